@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "CircularBufferSpiFlashRK.h"
+#include "SpiFlashTester.h"
+
+// Off-device benchmark. Build and run using: make bench
+//
+// Options:
+// --json    Output one JSON object per run (JSON Lines) instead of a table, for comparing across commits
+// --quick   Run a smaller matrix
+// --types   Compare reading one record type using readData(readInfo, typeMask) with reading all records
+// --file    Store the simulated flash in a memory-mapped sparse file instead of RAM, followed by the pathname
+//
+// Flash times are the simulated device times from SpiFlash (Winbond W25Q128JV timing by default), which
+// are a better indication of on-device performance than the wall-clock times on the host.
+
+const size_t flashSize = 256 * 1024 * 1024; // 256 MB, the largest buffer size in the matrix
+SpiFlash *spiFlash;
+
+const size_t benchSectorCount = 256; // 1 MB, used by benchTypes
+
+bool jsonOutput = false;
+
+/**
+ * @brief Latency samples for one operation type
+ */
+class LatencySamples {
+public:
+    void add(uint64_t wallNs, uint64_t flashNs) {
+        wall.push_back(wallNs);
+        flash.push_back(flashNs);
+    }
+
+    static uint64_t percentile(const std::vector<uint64_t> &samples, size_t pct) {
+        if (samples.empty()) {
+            return 0;
+        }
+        size_t index = samples.size() * pct / 100;
+        if (index >= samples.size()) {
+            index = samples.size() - 1;
+        }
+        return samples[index];
+    }
+
+    /**
+     * @brief Sorts the samples and calculates the percentiles
+     */
+    void calculate() {
+        std::sort(wall.begin(), wall.end());
+        std::sort(flash.begin(), flash.end());
+        wallP50 = percentile(wall, 50);
+        wallP99 = percentile(wall, 99);
+        wallMax = wall.empty() ? 0 : wall.back();
+        flashP50 = percentile(flash, 50);
+        flashP99 = percentile(flash, 99);
+        flashMax = flash.empty() ? 0 : flash.back();
+    }
+
+    void printJson(const char *name) const {
+        printf("\"%s\":{\"count\":%lu,\"p50Ns\":%llu,\"p99Ns\":%llu,\"maxNs\":%llu,\"flashP50Us\":%.1lf,\"flashP99Us\":%.1lf,\"flashMaxUs\":%.1lf}",
+            name, (unsigned long)wall.size(), (unsigned long long)wallP50, (unsigned long long)wallP99, (unsigned long long)wallMax,
+            (double)flashP50 / 1000.0, (double)flashP99 / 1000.0, (double)flashMax / 1000.0);
+    }
+
+    std::vector<uint64_t> wall;
+    std::vector<uint64_t> flash;
+    uint64_t wallP50 = 0, wallP99 = 0, wallMax = 0;
+    uint64_t flashP50 = 0, flashP99 = 0, flashMax = 0;
+};
+
+/**
+ * @brief Parameters for one run of the benchmark matrix
+ */
+struct BenchParams {
+    size_t recordSize; //!< Size of records written in bytes
+    size_t bufferSize; //!< Size of the circular buffer in bytes
+    double fill; //!< Fraction of the buffer filled with unread data before measuring (0.0 to 1.0)
+    double readRatio; //!< Records read per record written (1.0 = consumer keeps up, 0.0 = no consumer)
+    size_t writeCount; //!< Number of records written while measuring
+};
+
+/**
+ * @brief Results for one run of the benchmark matrix
+ */
+struct BenchResults {
+    LatencySamples write;
+    LatencySamples read;
+    LatencySamples markAsRead;
+    uint64_t wallNs = 0; //!< Wall-clock time for the writeData, readData, and markAsRead calls
+    uint64_t flashNs = 0; //!< Simulated flash time for the writeData, readData, and markAsRead calls
+    size_t readCount = 0;
+    uint64_t formatWallNs = 0;
+    uint64_t formatFlashNs = 0;
+    uint64_t loadWallNs = 0;
+    uint64_t loadFlashNs = 0;
+};
+
+static uint64_t nowNs() {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void benchRun(const BenchParams &params, BenchResults &results) {
+    static uint8_t buf[4096];
+    for(size_t ii = 0; ii < sizeof(buf); ii++) {
+        buf[ii] = (uint8_t) rand();
+    }
+
+    CircularBufferSpiFlashRK circBuffer(spiFlash, 0, params.bufferSize);
+
+    uint64_t startNs = nowNs();
+    uint64_t startFlashNs = spiFlash->getSimulatedNs();
+    circBuffer.format();
+    results.formatWallNs = nowNs() - startNs;
+    results.formatFlashNs = spiFlash->getSimulatedNs() - startFlashNs;
+
+    // Prefill with the largest records so large buffers fill quickly
+    if (params.fill > 0) {
+        CircularBufferSpiFlashRK::DataBuffer data(buf, circBuffer.getMaxRecordSize());
+        while(true) {
+            CircularBufferSpiFlashRK::UsageStats stats;
+            circBuffer.getUsageStats(stats);
+            if ((double)stats.dataSize >= params.fill * (double)params.bufferSize || stats.recordsLostToOverwrite) {
+                break;
+            }
+            circBuffer.writeData(data);
+        }
+    }
+
+    CircularBufferSpiFlashRK::DataBuffer data(buf, params.recordSize);
+    double readCredit = 0;
+
+    for(size_t ii = 0; ii < params.writeCount; ii++) {
+        startNs = nowNs();
+        startFlashNs = spiFlash->getSimulatedNs();
+        circBuffer.writeData(data);
+        results.write.add(nowNs() - startNs, spiFlash->getSimulatedNs() - startFlashNs);
+
+        readCredit += params.readRatio;
+        while(readCredit >= 1.0) {
+            readCredit -= 1.0;
+
+            CircularBufferSpiFlashRK::ReadInfo readInfo;
+            startNs = nowNs();
+            startFlashNs = spiFlash->getSimulatedNs();
+            bool bResult = circBuffer.readData(readInfo);
+            results.read.add(nowNs() - startNs, spiFlash->getSimulatedNs() - startFlashNs);
+            if (!bResult) {
+                break;
+            }
+            results.readCount++;
+
+            startNs = nowNs();
+            startFlashNs = spiFlash->getSimulatedNs();
+            circBuffer.markAsRead(readInfo);
+            results.markAsRead.add(nowNs() - startNs, spiFlash->getSimulatedNs() - startFlashNs);
+        }
+    }
+
+    startNs = nowNs();
+    startFlashNs = spiFlash->getSimulatedNs();
+    circBuffer.load();
+    results.loadWallNs = nowNs() - startNs;
+    results.loadFlashNs = spiFlash->getSimulatedNs() - startFlashNs;
+
+    for(LatencySamples *samples : { &results.write, &results.read, &results.markAsRead }) {
+        for(uint64_t ns : samples->wall) {
+            results.wallNs += ns;
+        }
+        for(uint64_t ns : samples->flash) {
+            results.flashNs += ns;
+        }
+        samples->calculate();
+    }
+}
+
+void benchPrintHeader() {
+    if (!jsonOutput) {
+        printf("%6s %10s %4s %5s %10s %11s | %-26s | %-26s | %-26s | %10s\n",
+            "record", "buffer", "fill", "ratio", "records/s", "flash rec/s",
+            "write flash us p50/p99/max", "read flash us p50/p99/max", "mark flash us p50/p99/max", "load ms");
+    }
+}
+
+void benchPrintResults(const BenchParams &params, BenchResults &results) {
+    double recordsPerSec = (results.wallNs > 0) ? ((double)params.writeCount * 1e9 / (double)results.wallNs) : 0;
+    double flashRecordsPerSec = (results.flashNs > 0) ? ((double)params.writeCount * 1e9 / (double)results.flashNs) : 0;
+
+    if (jsonOutput) {
+        printf("{\"bench\":\"matrix\",\"flash\":\"%s\",\"recordSize\":%lu,\"bufferSize\":%lu,\"fill\":%.2lf,\"readRatio\":%.2lf,\"writes\":%lu,\"reads\":%lu,"
+            "\"wallUs\":%llu,\"recordsPerSec\":%.0lf,\"flashUs\":%llu,\"flashRecordsPerSec\":%.0lf,",
+            spiFlash->timing.name, (unsigned long)params.recordSize, (unsigned long)params.bufferSize, params.fill, params.readRatio,
+            (unsigned long)params.writeCount, (unsigned long)results.readCount,
+            (unsigned long long)(results.wallNs / 1000), recordsPerSec, (unsigned long long)(results.flashNs / 1000), flashRecordsPerSec);
+        results.write.printJson("writeData");
+        printf(",");
+        results.read.printJson("readData");
+        printf(",");
+        results.markAsRead.printJson("markAsRead");
+        printf(",\"formatUs\":%llu,\"formatFlashUs\":%llu,\"loadUs\":%llu,\"loadFlashUs\":%llu}\n",
+            (unsigned long long)(results.formatWallNs / 1000), (unsigned long long)(results.formatFlashNs / 1000),
+            (unsigned long long)(results.loadWallNs / 1000), (unsigned long long)(results.loadFlashNs / 1000));
+    }
+    else {
+        char writeStr[48], readStr[48], markStr[48];
+        snprintf(writeStr, sizeof(writeStr), "%.0lf/%.0lf/%.0lf", results.write.flashP50 / 1000.0, results.write.flashP99 / 1000.0, results.write.flashMax / 1000.0);
+        snprintf(readStr, sizeof(readStr), "%.0lf/%.0lf/%.0lf", results.read.flashP50 / 1000.0, results.read.flashP99 / 1000.0, results.read.flashMax / 1000.0);
+        snprintf(markStr, sizeof(markStr), "%.0lf/%.0lf/%.0lf", results.markAsRead.flashP50 / 1000.0, results.markAsRead.flashP99 / 1000.0, results.markAsRead.flashMax / 1000.0);
+
+        printf("%6lu %10lu %4.2lf %5.2lf %10.0lf %11.0lf | %-26s | %-26s | %-26s | %10.1lf\n",
+            (unsigned long)params.recordSize, (unsigned long)params.bufferSize, params.fill, params.readRatio, recordsPerSec, flashRecordsPerSec,
+            writeStr, readStr, markStr, (double)results.loadFlashNs / 1e6);
+    }
+    fflush(stdout);
+}
+
+void benchMatrix(bool quick) {
+    std::vector<size_t> recordSizes = { 8, 64, 512, 2048, 4076 }; // 4076 is the largest record in a 4096 byte sector
+    std::vector<size_t> bufferSizes = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024 };
+    std::vector<double> fills = { 0.0, 0.5, 0.9 };
+    std::vector<double> readRatios = { 1.0, 0.5, 0.0 };
+    size_t writeCount = 2000;
+
+    if (quick) {
+        recordSizes = { 8, 512, 4076 };
+        bufferSizes = { 64 * 1024, 16 * 1024 * 1024 };
+        fills = { 0.0, 0.9 };
+        readRatios = { 1.0, 0.0 };
+        writeCount = 500;
+    }
+
+    benchPrintHeader();
+
+    for(size_t recordSize : recordSizes) {
+        for(size_t bufferSize : bufferSizes) {
+            for(double fill : fills) {
+                for(double readRatio : readRatios) {
+                    BenchParams params = { recordSize, bufferSize, fill, readRatio, writeCount };
+                    BenchResults results;
+                    benchRun(params, results);
+                    benchPrintResults(params, results);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Write a mixed workload of record types, then read only type 3 or all records after reloading
+ * 
+ * @param workload "interleaved" (type 3 is 5% of records, spread evenly) or "bursty" (type 3 records
+ * are written in bursts, so most sectors don't contain any)
+ * @param filtered true to read using readData(readInfo, 1 << 3), false to read every record and check its type
+ */
+void benchTypesRun(const char *workload, bool filtered) {
+    const size_t recordCount = 10000;
+    bool bursty = strcmp(workload, "bursty") == 0;
+
+    // Same records for each mode
+    srand(0);
+
+    uint8_t buf[128];
+    for(size_t ii = 0; ii < sizeof(buf); ii++) {
+        buf[ii] = (uint8_t) rand();
+    }
+
+    CircularBufferSpiFlashRK circBuffer(spiFlash, 0, benchSectorCount * 4096);
+    circBuffer.format();
+
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        // 70% type 1 (telemetry), 25% type 2 (logs), 5% type 3 (events)
+        uint8_t type;
+        if (bursty) {
+            type = ((ii % 2000) < 100) ? 3 : (((ii % 4) == 0) ? 2 : 1);
+        }
+        else {
+            int r = rand() % 100;
+            type = (r < 5) ? 3 : ((r < 30) ? 2 : 1);
+        }
+        CircularBufferSpiFlashRK::DataBuffer data(buf, 16 + rand() % 112);
+        circBuffer.writeTypedData(type, data);
+    }
+
+    // Reload so the sector cache is empty, as it would be after a reset
+    circBuffer.load();
+
+    spiFlash->resetCounters();
+    uint64_t startNs = nowNs();
+    size_t returned = 0;
+
+    CircularBufferSpiFlashRK::ReadInfo readInfo;
+    if (filtered) {
+        while(circBuffer.readData(readInfo, 1 << 3)) {
+            returned++;
+            circBuffer.markAsRead(readInfo);
+        }
+    }
+    else {
+        while(circBuffer.readData(readInfo)) {
+            if (readInfo.getType() == 3) {
+                returned++;
+            }
+            circBuffer.markAsRead(readInfo);
+        }
+    }
+    uint64_t wallUs = (nowNs() - startNs) / 1000;
+
+    const char *mode = filtered ? "typeMask" : "all";
+    if (jsonOutput) {
+        printf("{\"bench\":\"types\",\"flash\":\"%s\",\"workload\":\"%s\",\"mode\":\"%s\",\"records\":%lu,\"returned\":%lu,\"reads\":%lu,\"readBytes\":%lu,"
+            "\"readUs\":%llu,\"flashUs\":%llu,\"wallUs\":%llu}\n",
+            spiFlash->timing.name, workload, mode, (unsigned long)recordCount, (unsigned long)returned, 
+            (unsigned long)spiFlash->readCount, (unsigned long)spiFlash->readByteCount,
+            (unsigned long long)(spiFlash->readNs / 1000), (unsigned long long)(spiFlash->getSimulatedNs() / 1000), (unsigned long long)wallUs);
+    }
+    else {
+        printf("%-12s %-8s records=%6lu returned=%5lu reads=%6lu readBytes=%8lu readUs=%8llu flashUs=%8llu\n",
+            workload, mode, (unsigned long)recordCount, (unsigned long)returned, 
+            (unsigned long)spiFlash->readCount, (unsigned long)spiFlash->readByteCount,
+            (unsigned long long)(spiFlash->readNs / 1000), (unsigned long long)(spiFlash->getSimulatedNs() / 1000));
+    }
+    fflush(stdout);
+}
+
+void benchTypes() {
+    const char *workloads[] = { "interleaved", "bursty" };
+
+    for(const char *workload : workloads) {
+        benchTypesRun(workload, false);
+        benchTypesRun(workload, true);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    bool quick = false;
+    bool types = false;
+    const char *path = nullptr;
+
+    for(int ii = 1; ii < argc; ii++) {
+        if (strcmp(argv[ii], "--json") == 0) {
+            jsonOutput = true;
+        }
+        else
+        if (strcmp(argv[ii], "--quick") == 0) {
+            quick = true;
+        }
+        else
+        if (strcmp(argv[ii], "--types") == 0) {
+            types = true;
+        }
+        else
+        if (strcmp(argv[ii], "--file") == 0 && (ii + 1) < argc) {
+            path = argv[++ii];
+        }
+        else {
+            fprintf(stderr, "usage: %s [--json] [--quick] [--types] [--file path]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Allocated on the heap because the largest buffer in the matrix is 256 MB
+    uint8_t *flashBuffer = nullptr;
+    if (path) {
+        spiFlash = new SpiFlash(path, flashSize);
+        if (!spiFlash->isValid()) {
+            fprintf(stderr, "could not create %s\n", path);
+            return 1;
+        }
+    }
+    else {
+        flashBuffer = new uint8_t[flashSize];
+        spiFlash = new SpiFlash(flashBuffer, flashSize);
+    }
+    spiFlash->begin();
+
+    if (types) {
+        benchTypes();
+    }
+    else {
+        benchMatrix(quick);
+    }
+
+    delete spiFlash;
+    delete[] flashBuffer;
+
+    return 0;
+}
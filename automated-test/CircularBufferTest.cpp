@@ -1,4 +1,7 @@
 #include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
 #include "CircularBufferSpiFlashRK.h"
 #include "SpiFlashTester.h"
 #include "CircularBufferSpiFlashRK_AutomatedTest.h"
@@ -349,6 +352,21 @@ void testUnitWrap(std::vector<String> &testSet) {
 
 }
 
+void checkUsageStatsAfterLoad(CircularBufferSpiFlashRK &circBuffer) {
+    // The incrementally updated stats must match the stats calculated by load
+    CircularBufferSpiFlashRK::UsageStats stats, loadStats;
+    assert(circBuffer.getUsageStats(stats));
+    assert(circBuffer.load());
+    assert(circBuffer.getUsageStats(loadStats));
+
+    if (stats.recordCount != loadStats.recordCount || stats.dataSize != loadStats.dataSize || stats.freeSectors != loadStats.freeSectors || 
+        stats.bytesUntilOverwrite != loadStats.bytesUntilOverwrite || stats.oldestSequence != loadStats.oldestSequence || stats.newestSequence != loadStats.newestSequence) {
+        stats.log(LOG_LEVEL_INFO, "incremental");
+        loadStats.log(LOG_LEVEL_INFO, "load");
+        assert(false);
+    }
+}
+
 void testUsageStats(std::vector<String> &testSet) {
     const uint16_t sectorCount = 100; // 409,600 bytes
 
@@ -397,6 +415,7 @@ void testUsageStats(std::vector<String> &testSet) {
         printf("testUsageStats freeSectors got=%d expected not=%d\n", (int) stats.freeSectors, (int) sectorCount );
         assert(false);
     }
+    checkUsageStatsAfterLoad(circBuffer);
 
     
     CircularBufferSpiFlashRK::ReadInfo readInfo;
@@ -432,23 +451,2089 @@ void testUsageStats(std::vector<String> &testSet) {
 
 }
 
-void runUnitTests() {
-    // Local unit tests only used off-device 
+void testUsageStatsOverwrite(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 16;
 
-    // generateRandomStrings();
-    readRandomStrings();
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+    assert(circBuffer.format());
 
-    testDataBuffer();
-    
-    testUnitSectorAppend(randomStringSmall);
-    testUnitSectorAppend(randomString1024);
+    CircularBufferSpiFlashRK::UsageStats stats;
+    assert(circBuffer.getUsageStats(stats));
+    assert(stats.freeSectors == sectorCount);
+    assert(stats.bytesUntilOverwrite == sectorCount * (4096 - sizeof(CircularBufferSpiFlashRK::SectorHeader)));
+    assert(stats.recordsLostToOverwrite == 0);
 
-    testUnitReadWrite(randomStringSmall);
+    int stringCount = testSet.size();
+    size_t writeIndex = 0;
+    size_t readCount = 0;
 
-    
-    testUnitWrap(randomString1024);
+    // Fill without reading until records are overwritten
+    size_t lastBytesUntilOverwrite = stats.bytesUntilOverwrite;
+    while(true) {
+        const String &str = testSet.at(writeIndex++ % stringCount);
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(str.c_str());
+        assert(circBuffer.writeData(origBuffer));
 
-    testUsageStats(randomStringSmall);
+        assert(circBuffer.getUsageStats(stats));
+        if (stats.recordsLostToOverwrite) {
+            break;
+        }
+        assert(stats.bytesUntilOverwrite < lastBytesUntilOverwrite);
+        lastBytesUntilOverwrite = stats.bytesUntilOverwrite;
+    }
+    assert(stats.freeSectors == 1);
+    assert(stats.recordCount + stats.recordsLostToOverwrite == writeIndex);
+    assert(stats.newestSequence - stats.oldestSequence == sectorCount - 1);
+
+    // Read some, including past the first sector
+    for(size_t ii = 0; ii < 20; ii++) {
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(circBuffer.readData(readInfo));
+        assert(circBuffer.markAsRead(readInfo));
+        readCount++;
+    }
+    assert(circBuffer.getUsageStats(stats));
+    assert(stats.recordCount + stats.recordsLostToOverwrite + readCount == writeIndex);
+    assert(stats.freeSectors > 1);
+
+    checkUsageStatsAfterLoad(circBuffer);
+
+    // Abandoned and aborted records are not counted
+    {
+        CircularBufferSpiFlashRK::RecordWriter writer;
+        assert(circBuffer.openRecord(writer, 100));
+        assert(writer.append("abc", 4));
+        assert(writer.abort());
+    }
+    checkUsageStatsAfterLoad(circBuffer);
+
+    while(true) {
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        if (!circBuffer.readData(readInfo)) {
+            break;
+        }
+        assert(circBuffer.markAsRead(readInfo));
+    }
+    assert(circBuffer.getUsageStats(stats));
+    assert(stats.recordCount == 0);
+    assert(stats.dataSize == 0);
+
+    checkUsageStatsAfterLoad(circBuffer);
+}
+
+// Only has the erase methods of the real SpiFlashRK class
+class SpiFlashRKEraseApi {
+public:
+    void sectorErase(size_t addr) { sectorEraseCount++; };
+    void blockErase(size_t addr) { blockEraseCount++; };
+
+    size_t sectorEraseCount = 0;
+    size_t blockEraseCount = 0;
+};
+
+// Does not have a block erase
+class SpiFlashSectorEraseOnly {
+public:
+    void sectorErase(size_t addr) {};
+};
+
+void testBlockErase() {
+    // 64K block erase is detected using the SpiFlashRK method name
+    SpiFlashRKEraseApi spiFlashRK;
+    assert(CircularBufferSpiFlashRK::blockErase64K(&spiFlashRK, 65536, 0));
+    assert(spiFlashRK.blockEraseCount == 1);
+    assert(spiFlashRK.sectorEraseCount == 0);
+
+    SpiFlashSectorEraseOnly sectorEraseOnly;
+    assert(!CircularBufferSpiFlashRK::blockErase64K(&sectorEraseOnly, 65536, 0));
+
+    // Without withBlockErase32K(), a 32K sector is erased 4K at a time
+    const size_t sectorCount = 4;
+    size_t sectorEraseCount = spiFlash.sectorEraseCount;
+    size_t blockErase32KCount = spiFlash.blockErase32KCount;
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 32768, 32768);
+    assert(circBuffer.format());
+    assert(spiFlash.sectorEraseCount - sectorEraseCount == sectorCount * 8);
+    assert(spiFlash.blockErase32KCount == blockErase32KCount);
+}
+
+void testLargeSectors(size_t sectorSize) {
+    const size_t sectorCount = 32;
+    const size_t testCount = 500;
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * sectorSize, sectorSize);
+    circBuffer.withBlockErase32K([](size_t addr) { spiFlash.blockErase32K(addr); });
+    assert(circBuffer.getSectorSize() == sectorSize);
+    assert(circBuffer.getMaxRecordSize() == sectorSize - 20);
+
+    size_t sectorEraseCount = spiFlash.sectorEraseCount;
+    size_t blockErase32KCount = spiFlash.blockErase32KCount;
+    size_t blockErase64KCount = spiFlash.blockErase64KCount;
+
+    assert(circBuffer.format());
+
+    // Each logical sector is erased with a single erase command of the matching size
+    if (sectorSize == 65536) {
+        assert(spiFlash.blockErase64KCount - blockErase64KCount == sectorCount);
+    }
+    else
+    if (sectorSize == 32768) {
+        assert(spiFlash.blockErase32KCount - blockErase32KCount == sectorCount);
+    }
+    else {
+        assert(spiFlash.sectorEraseCount - sectorEraseCount == sectorCount);
+    }
+
+    // Records larger than the sector cannot be written
+    {
+        CircularBufferSpiFlashRK::DataBuffer tooLarge(nullptr, circBuffer.getMaxRecordSize() + 1);
+        assert(!circBuffer.writeData(tooLarge));
+    }
+
+    std::deque<CircularBufferSpiFlashRK::DataBuffer> expected;
+
+    for(size_t testNum = 0; testNum < testCount; testNum++) {
+        int numToWrite = rand() % 8;
+        for(int ii = 0; ii < numToWrite; ii++) {
+            size_t len;
+            switch(rand() % 8) {
+                case 0:
+                    len = circBuffer.getMaxRecordSize();
+                    break;
+                case 1:
+                    len = 4096 + rand() % 8192;
+                    break;
+                default:
+                    len = 1 + rand() % 512;
+                    break;
+            }
+            if (len > circBuffer.getMaxRecordSize()) {
+                len = circBuffer.getMaxRecordSize();
+            }
+
+            CircularBufferSpiFlashRK::DataBuffer data;
+            uint8_t *p = data.allocate(len);
+            for(size_t jj = 0; jj < len; jj++) {
+                p[jj] = (uint8_t) rand();
+            }
+            assert(circBuffer.writeData(data));
+            expected.push_back(data);
+        }
+
+        int numToRead = rand() % 10;
+        for(int ii = 0; ii < numToRead && !expected.empty(); ii++) {
+            CircularBufferSpiFlashRK::ReadInfo readInfo;
+            assert(circBuffer.readData(readInfo));
+            assert(circBuffer.markAsRead(readInfo));
+
+            if (!(readInfo == expected.front())) {
+                printf("testLargeSectors sectorSize=%d testNum=%d got size=%d exp size=%d\n", (int)sectorSize, (int)testNum, (int)readInfo.size(), (int)expected.front().size());
+                assert(false);
+            }
+            expected.pop_front();
+        }
+    }
+
+    // Validate that completed buffer can be loaded again
+    assert(circBuffer.load());
+
+    if (sectorSize != 4096) {
+        // Loading with a different sector size fails instead of misinterpreting the data
+        CircularBufferSpiFlashRK circBuffer4K(&spiFlash, 0, sectorCount * sectorSize);
+        assert(!circBuffer4K.load());
+    }
+}
+
+void testLargeChip(std::vector<String> &testSet) {
+    // 1 GB chip in a sparse file. With 4096 byte sectors this is 262144 sectors, which
+    // requires 32-bit sector numbers.
+    const size_t largeFlashSize = 1024 * 1024 * 1024;
+    const char *path = "test01/largeChip.bin";
+
+    {
+        SpiFlash largeFlash(path, largeFlashSize);
+        assert(largeFlash.isValid());
+
+        CircularBufferSpiFlashRK circBuffer(&largeFlash, 0, largeFlashSize);
+        const uint32_t sectorCount = (uint32_t) circBuffer.getSectorCount();
+        assert(sectorCount == 262144);
+
+        // Instead of format(), write the sector headers so the oldest sector is near the end of the buffer. 
+        // This exercises sector numbers above 65535 and wrapping to sector 0 without writing 1 GB of data first.
+        // The sparse file starts out erased.
+        const uint32_t startSectorNum = sectorCount - 8;
+        for(uint32_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
+            circBuffer.writeSectorHeader(sectorNum, false /* erase */, 1 + (sectorNum + sectorCount - startSectorNum) % sectorCount);
+        }
+        assert(circBuffer.load());
+
+        int stringCount = testSet.size();
+        int writeIndex = 0;
+        int readIndex = 0;
+        size_t dataSize = 0;
+
+        // About 20 sectors of data, so it wraps from the last sector to sector 0
+        while(dataSize < 20 * 4096) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(writeIndex++ % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer));
+            dataSize += origBuffer.size();
+        }
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordCount == (size_t)writeIndex);
+        assert(stats.dataSize == dataSize);
+
+        // Reload from flash
+        assert(circBuffer.load());
+
+        bool sawHighSector = false;
+        bool sawLowSector = false;
+        while(true) {
+            CircularBufferSpiFlashRK::ReadInfo readInfo;
+            if (!circBuffer.readData(readInfo)) {
+                break;
+            }
+            if (readInfo.sectorNum >= startSectorNum) {
+                sawHighSector = true;
+            }
+            else {
+                // Wrapped around
+                assert(readInfo.sectorNum < 32);
+                sawLowSector = true;
+            }
+            assert(circBuffer.markAsRead(readInfo));
+
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(readIndex++ % stringCount).c_str());
+            if (strcmp(origBuffer.c_str(), readInfo.c_str()) != 0) {
+                printf("testLargeChip readIndex=%d sectorNum=%d\n", readIndex, (int)readInfo.sectorNum);
+                assert(false);
+            }
+        }
+        assert(readIndex == writeIndex);
+        assert(sawHighSector && sawLowSector);
+
+        assert(circBuffer.load());
+    }
+
+    {
+        // Reopen the existing sparse file, everything was read
+        SpiFlash largeFlash(path, 0, SpiFlash::FileMode::OPEN_SPARSE);
+        assert(largeFlash.isValid());
+        assert(largeFlash.size == largeFlashSize);
+
+        CircularBufferSpiFlashRK circBuffer(&largeFlash, 0, largeFlashSize);
+        assert(circBuffer.load());
+
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(!circBuffer.readData(readInfo));
+    }
+
+    unlink(path);
+}
+
+void testWriteBuffering(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t recordCount = 2000;
+
+    int stringCount = testSet.size();
+    size_t pageProgramCount[2];
+
+    for(int buffering = 0; buffering < 2; buffering++) {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withWriteBuffering(buffering != 0);
+        assert(circBuffer.format());
+
+        size_t startCount = spiFlash.pageProgramCount;
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer));
+        }
+        pageProgramCount[buffering] = spiFlash.pageProgramCount - startCount;
+
+        // Records are readable whether they are still buffered or not
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::ReadInfo readInfo;
+            assert(circBuffer.readData(readInfo));
+            assert(circBuffer.markAsRead(readInfo));
+            if (strcmp(readInfo.c_str(), testSet.at(ii % stringCount).c_str()) != 0) {
+                printf("testWriteBuffering buffering=%d ii=%d\n", buffering, (int)ii);
+                assert(false);
+            }
+        }
+        assert(circBuffer.load());
+    }
+    printf("testWriteBuffering pageProgramCount unbuffered=%d buffered=%d\n", (int)pageProgramCount[0], (int)pageProgramCount[1]);
+    assert(pageProgramCount[1] < pageProgramCount[0] / 2);
+
+    // Buffered records are only in flash after a durability point
+    {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withWriteBuffering();
+        assert(circBuffer.format());
+
+        CircularBufferSpiFlashRK::DataBuffer origBuffer("a");
+        assert(circBuffer.writeData(origBuffer));
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        {
+            CircularBufferSpiFlashRK otherBuffer(&spiFlash, 0, sectorCount * 4096);
+            assert(otherBuffer.load());
+            assert(otherBuffer.getUsageStats(stats));
+            assert(stats.recordCount == 0);
+        }
+
+        assert(circBuffer.flush());
+        {
+            CircularBufferSpiFlashRK otherBuffer(&spiFlash, 0, sectorCount * 4096);
+            assert(otherBuffer.load());
+            assert(otherBuffer.getUsageStats(stats));
+            assert(stats.recordCount == 1);
+        }
+    }
+}
+
+void testTailCache(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t testCount = 2000;
+
+    int stringCount = testSet.size();
+    size_t readCount[2];
+
+    for(int cache = 0; cache < 2; cache++) {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        if (cache) {
+            circBuffer.withTailCache(4096).withWriteBuffering();
+        }
+        assert(circBuffer.format());
+
+        int writeIndex = 0;
+        int readIndex = 0;
+
+        // Consumer keeps up with the producer, so reads are mostly of recently written data
+        size_t startCount = spiFlash.readCount;
+        for(size_t testNum = 0; testNum < testCount; testNum++) {
+            int numToWrite = rand() % 3;
+            for(int ii = 0; ii < numToWrite; ii++) {
+                CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(writeIndex++ % stringCount).c_str());
+                assert(circBuffer.writeData(origBuffer));
+            }
+            while(readIndex < writeIndex) {
+                CircularBufferSpiFlashRK::ReadInfo readInfo;
+                assert(circBuffer.readData(readInfo));
+                assert(circBuffer.markAsRead(readInfo));
+                if (strcmp(readInfo.c_str(), testSet.at(readIndex++ % stringCount).c_str()) != 0) {
+                    printf("testTailCache cache=%d testNum=%d\n", cache, (int)testNum);
+                    assert(false);
+                }
+            }
+        }
+        readCount[cache] = spiFlash.readCount - startCount;
+
+        assert(circBuffer.load());
+    }
+    printf("testTailCache readCount uncached=%d cached=%d\n", (int)readCount[0], (int)readCount[1]);
+    assert(readCount[1] < readCount[0] / 4);
+}
+
+void testReadAhead(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t recordCount = 2000;
+
+    int stringCount = testSet.size();
+    size_t readCount[2];
+
+    for(int readAhead = 0; readAhead < 2; readAhead++) {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        if (readAhead) {
+            circBuffer.withReadAhead(16);
+        }
+        assert(circBuffer.format());
+
+        // Build a backlog, then drain it
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer));
+        }
+
+        size_t startCount = spiFlash.readCount;
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::ReadInfo readInfo;
+            assert(circBuffer.readData(readInfo));
+            assert(circBuffer.markAsRead(readInfo));
+            if (strcmp(readInfo.c_str(), testSet.at(ii % stringCount).c_str()) != 0) {
+                printf("testReadAhead readAhead=%d ii=%d\n", readAhead, (int)ii);
+                assert(false);
+            }
+        }
+        readCount[readAhead] = spiFlash.readCount - startCount;
+
+        CircularBufferSpiFlashRK::ReadAheadStats stats;
+        assert(circBuffer.getReadAheadStats(stats));
+        if (readAhead) {
+            stats.log(LOG_LEVEL_INFO, "testReadAhead");
+            assert(stats.hits + stats.misses == recordCount);
+            assert(stats.hits > stats.misses * 8);
+        }
+        else {
+            assert(stats.hits == 0 && stats.misses == 0);
+        }
+
+        assert(circBuffer.load());
+    }
+    printf("testReadAhead readCount noReadAhead=%d readAhead=%d\n", (int)readCount[0], (int)readCount[1]);
+    assert(readCount[1] < readCount[0]);
+
+    {
+        // READ_AHEAD_REST_OF_SECTOR prefetches the rest of the sector when the miss is not at index 0
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withReadAhead(CircularBufferSpiFlashRK::READ_AHEAD_REST_OF_SECTOR);
+        assert(circBuffer.format());
+
+        const size_t sectorRecords = 10;
+        char buf[16];
+        for(size_t ii = 0; ii < sectorRecords; ii++) {
+            snprintf(buf, sizeof(buf), "record %d", (int)ii);
+            assert(circBuffer.writeData(buf));
+        }
+
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.equals("record 0"));
+        assert(circBuffer.markAsRead(readInfo));
+
+        // Clears the read ahead buffer so the next read is a miss at index 1
+        assert(circBuffer.load());
+
+        CircularBufferSpiFlashRK::ReadAheadStats stats1, stats2;
+        assert(circBuffer.getReadAheadStats(stats1));
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.equals("record 1"));
+        assert(readInfo.index == 1);
+        assert(circBuffer.getReadAheadStats(stats2));
+
+        // Records 1 - 9 are 9 bytes each, including the null terminator, with a RecordCommon between them
+        size_t expectedLen = (sectorRecords - 1) * 9 + (sectorRecords - 2) * sizeof(CircularBufferSpiFlashRK::RecordCommon);
+        assert(stats2.misses == stats1.misses + 1);
+        assert(stats2.bytesRead - stats1.bytesRead == expectedLen);
+
+        for(size_t ii = 1; ii < sectorRecords; ii++) {
+            assert(circBuffer.readData(readInfo));
+            snprintf(buf, sizeof(buf), "record %d", (int)ii);
+            assert(readInfo.equals(buf));
+            assert(circBuffer.markAsRead(readInfo));
+        }
+        assert(circBuffer.getReadAheadStats(stats1));
+        assert(stats1.misses == stats2.misses);
+    }
+}
+
+void testReadIntoBuffer(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t recordCount = 300;
+
+    int stringCount = testSet.size();
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+    assert(circBuffer.format());
+
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeData(origBuffer));
+    }
+
+    size_t readIndex = 0;
+    while(readIndex < recordCount) {
+        const String &expected = testSet.at(readIndex % stringCount);
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+
+        switch(readIndex % 3) {
+            case 0: {
+                // Caller provided buffer
+                char buf[1100];
+                assert(circBuffer.readData(readInfo, buf, sizeof(buf)));
+                assert(readInfo.size() == 0);
+                assert(readInfo.recordCommon.size == expected.length() + 1);
+                assert(strcmp(buf, expected.c_str()) == 0);
+                break;
+            }
+            case 1: {
+                // Buffer too small, only the beginning is copied
+                char buf[8];
+                memset(buf, 0, sizeof(buf));
+                assert(circBuffer.readData(readInfo, buf, sizeof(buf) - 1));
+                assert(readInfo.recordCommon.size == expected.length() + 1);
+                assert(strncmp(buf, expected.c_str(), sizeof(buf) - 1) == 0);
+                break;
+            }
+            default: {
+                // Streaming in chunks
+                uint8_t chunkBuf[50];
+                std::string result;
+                size_t expectedOffset = 0;
+                bool bResult = circBuffer.readDataStream(readInfo, chunkBuf, sizeof(chunkBuf), [&](const uint8_t *data, size_t dataOffset, size_t len) {
+                    assert(dataOffset == expectedOffset);
+                    assert(len <= sizeof(chunkBuf));
+                    expectedOffset += len;
+                    result.append((const char *)data, len);
+                    return true;
+                });
+                assert(bResult);
+                assert(expectedOffset == readInfo.recordCommon.size);
+                assert(strcmp(result.c_str(), expected.c_str()) == 0);
+                break;
+            }
+        }
+        assert(circBuffer.markAsRead(readInfo));
+        readIndex++;
+    }
+
+    CircularBufferSpiFlashRK::ReadInfo readInfo;
+    char buf[16];
+    assert(!circBuffer.readData(readInfo, buf, sizeof(buf)));
+
+    assert(circBuffer.load());
+}
+
+void testRecordWriter(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t recordCount = 200;
+
+    int stringCount = testSet.size();
+
+    {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        assert(circBuffer.format());
+
+        // Records written in pieces, every fifth one aborted
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            const String &str = testSet.at(ii % stringCount);
+
+            CircularBufferSpiFlashRK::RecordWriter writer;
+            assert(circBuffer.openRecord(writer, str.length() + 1));
+            assert(writer.isOpen());
+
+            // writeData is not allowed while a record is open
+            CircularBufferSpiFlashRK::DataBuffer tempBuffer("x");
+            assert(!circBuffer.writeData(tempBuffer));
+
+            size_t len = str.length() + 1;
+            size_t half = len / 2;
+            assert(writer.append(str.c_str(), half));
+            assert(writer.append(str.c_str() + half, len - half));
+            assert(writer.getSize() == len);
+            
+            // Can't exceed the reserved size
+            assert(!writer.append("x", 1));
+
+            if ((ii % 5) == 4) {
+                assert(writer.abort());
+            }
+            else {
+                assert(writer.commit());
+            }
+            assert(!writer.isOpen());
+        }
+
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            if ((ii % 5) == 4) {
+                continue;
+            }
+            CircularBufferSpiFlashRK::ReadInfo readInfo;
+            assert(circBuffer.readData(readInfo));
+            assert(strcmp(readInfo.c_str(), testSet.at(ii % stringCount).c_str()) == 0);
+            assert(circBuffer.markAsRead(readInfo));
+        }
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(!circBuffer.readData(readInfo));
+
+        // Destroying an open writer aborts the record
+        {
+            CircularBufferSpiFlashRK::RecordWriter writer;
+            assert(circBuffer.openRecord(writer, 100));
+            assert(writer.append("abc", 4));
+        }
+        CircularBufferSpiFlashRK::DataBuffer origBuffer("after");
+        assert(circBuffer.writeData(origBuffer));
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.equals("after"));
+        assert(circBuffer.markAsRead(readInfo));
+
+        CircularBufferSpiFlashRK::UsageStats usageStats;
+        assert(circBuffer.getUsageStats(usageStats));
+        assert(usageStats.recordCount == 0);
+    }
+
+    {
+        // Simulate a reset while a record is open
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        assert(circBuffer.format());
+
+        CircularBufferSpiFlashRK::DataBuffer origBuffer("before");
+        assert(circBuffer.writeData(origBuffer));
+
+        CircularBufferSpiFlashRK::RecordWriter writer;
+        assert(circBuffer.openRecord(writer, 1000));
+        assert(writer.append(testSet.at(0).c_str(), testSet.at(0).length()));
+        circBuffer.flush();
+
+        // Discard the writer without committing or aborting
+        writer.circBuffer = nullptr;
+
+        CircularBufferSpiFlashRK circBuffer2(&spiFlash, 0, sectorCount * 4096);
+        assert(circBuffer2.load());
+
+        origBuffer.copy("after");
+        assert(circBuffer2.writeData(origBuffer));
+
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(circBuffer2.readData(readInfo));
+        assert(readInfo.equals("before"));
+        assert(circBuffer2.markAsRead(readInfo));
+
+        // The incomplete record is skipped and "after" was written to the next sector
+        assert(circBuffer2.readData(readInfo));
+        assert(readInfo.equals("after"));
+        assert(readInfo.sectorNum == 1);
+        assert(circBuffer2.markAsRead(readInfo));
+
+        assert(!circBuffer2.readData(readInfo));
+        assert(circBuffer2.load());
+    }
+
+    {
+        // The lock is not held while the record is open, so reads continue and the writer can be used from another thread
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        assert(circBuffer.format());
+
+        assert(circBuffer.writeData("first"));
+
+        CircularBufferSpiFlashRK::RecordWriter writer;
+        assert(circBuffer.openRecord(writer, 1000));
+        assert(writer.append("abc", 3));
+
+        // Other writers fail fast instead of blocking
+        assert(!circBuffer.writeData("second"));
+        assert(!circBuffer.load());
+        assert(!circBuffer.format());
+
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.equals("first"));
+        assert(circBuffer.markAsRead(readInfo));
+        assert(!circBuffer.readData(readInfo));
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        circBuffer.getUsageStats(stats);
+        assert(stats.recordCount == 0);
+
+        // The write sector is indexed again while the record is open
+        circBuffer.clearCache();
+
+        bool appendResult = false;
+        bool commitResult = false;
+        std::thread otherThread([&]() {
+            appendResult = writer.append("def", 4);
+            commitResult = writer.commit();
+        });
+        otherThread.join();
+        assert(appendResult);
+        assert(commitResult);
+        assert(!writer.isOpen());
+
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.equals("abcdef"));
+        uint32_t sectorNum = readInfo.sectorNum;
+        assert(circBuffer.markAsRead(readInfo));
+
+        // Writing continues in the same sector after the committed record
+        assert(circBuffer.writeData("second"));
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.equals("second"));
+        assert(readInfo.sectorNum == sectorNum);
+        assert(circBuffer.markAsRead(readInfo));
+
+        assert(circBuffer.load());
+        assert(!circBuffer.readData(readInfo));
+    }
+}
+
+void testMetrics(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 16;
+    const size_t recordCount = 100;
+
+    int stringCount = testSet.size();
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+    assert(circBuffer.format());
+
+    CircularBufferSpiFlashRK::Metrics metrics;
+#if CIRCULARBUFFERSPIFLASHRK_METRICS
+    circBuffer.resetMetrics();
+    assert(circBuffer.getMetrics(metrics));
+    assert(metrics.ops[CircularBufferSpiFlashRK::Metrics::OP_WRITE].calls == 0);
+
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeData(origBuffer));
+    }
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(circBuffer.readData(readInfo));
+        assert(circBuffer.markAsRead(readInfo));
+    }
+
+    assert(circBuffer.getMetrics(metrics));
+    metrics.log(LOG_LEVEL_TRACE, "testMetrics");
+
+    const CircularBufferSpiFlashRK::Metrics::OperationMetrics &writeMetrics = metrics.ops[CircularBufferSpiFlashRK::Metrics::OP_WRITE];
+    assert(writeMetrics.calls == recordCount);
+    assert(writeMetrics.spiPrograms >= recordCount);
+    assert(writeMetrics.spiProgramBytes > 0);
+
+    const CircularBufferSpiFlashRK::Metrics::OperationMetrics &readMetrics = metrics.ops[CircularBufferSpiFlashRK::Metrics::OP_READ];
+    assert(readMetrics.calls == recordCount);
+    assert(readMetrics.spiReads > 0);
+    assert(readMetrics.spiPrograms == 0);
+
+    const CircularBufferSpiFlashRK::Metrics::OperationMetrics &markMetrics = metrics.ops[CircularBufferSpiFlashRK::Metrics::OP_MARK_AS_READ];
+    assert(markMetrics.calls == recordCount);
+    assert(markMetrics.spiErases + readMetrics.spiErases > 0);
+
+    for(size_t op = 0; op < CircularBufferSpiFlashRK::Metrics::OP_COUNT; op++) {
+        uint32_t histogramCount = 0;
+        for(size_t bucket = 0; bucket < CircularBufferSpiFlashRK::Metrics::LATENCY_BUCKET_COUNT; bucket++) {
+            histogramCount += metrics.ops[op].latencyHistogram[bucket];
+        }
+        assert(histogramCount == metrics.ops[op].calls);
+    }
+    assert(metrics.sectorCacheHits > 0);
+    assert(metrics.lockCount >= 3 * recordCount);
+
+    // Record writer open, append, and commit are each a call
+    {
+        CircularBufferSpiFlashRK::RecordWriter writer;
+        assert(circBuffer.openRecord(writer, 100));
+        assert(writer.append("abc", 4));
+        assert(writer.commit());
+    }
+    assert(circBuffer.getMetrics(metrics));
+    assert(metrics.ops[CircularBufferSpiFlashRK::Metrics::OP_RECORD_WRITER].calls == 3);
+
+    circBuffer.resetMetrics();
+    assert(circBuffer.getMetrics(metrics));
+    assert(metrics.ops[CircularBufferSpiFlashRK::Metrics::OP_WRITE].calls == 0);
+    assert(metrics.lockCount == 1);
+#else
+    assert(!circBuffer.getMetrics(metrics));
+#endif
+}
+
+void testTrace(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 16;
+    const size_t recordCount = 100;
+    const size_t traceEntries = 1000;
+
+    int stringCount = testSet.size();
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+    assert(circBuffer.format());
+
+    CircularBufferSpiFlashRK::TraceEntry entries[traceEntries];
+
+#if CIRCULARBUFFERSPIFLASHRK_TRACE
+    circBuffer.withTrace(traceEntries);
+
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeData(origBuffer));
+    }
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(circBuffer.readData(readInfo));
+        assert(circBuffer.markAsRead(readInfo));
+    }
+
+    size_t count = circBuffer.readTrace(entries, traceEntries);
+    assert(count > 2 * recordCount && count < traceEntries);
+
+    size_t eventCounts[6] = {0};
+    for(size_t ii = 0; ii < count; ii++) {
+        assert(entries[ii].event >= CircularBufferSpiFlashRK::TraceEntry::EVENT_READ_SECTOR && entries[ii].event <= CircularBufferSpiFlashRK::TraceEntry::EVENT_MARK_AS_READ);
+        assert(entries[ii].sectorNum < sectorCount);
+        eventCounts[entries[ii].event]++;
+        if (ii > 0) {
+            // Entries are added when the step completes
+            assert((entries[ii].timestampUs + entries[ii].durationUs) >= (entries[ii - 1].timestampUs + entries[ii - 1].durationUs));
+        }
+    }
+    assert(eventCounts[CircularBufferSpiFlashRK::TraceEntry::EVENT_APPEND] == recordCount);
+    assert(eventCounts[CircularBufferSpiFlashRK::TraceEntry::EVENT_MARK_AS_READ] == recordCount);
+    assert(eventCounts[CircularBufferSpiFlashRK::TraceEntry::EVENT_FINALIZE] > 0);
+    assert(eventCounts[CircularBufferSpiFlashRK::TraceEntry::EVENT_WRITE_SECTOR_HEADER] > 0);
+    assert(eventCounts[CircularBufferSpiFlashRK::TraceEntry::EVENT_READ_SECTOR] > 0);
+
+    // Save for use with tools/trace2chrome
+    FILE *fd = fopen("test01/trace.bin", "wb");
+    if (fd) {
+        fwrite(entries, sizeof(CircularBufferSpiFlashRK::TraceEntry), count, fd);
+        fclose(fd);
+    }
+
+    // Reading removes the entries
+    assert(circBuffer.readTrace(entries, traceEntries) == 0);
+
+    // When full, the oldest entries are overwritten
+    circBuffer.withTrace(10);
+    for(size_t ii = 0; ii < 20; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeData(origBuffer));
+    }
+    count = circBuffer.readTrace(entries, 4);
+    assert(count == 4);
+    count += circBuffer.readTrace(&entries[4], traceEntries - 4);
+    assert(count == 10);
+    assert(entries[9].event == CircularBufferSpiFlashRK::TraceEntry::EVENT_APPEND);
+    assert((entries[9].timestampUs + entries[9].durationUs) >= (entries[0].timestampUs + entries[0].durationUs));
+#else
+    assert(circBuffer.readTrace(entries, traceEntries) == 0);
+#endif
+}
+
+void testSpiFlashTiming() {
+    // Uses a separate object so the counters for the shared spiFlash are not affected
+    const size_t testFlashSize = 1024 * 1024;
+    uint8_t *testFlashBuffer = new uint8_t[testFlashSize];
+    SpiFlash testFlash(testFlashBuffer, testFlashSize);
+    testFlash.withTiming(SpiFlash::TIMING_WINBOND_W25Q128JV);
+
+    // 30 MHz, 1 us overhead: 1 byte command + 3 byte address + 256 bytes data = 2080 clocks = 69.3 us
+    uint8_t buf[512];
+    testFlash.readData(0, buf, 256);
+    assert(testFlash.readNs == 1000 + 2080 * 1000 / 30);
+
+    // Erase time is dominated by tSE
+    testFlash.sectorErase(0);
+    assert(testFlash.eraseNs > 45000000 && testFlash.eraseNs < 45100000);
+
+    // A write crossing a page boundary requires two page programs
+    memset(buf, 0, sizeof(buf));
+    testFlash.writeData(200, buf, 100);
+    assert(testFlash.pageProgramCount == 2);
+    uint64_t twoPageNs = testFlash.programNs;
+
+    testFlash.resetCounters();
+    assert(testFlash.getSimulatedNs() == 0);
+    testFlash.writeData(512, buf, 100);
+    assert(testFlash.pageProgramCount == 1);
+    assert(testFlash.programNs < twoPageNs);
+
+    // A full page program is limited to tPP
+    testFlash.resetCounters();
+    testFlash.writeData(1024, buf, 256);
+    assert(testFlash.programNs > 400000 && testFlash.programNs < 500000);
+
+    // Parts have different timing
+    const SpiFlashTiming *parts[] = { &SpiFlash::TIMING_WINBOND_W25Q128JV, &SpiFlash::TIMING_MACRONIX_MX25L12833F, &SpiFlash::TIMING_ISSI_IS25LP128F };
+    for(const SpiFlashTiming *part : parts) {
+        testFlash.withTiming(*part).resetCounters();
+
+        CircularBufferSpiFlashRK circBuffer(&testFlash, 0, 64 * 4096);
+        assert(circBuffer.format());
+        for(size_t ii = 0; ii < 200; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(buf, 100);
+            assert(circBuffer.writeData(origBuffer));
+        }
+        testFlash.printTiming("testSpiFlashTiming");
+        assert(testFlash.getSimulatedNs() > 0);
+    }
+
+    delete[] testFlashBuffer;
+}
+
+void testSectorFooter(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t recordCount = 1000;
+    int stringCount = testSet.size();
+    size_t readIndex = 0;
+
+    {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withSectorFooter();
+        assert(circBuffer.format());
+
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer));
+        }
+
+        // An aborted record, so the footer has more entries than recordCount in the sector header
+        CircularBufferSpiFlashRK::RecordWriter writer;
+        assert(circBuffer.openRecord(writer, 16));
+        assert(writer.append("aborted", 7));
+        assert(writer.abort());
+        for(size_t ii = recordCount; ii < recordCount + 200; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer));
+        }
+
+        // Every finalized sector has a footer
+        size_t footerCount = 0;
+        for(uint32_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
+            unsigned int flags = circBuffer.getSector(sectorNum)->c.flags;
+            if ((flags & CircularBufferSpiFlashRK::SECTOR_FLAG_FINALIZED_MASK) == 0) {
+                assert((flags & CircularBufferSpiFlashRK::SECTOR_FLAG_FOOTER_MASK) == 0);
+                footerCount++;
+            }
+        }
+        assert(footerCount > 4);
+
+        // Read part way into the second sector, which marks records as read in the footer
+        uint32_t firstSectorNum = 0;
+        while(true) {
+            CircularBufferSpiFlashRK::ReadInfo readInfo;
+            assert(circBuffer.readData(readInfo));
+            assert(strcmp(readInfo.c_str(), testSet.at(readIndex % stringCount).c_str()) == 0);
+            assert(circBuffer.markAsRead(readInfo));
+            readIndex++;
+            if (readIndex == 1) {
+                firstSectorNum = readInfo.sectorNum;
+            }
+            else
+            if (readInfo.sectorNum != firstSectorNum && readInfo.index == 2) {
+                break;
+            }
+        }
+    }
+
+    for(int footers = 0; footers < 2; footers++) {
+        // Reload with and without the option enabled, which does not affect reading existing footers
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withSectorFooter(footers == 1);
+        assert(circBuffer.load());
+
+        // Indexing a finalized sector with a footer is one read instead of one per record
+        CircularBufferSpiFlashRK::UsageStats stats;
+        assert(circBuffer.getUsageStats(stats));
+        uint32_t sectorNum;
+        assert(circBuffer.sequenceToSectorNum(stats.oldestSequence + 2, sectorNum));
+        size_t startCount = spiFlash.readCount;
+        CircularBufferSpiFlashRK::Sector *pSector = circBuffer.getSector(sectorNum);
+        assert(spiFlash.readCount - startCount == 1);
+        assert(pSector->records.size() > 1);
+
+        // Continues after the records marked as read in the footer, skipping the aborted record
+        size_t index = readIndex;
+        while(true) {
+            CircularBufferSpiFlashRK::ReadInfo readInfo;
+            if (!circBuffer.readData(readInfo)) {
+                break;
+            }
+            if (strcmp(readInfo.c_str(), testSet.at(index % stringCount).c_str()) != 0) {
+                printf("testSectorFooter footers=%d index=%d\n", footers, (int)index);
+                assert(false);
+            }
+            index++;
+            if (footers == 1) {
+                assert(circBuffer.markAsRead(readInfo));
+            }
+            else {
+                // Leave the records for the next pass
+                circBuffer.clearCache();
+                CircularBufferSpiFlashRK::ReadInfo readInfo2;
+                assert(circBuffer.readData(readInfo2));
+                assert(readInfo2.sectorNum == readInfo.sectorNum && readInfo2.index == readInfo.index);
+                break;
+            }
+        }
+        if (footers == 1) {
+            assert(index == recordCount + 200);
+        }
+    }
+
+    {
+        // Fewer records fit in each sector with the footer
+        size_t sectorsUsed[2];
+        for(int footers = 0; footers < 2; footers++) {
+            CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+            circBuffer.withSectorFooter(footers == 1);
+            assert(circBuffer.format());
+            CircularBufferSpiFlashRK::UsageStats stats;
+            assert(circBuffer.getUsageStats(stats));
+            uint32_t startSequence = stats.newestSequence;
+            for(size_t ii = 0; ii < recordCount; ii++) {
+                CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+                assert(circBuffer.writeData(origBuffer));
+            }
+            assert(circBuffer.getUsageStats(stats));
+            sectorsUsed[footers] = stats.newestSequence - startSequence;
+        }
+        printf("testSectorFooter sectorsUsed noFooter=%d footer=%d\n", (int)sectorsUsed[0], (int)sectorsUsed[1]);
+        assert(sectorsUsed[1] >= sectorsUsed[0]);
+    }
+}
+
+void testTimestamps(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t recordCount = 1000;
+    int stringCount = testSet.size();
+
+    // Record ii has timestamp 1000 + ii * 10
+    auto recordTimestamp = [](size_t ii) { return (uint32_t)(1000 + ii * 10); };
+
+    {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withTimeIndex().withSectorFooter();
+        assert(circBuffer.format());
+
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer, recordTimestamp(ii)));
+        }
+
+        // Finalized sectors have both the time range and the footer
+        size_t finalizedCount = 0;
+        for(uint32_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
+            unsigned int flags = circBuffer.getSector(sectorNum)->c.flags;
+            if ((flags & CircularBufferSpiFlashRK::SECTOR_FLAG_FINALIZED_MASK) == 0) {
+                assert((flags & (CircularBufferSpiFlashRK::SECTOR_FLAG_TIME_RANGE_MASK | CircularBufferSpiFlashRK::SECTOR_FLAG_FOOTER_MASK)) == 0);
+                finalizedCount++;
+            }
+        }
+        assert(finalizedCount > 4);
+
+        // The timestamp is returned separately from the data
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(circBuffer.readData(readInfo));
+        assert(strcmp(readInfo.c_str(), testSet.at(0).c_str()) == 0);
+        assert(readInfo.size() == testSet.at(0).length() + 1);
+        assert(readInfo.timestamp == recordTimestamp(0));
+
+        char buf[256];
+        CircularBufferSpiFlashRK::ReadInfo readInfo2;
+        assert(circBuffer.readData(readInfo2, buf, sizeof(buf)));
+        assert(readInfo2.recordCommon.size == testSet.at(0).length() + 1);
+        assert(readInfo2.timestamp == recordTimestamp(0));
+        assert(strcmp(buf, testSet.at(0).c_str()) == 0);
+        assert(circBuffer.readDataChunk(readInfo2, 1, buf, 2));
+        assert(memcmp(buf, &testSet.at(0).c_str()[1], 2) == 0);
+    }
+
+    for(int pass = 0; pass < 2; pass++) {
+        // After load, the time ranges are read with the sector headers
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withTimeIndex();
+        assert(circBuffer.load());
+
+        // Only the sectors that overlap the range are indexed
+        circBuffer.clearCache();
+        size_t startCount = spiFlash.readCount;
+        CircularBufferSpiFlashRK::TimeRangeCursor cursor(recordTimestamp(300), recordTimestamp(399));
+        size_t index = 300;
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        while(circBuffer.readDataInTimeRange(cursor, readInfo)) {
+            assert(readInfo.timestamp == recordTimestamp(index));
+            assert(strcmp(readInfo.c_str(), testSet.at(index % stringCount).c_str()) == 0);
+            index++;
+        }
+        assert(index == 400);
+        printf("testTimestamps readDataInTimeRange reads=%d\n", (int)(spiFlash.readCount - startCount));
+        assert((spiFlash.readCount - startCount) < recordCount / 2);
+
+        // Not marked as read
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.timestamp == recordTimestamp(0));
+
+        if (pass == 0) {
+            continue;
+        }
+
+        // A time between records
+        assert(circBuffer.seekToTime(recordTimestamp(500) - 5));
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.timestamp == recordTimestamp(500));
+        assert(strcmp(readInfo.c_str(), testSet.at(500 % stringCount).c_str()) == 0);
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordCount == recordCount - 500);
+        assert(stats.recordsLostToOverwrite == 0);
+
+        // A cursor continues with records written later
+        CircularBufferSpiFlashRK::TimeRangeCursor cursor2(recordTimestamp(990), 0xffffffff);
+        index = 990;
+        for(int writes = 0; writes < 2; writes++) {
+            while(circBuffer.readDataInTimeRange(cursor2, readInfo)) {
+                assert(readInfo.timestamp == recordTimestamp(index));
+                index++;
+            }
+            assert(index == recordCount + writes * 100);
+            for(size_t ii = index; ii < index + 100; ii++) {
+                CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+                assert(circBuffer.writeData(origBuffer, recordTimestamp(ii)));
+            }
+        }
+
+        // Records without a timestamp are returned with timestamp 0, so seekToTime discards them even if
+        // they were written after the records it keeps
+        assert(circBuffer.writeData(CircularBufferSpiFlashRK::DataBuffer("no timestamp")));
+        assert(circBuffer.seekToTime(recordTimestamp(recordCount + 199)));
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.timestamp == recordTimestamp(recordCount + 199));
+        assert(circBuffer.markAsRead(readInfo));
+        assert(!circBuffer.readData(readInfo));
+        assert(circBuffer.writeData(CircularBufferSpiFlashRK::DataBuffer("no timestamp")));
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.timestamp == 0);
+        assert(readInfo.equals("no timestamp"));
+
+        // Everything is discarded, including the write sector
+        assert(circBuffer.seekToTime(0xffffffff));
+        assert(!circBuffer.readData(readInfo));
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordCount == 0 && stats.dataSize == 0);
+    }
+
+    {
+        // Timestamps can be read without the time index, but seeking requires it
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        assert(circBuffer.format());
+        assert(circBuffer.writeData(CircularBufferSpiFlashRK::DataBuffer("test"), 1234));
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.timestamp == 1234 && readInfo.equals("test"));
+        assert(!circBuffer.seekToTime(1000));
+    }
+}
+
+void testRecordTypes(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t recordCount = 1000;
+    int stringCount = testSet.size();
+
+    // Records 400 - 499 are type 5, otherwise every 10th record is type 3 and the rest are type 1
+    auto recordType = [](size_t ii) { return (uint8_t)((ii >= 400 && ii < 500) ? 5 : (((ii % 10) == 0) ? 3 : 1)); };
+
+    {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        assert(circBuffer.format());
+
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeTypedData(recordType(ii), origBuffer));
+        }
+        assert(!circBuffer.writeTypedData(CircularBufferSpiFlashRK::RECORD_TYPE_COUNT, CircularBufferSpiFlashRK::DataBuffer("invalid")));
+
+        // The first sector only has types 1 and 3
+        assert(circBuffer.getSector(0)->c.typeBitmap == (uint16_t)~((1 << 1) | (1 << 3)));
+
+        // Records of other types are left unread
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        size_t readCount = 0;
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            if (recordType(ii) != 3) {
+                continue;
+            }
+            assert(circBuffer.readData(readInfo, 1 << 3));
+            assert(readInfo.getType() == 3);
+            assert(strcmp(readInfo.c_str(), testSet.at(ii % stringCount).c_str()) == 0);
+            assert(circBuffer.markAsRead(readInfo));
+            readCount++;
+        }
+        assert(!circBuffer.readData(readInfo, 1 << 3));
+        assert(readCount == 90);
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordCount == recordCount - readCount);
+    }
+
+    {
+        // After load, sectors that had records read out of order are indexed to calculate the usage stats
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        assert(circBuffer.load());
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordCount == recordCount - 90);
+
+        // Sectors without type 5 records are skipped without indexing them
+        // (validateSector in markAsRead reads the whole sector, so only the readData calls are counted)
+        circBuffer.clearCache();
+        size_t typeReadCount = 0;
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        for(size_t ii = 400; ii < 500; ii++) {
+            size_t startCount = spiFlash.readCount;
+            assert(circBuffer.readData(readInfo, (1 << 5) | (1 << 7)));
+            typeReadCount += spiFlash.readCount - startCount;
+            assert(readInfo.getType() == 5);
+            assert(strcmp(readInfo.c_str(), testSet.at(ii % stringCount).c_str()) == 0);
+            assert(circBuffer.markAsRead(readInfo));
+        }
+        assert(!circBuffer.readData(readInfo, 1 << 5));
+        printf("testRecordTypes readData(typeMask) reads=%d\n", (int)typeReadCount);
+        assert(typeReadCount < recordCount / 2);
+
+        // The remaining records are returned in order by readData and the empty sectors are erased
+        readInfo.free();
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            if (recordType(ii) != 1) {
+                continue;
+            }
+            assert(circBuffer.readData(readInfo));
+            assert(readInfo.getType() == 1);
+            assert(strcmp(readInfo.c_str(), testSet.at(ii % stringCount).c_str()) == 0);
+            assert(circBuffer.markAsRead(readInfo));
+        }
+        assert(!circBuffer.readData(readInfo));
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordCount == 0 && stats.dataSize == 0);
+        assert(stats.freeSectors == sectorCount);
+
+        // Records from openRecord() have a type too, and the write sector type bitmap is rebuilt by load
+        CircularBufferSpiFlashRK::RecordWriter writer;
+        assert(circBuffer.openRecord(writer, 100, 7));
+        assert(writer.append("typed", 6));
+        assert(writer.commit());
+        assert(circBuffer.writeTypedData(2, CircularBufferSpiFlashRK::DataBuffer("type 2")));
+    }
+    {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        assert(circBuffer.load());
+
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(circBuffer.readData(readInfo, (1 << 2) | (1 << 5)));
+        assert(readInfo.getType() == 2 && readInfo.equals("type 2"));
+        assert(circBuffer.markAsRead(readInfo));
+        assert(circBuffer.readData(readInfo, 1 << 7));
+        assert(readInfo.getType() == 7 && strcmp(readInfo.c_str(), "typed") == 0);
+        assert(circBuffer.markAsRead(readInfo));
+        assert(!circBuffer.readData(readInfo));
+    }
+}
+
+void testExpireBefore(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t recordCount = 1000;
+    int stringCount = testSet.size();
+
+    auto recordTimestamp = [](size_t ii) { return (uint32_t)(1000 + ii * 10); };
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+    circBuffer.withTimeIndex().withSectorFooter();
+    assert(circBuffer.format());
+
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeData(origBuffer, recordTimestamp(ii)));
+    }
+
+    CircularBufferSpiFlashRK::ReadInfo readInfo;
+    for(size_t ii = 0; ii < 5; ii++) {
+        assert(circBuffer.readData(readInfo));
+        assert(circBuffer.markAsRead(readInfo));
+    }
+
+    // Only the first sector is indexed, from the footer, and no record data is read
+    circBuffer.clearCache();
+    size_t startCount = spiFlash.readCount;
+    assert(circBuffer.expireBefore(recordTimestamp(300)));
+    assert((spiFlash.readCount - startCount) <= 2);
+
+    // Records in the sector containing timestamp 300 are not expired
+    assert(circBuffer.readData(readInfo));
+    assert(readInfo.timestamp > recordTimestamp(5) && readInfo.timestamp <= recordTimestamp(300));
+    size_t firstIndex = (readInfo.timestamp - 1000) / 10;
+    assert(strcmp(readInfo.c_str(), testSet.at(firstIndex % stringCount).c_str()) == 0);
+
+    CircularBufferSpiFlashRK::UsageStats stats;
+    assert(circBuffer.getUsageStats(stats));
+    assert(stats.recordsExpired == firstIndex - 5);
+    assert(stats.recordCount == recordCount - firstIndex);
+    assert(stats.recordsLostToOverwrite == 0);
+
+    // Nothing more to expire
+    assert(circBuffer.expireBefore(recordTimestamp(firstIndex)));
+    assert(circBuffer.getUsageStats(stats));
+    assert(stats.recordsExpired == firstIndex - 5);
+
+    // The write sector is not erased
+    assert(circBuffer.expireBefore(0xffffffff));
+    assert(circBuffer.getUsageStats(stats));
+    assert(stats.oldestSequence == stats.newestSequence);
+    assert(stats.recordCount > 0 && stats.recordCount + stats.recordsExpired + 5 == recordCount);
+    assert(circBuffer.readData(readInfo));
+    assert(readInfo.timestamp == recordTimestamp(recordCount - stats.recordCount));
+
+    for(size_t ii = recordCount; ii < 2 * recordCount; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeData(origBuffer, recordTimestamp(ii)));
+    }
+
+    {
+        CircularBufferSpiFlashRK circBuffer2(&spiFlash, 0, sectorCount * 4096);
+        assert(circBuffer2.load());
+        assert(!circBuffer2.expireBefore(recordTimestamp(300)));
+
+        // Enabling the time index after load() reads the time ranges from flash
+        circBuffer2.withTimeIndex();
+        assert(circBuffer2.expireBefore(recordTimestamp(recordCount + 300)));
+        assert(circBuffer2.getUsageStats(stats));
+        assert(stats.recordsExpired > 0);
+        assert(circBuffer2.readData(readInfo));
+        assert(readInfo.timestamp > recordTimestamp(recordCount) && readInfo.timestamp <= recordTimestamp(recordCount + 300));
+    }
+}
+
+void testCompaction(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 64;
+    const size_t recordCount = 1000;
+    int stringCount = testSet.size();
+
+    // Every 10th record is type 3, the rest are type 1
+    auto recordType = [](size_t ii) { return (uint8_t)(((ii % 10) == 0) ? 3 : 1); };
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+    circBuffer.withTimeIndex();
+    assert(circBuffer.format());
+
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeTypedData(recordType(ii), origBuffer, (uint32_t)ii));
+    }
+
+    // Mostly unread, nothing to compact
+    assert(!circBuffer.compactStep());
+
+    // The type 1 records are read, which leaves every sector with a few unread records
+    CircularBufferSpiFlashRK::ReadInfo readInfo;
+    while(circBuffer.readData(readInfo, 1 << 1)) {
+        assert(circBuffer.markAsRead(readInfo));
+    }
+
+    CircularBufferSpiFlashRK::UsageStats stats;
+    assert(circBuffer.getUsageStats(stats));
+    assert(stats.recordCount == recordCount / 10);
+    size_t freeSectorsBefore = stats.freeSectors;
+
+    size_t steps = 0;
+    while(circBuffer.compactStep(256)) {
+        steps++;
+    }
+
+    assert(circBuffer.getUsageStats(stats));
+    printf("testCompaction steps=%d recordsCompacted=%d freeSectors before=%d after=%d\n", (int)steps, (int)stats.recordsCompacted, (int)freeSectorsBefore, (int)stats.freeSectors);
+    assert(steps > 1);
+    assert(stats.recordsCompacted > 0);
+    assert(stats.recordCount == recordCount / 10);
+    assert(stats.freeSectors > freeSectorsBefore);
+    assert(stats.recordsLostToOverwrite == 0);
+
+    {
+        // The usage stats are the same after load
+        CircularBufferSpiFlashRK circBuffer2(&spiFlash, 0, sectorCount * 4096);
+        circBuffer2.withTimeIndex();
+        assert(circBuffer2.load());
+
+        CircularBufferSpiFlashRK::UsageStats stats2;
+        assert(circBuffer2.getUsageStats(stats2));
+        assert(stats2.recordCount == stats.recordCount && stats2.dataSize == stats.dataSize);
+
+        // Every type 3 record is returned once, with its timestamp, but moved records are returned later
+        std::vector<bool> found(recordCount, false);
+        size_t readCount = 0;
+        while(circBuffer2.readData(readInfo)) {
+            assert(readInfo.getType() == 3);
+            assert(readInfo.timestamp < recordCount && (readInfo.timestamp % 10) == 0);
+            assert(!found[readInfo.timestamp]);
+            found[readInfo.timestamp] = true;
+            assert(strcmp(readInfo.c_str(), testSet.at(readInfo.timestamp % stringCount).c_str()) == 0);
+            assert(circBuffer2.markAsRead(readInfo));
+            readCount++;
+        }
+        assert(readCount == recordCount / 10);
+    }
+
+    {
+        // Moved records are older than the records around them, but time range reads and seekToTime still find them
+        CircularBufferSpiFlashRK circBuffer3(&spiFlash, 0, sectorCount * 4096);
+        circBuffer3.withTimeIndex();
+        assert(circBuffer3.format());
+
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer3.writeTypedData(recordType(ii), origBuffer, (uint32_t)ii));
+        }
+        while(circBuffer3.readData(readInfo, 1 << 1)) {
+            assert(circBuffer3.markAsRead(readInfo));
+        }
+        while(circBuffer3.compactStep(256)) {
+        }
+        assert(circBuffer3.getUsageStats(stats));
+        assert(stats.recordsCompacted > 0);
+
+        CircularBufferSpiFlashRK::TimeRangeCursor cursor(0, 99);
+        std::vector<bool> found(recordCount, false);
+        size_t readCount = 0;
+        while(circBuffer3.readDataInTimeRange(cursor, readInfo)) {
+            assert(readInfo.timestamp <= 99 && (readInfo.timestamp % 10) == 0);
+            assert(!found[readInfo.timestamp]);
+            found[readInfo.timestamp] = true;
+            readCount++;
+        }
+        assert(readCount == 10);
+
+        assert(circBuffer3.seekToTime(500));
+        assert(circBuffer3.getUsageStats(stats));
+        assert(stats.recordCount == (recordCount - 500) / 10);
+
+        readCount = 0;
+        while(circBuffer3.readData(readInfo)) {
+            assert(readInfo.timestamp >= 500 && (readInfo.timestamp % 10) == 0);
+            assert(circBuffer3.markAsRead(readInfo));
+            readCount++;
+        }
+        assert(readCount == (recordCount - 500) / 10);
+    }
+}
+
+void testPriorityTypes(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 16;
+    const size_t recordCount = 10000;
+    int stringCount = testSet.size();
+
+    // Every 50th record is type 7 (high priority), the rest are type 0
+    auto isPriority = [](size_t ii) { return (ii % 50) == 0; };
+
+    for(int pass = 0; pass < 2; pass++) {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        if (pass == 1) {
+            circBuffer.withPriorityTypes(1 << 7);
+        }
+        assert(circBuffer.format());
+
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeTypedData(isPriority(ii) ? 7 : 0, origBuffer, (uint32_t)ii));
+        }
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordsLostToOverwrite > 0);
+
+        size_t priorityCount = 0;
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        while(circBuffer.readData(readInfo, 1 << 7)) {
+            assert(isPriority(readInfo.timestamp));
+            assert(strcmp(readInfo.c_str(), testSet.at(readInfo.timestamp % stringCount).c_str()) == 0);
+            assert(circBuffer.markAsRead(readInfo));
+            priorityCount++;
+        }
+        printf("testPriorityTypes pass=%d priorityCount=%d recordsRelocated=%d recordsLostToOverwrite=%d\n", 
+            pass, (int)priorityCount, (int)stats.recordsRelocated, (int)stats.recordsLostToOverwrite);
+
+        if (pass == 0) {
+            // Without priority types, most of them are overwritten
+            assert(stats.recordsRelocated == 0);
+            assert(priorityCount < recordCount / 50 / 2);
+        }
+        else {
+            // All of them are kept
+            assert(stats.recordsRelocated > 0);
+            assert(priorityCount == recordCount / 50);
+            assert(stats.priorityRecordsLost == 0);
+        }
+    }
+
+    // A sector that is entirely small high priority records, followed by large normal records. With a 
+    // small maxRelocateBytes, only one record is moved per write, so most of them are lost and counted.
+    for(int pass = 0; pass < 2; pass++) {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withPriorityTypes(1 << 7, (pass == 0) ? 4096 : 1);
+        assert(circBuffer.format());
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        assert(circBuffer.getUsageStats(stats));
+        uint32_t firstSectorSequence = stats.newestSequence;
+
+        size_t priorityWritten = 0;
+        CircularBufferSpiFlashRK::DataBuffer priorityData(nullptr, 20);
+        while(true) {
+            assert(circBuffer.writeTypedData(7, priorityData, (uint32_t)priorityWritten));
+            assert(circBuffer.getUsageStats(stats));
+            if (stats.newestSequence != firstSectorSequence) {
+                // This record started the second sector
+                break;
+            }
+            priorityWritten++;
+        }
+        priorityWritten++;
+
+        CircularBufferSpiFlashRK::DataBuffer normalData(nullptr, 1000);
+        for(size_t ii = 0; ii < sectorCount * 4 * 3; ii++) {
+            assert(circBuffer.writeTypedData(0, normalData, 0));
+        }
+
+        assert(circBuffer.getUsageStats(stats));
+
+        // Each high priority record is either still in the buffer, once, or counted as lost
+        std::vector<bool> found(priorityWritten, false);
+        size_t priorityCount = 0;
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        while(circBuffer.readData(readInfo, 1 << 7)) {
+            assert(readInfo.timestamp < priorityWritten);
+            assert(!found[readInfo.timestamp]);
+            found[readInfo.timestamp] = true;
+            assert(circBuffer.markAsRead(readInfo));
+            priorityCount++;
+        }
+        printf("testPriorityTypes fullSector pass=%d priorityWritten=%d priorityCount=%d recordsRelocated=%d priorityRecordsLost=%d\n", 
+            pass, (int)priorityWritten, (int)priorityCount, (int)stats.recordsRelocated, (int)stats.priorityRecordsLost);
+
+        assert(priorityCount + stats.priorityRecordsLost == priorityWritten);
+        assert(stats.recordsLostToOverwrite >= stats.priorityRecordsLost);
+        if (pass == 0) {
+            assert(stats.priorityRecordsLost == 0);
+        }
+        else {
+            assert(stats.priorityRecordsLost > 0);
+        }
+    }
+}
+
+void testLeases(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 16;
+    const size_t recordCount = 500;
+    int stringCount = testSet.size();
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+    circBuffer.withLeases(3, 50);
+    assert(circBuffer.format());
+
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeTypedData((ii % 4) == 0 ? 1 : 0, origBuffer, (uint32_t)ii));
+    }
+
+    // Three different records can be in flight at once
+    CircularBufferSpiFlashRK::ReadInfo readInfo[4];
+    for(size_t ii = 0; ii < 3; ii++) {
+        assert(circBuffer.readData(readInfo[ii]));
+        assert(readInfo[ii].timestamp == ii);
+    }
+    assert(!circBuffer.readData(readInfo[3]));
+
+    // Acknowledge out of order, which frees a lease for the next record
+    assert(circBuffer.markAsRead(readInfo[1]));
+    assert(circBuffer.readData(readInfo[1]));
+    assert(readInfo[1].timestamp == 3);
+
+    // A nack returns the record to the queue, so it's the next one returned
+    assert(circBuffer.nack(readInfo[0]));
+    assert(!circBuffer.nack(readInfo[0]));
+    assert(circBuffer.readData(readInfo[0]));
+    assert(readInfo[0].timestamp == 0);
+
+    // Leases that are not acknowledged expire
+    usleep(100 * 1000);
+    assert(circBuffer.readData(readInfo[3]));
+    assert(readInfo[3].timestamp == 0);
+    assert(circBuffer.readData(readInfo[2]));
+    assert(readInfo[2].timestamp == 2);
+
+    assert(circBuffer.markAsRead(readInfo[3]));
+    assert(circBuffer.markAsRead(readInfo[2]));
+
+    // Typed reads skip leased records too
+    CircularBufferSpiFlashRK::ReadInfo typedInfo[2];
+    assert(circBuffer.readData(typedInfo[0], 1 << 1));
+    assert(typedInfo[0].timestamp == 4);
+    assert(circBuffer.readData(typedInfo[1], 1 << 1));
+    assert(typedInfo[1].timestamp == 8);
+    assert(circBuffer.markAsRead(typedInfo[1]));
+    assert(circBuffer.markAsRead(typedInfo[0]));
+
+    // Drain the rest with a pipeline of 3, acknowledging the newest in flight first. Record 3 expired
+    // and is returned again.
+    size_t readCount = 5;
+    std::vector<CircularBufferSpiFlashRK::ReadInfo> inFlight;
+    while(true) {
+        CircularBufferSpiFlashRK::ReadInfo ri;
+        bool hasData = circBuffer.readData(ri);
+        if (hasData) {
+            assert(strcmp(ri.c_str(), testSet.at(ri.timestamp % stringCount).c_str()) == 0);
+            inFlight.push_back(ri);
+        }
+        if (inFlight.size() == 3 || (!hasData && !inFlight.empty())) {
+            assert(circBuffer.markAsRead(inFlight.back()));
+            inFlight.pop_back();
+            readCount++;
+        }
+        else if (!hasData) {
+            break;
+        }
+    }
+    assert(readCount == recordCount);
+
+    CircularBufferSpiFlashRK::UsageStats stats;
+    assert(circBuffer.getUsageStats(stats));
+    assert(stats.recordCount == 0);
+
+    {
+        // Leased records are not moved by compactStep(), so acknowledging the lease does not leave a copy
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withLeases(3, 0);
+        assert(circBuffer.format());
+
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeTypedData((ii % 10) == 0 ? 3 : 1, origBuffer, (uint32_t)ii));
+        }
+
+        CircularBufferSpiFlashRK::ReadInfo leasedInfo;
+        assert(circBuffer.readData(leasedInfo, 1 << 3));
+        assert(leasedInfo.timestamp == 0);
+
+        CircularBufferSpiFlashRK::ReadInfo ri;
+        while(circBuffer.readData(ri, 1 << 1)) {
+            assert(circBuffer.markAsRead(ri));
+        }
+
+        // The other records in the oldest sector are moved, but the sector is kept for the leased record
+        while(circBuffer.compactStep(256)) {
+        }
+        assert(circBuffer.getUsageStats(stats));
+        size_t compactedBefore = stats.recordsCompacted;
+        assert(compactedBefore > 0);
+        assert(stats.recordCount == recordCount / 10);
+
+        assert(circBuffer.markAsRead(leasedInfo));
+        while(circBuffer.compactStep(256)) {
+        }
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordsCompacted > compactedBefore);
+        assert(stats.recordCount == recordCount / 10 - 1);
+
+        std::vector<bool> found(recordCount, false);
+        size_t readCount = 0;
+        while(circBuffer.readData(ri)) {
+            assert(ri.getType() == 3);
+            assert(ri.timestamp != 0 && (ri.timestamp % 10) == 0);
+            assert(!found[ri.timestamp]);
+            found[ri.timestamp] = true;
+            assert(circBuffer.markAsRead(ri));
+            readCount++;
+        }
+        assert(readCount == recordCount / 10 - 1);
+    }
+}
+
+void testRetainAfterRead(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 16;
+    const size_t recordCount = 1200;
+    int stringCount = testSet.size();
+
+    {
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withRetainAfterRead().withTimeIndex();
+        assert(circBuffer.format());
+
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer, (uint32_t)ii));
+        }
+
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        for(size_t ii = 0; ii < recordCount; ii++) {
+            assert(circBuffer.readData(readInfo));
+            assert(readInfo.timestamp == ii);
+            assert(circBuffer.markAsRead(readInfo));
+        }
+        assert(!circBuffer.readData(readInfo));
+        assert(!circBuffer.compactStep());
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordCount == 0);
+        assert(stats.retainedSectors > 0);
+        assert(stats.retainedSectors == stats.newestSequence - stats.oldestSequence);
+
+        // Reading a new record only indexes the write sector, not the retained sectors
+        CircularBufferSpiFlashRK::DataBuffer newBuffer(testSet.at(recordCount % stringCount).c_str());
+        assert(circBuffer.writeData(newBuffer, (uint32_t)recordCount));
+        circBuffer.clearCache();
+        size_t startCount = spiFlash.readCount;
+        assert(circBuffer.readData(readInfo));
+        assert(readInfo.timestamp == recordCount);
+        printf("testRetainAfterRead retainedSectors=%d readData flash reads=%d\n", (int)stats.retainedSectors, (int)(spiFlash.readCount - startCount));
+        assert(spiFlash.readCount - startCount < recordCount / stats.retainedSectors);
+        assert(circBuffer.markAsRead(readInfo));
+    }
+
+    {
+        // Retained sectors are found from the sector headers after reboot
+        CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+        circBuffer.withRetainAfterRead().withTimeIndex();
+        assert(circBuffer.load());
+
+        CircularBufferSpiFlashRK::UsageStats stats;
+        assert(circBuffer.getUsageStats(stats));
+        assert(stats.recordCount == 0);
+        assert(stats.retainedSectors > 0);
+
+        CircularBufferSpiFlashRK::ReadInfo readInfo;
+        assert(!circBuffer.readData(readInfo));
+
+        // Replay everything
+        CircularBufferSpiFlashRK::ReplayCursor cursor;
+        assert(circBuffer.rewind(cursor, 0));
+        size_t replayCount = 0;
+        while(circBuffer.readReplay(cursor, readInfo)) {
+            assert(readInfo.timestamp == replayCount);
+            assert(strcmp(readInfo.c_str(), testSet.at(replayCount % stringCount).c_str()) == 0);
+            replayCount++;
+        }
+        assert(replayCount == recordCount + 1);
+
+        // Unread records are not replayed, and replay continues when more records are read
+        for(size_t ii = recordCount + 1; ii < recordCount + 11; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer, (uint32_t)ii));
+        }
+        assert(!circBuffer.readReplay(cursor, readInfo));
+        assert(circBuffer.readData(readInfo));
+        assert(circBuffer.markAsRead(readInfo));
+        assert(circBuffer.readReplay(cursor, readInfo));
+        assert(readInfo.timestamp == recordCount + 1);
+        assert(!circBuffer.readReplay(cursor, readInfo));
+
+        // Replay by time
+        assert(circBuffer.rewindToTime(cursor, 250));
+        replayCount = 0;
+        while(circBuffer.readReplay(cursor, readInfo)) {
+            assert(readInfo.timestamp == 250 + replayCount);
+            replayCount++;
+        }
+        assert(replayCount == recordCount + 2 - 250);
+
+        // Retained sectors are overwritten before unread records are lost
+        size_t lastRetainedSectors = stats.retainedSectors;
+        for(size_t ii = recordCount + 11; ii < 10 * recordCount; ii++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer, (uint32_t)ii));
+
+            assert(circBuffer.getUsageStats(stats));
+            if (stats.recordsLostToOverwrite > 0) {
+                break;
+            }
+            lastRetainedSectors = stats.retainedSectors;
+        }
+        assert(stats.recordsLostToOverwrite > 0);
+        assert(lastRetainedSectors == 0);
+
+        // The records that were replayed have been overwritten
+        assert(circBuffer.rewind(cursor, 0));
+        assert(!circBuffer.readReplay(cursor, readInfo));
+    }
+}
+
+void testReadReverse(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 16;
+    const size_t recordCount = 1000;
+    const size_t readCount = 100;
+    int stringCount = testSet.size();
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+    circBuffer.withSectorFooter();
+    assert(circBuffer.format());
+
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeData(origBuffer, (uint32_t)ii));
+    }
+
+    CircularBufferSpiFlashRK::ReadInfo readInfo;
+    for(size_t ii = 0; ii < readCount; ii++) {
+        assert(circBuffer.readData(readInfo));
+        assert(circBuffer.markAsRead(readInfo));
+    }
+
+    // The newest K records are read without scanning from the oldest record
+    {
+        const size_t latestCount = 200;
+        CircularBufferSpiFlashRK::ReverseCursor cursor;
+        size_t startCount = spiFlash.readCount;
+        size_t sectorsUsed = 0;
+        uint32_t lastSectorNum = 0xffffffff;
+        for(size_t ii = 0; ii < latestCount; ii++) {
+            assert(circBuffer.readDataReverse(cursor, readInfo));
+            assert(readInfo.timestamp == recordCount - 1 - ii);
+            assert(strcmp(readInfo.c_str(), testSet.at(readInfo.timestamp % stringCount).c_str()) == 0);
+            if (readInfo.sectorNum != lastSectorNum) {
+                lastSectorNum = readInfo.sectorNum;
+                sectorsUsed++;
+            }
+        }
+        size_t flashReads = spiFlash.readCount - startCount;
+        printf("testReadReverse latestCount=%d sectorsUsed=%d flashReads=%d\n", (int)latestCount, (int)sectorsUsed, (int)flashReads);
+        assert(flashReads <= latestCount + sectorsUsed);
+    }
+
+    // Records written after the first call are not returned, and the read flags are not changed
+    for(int pass = 0; pass < 2; pass++) {
+        bool unreadOnly = (pass == 1);
+        CircularBufferSpiFlashRK::ReverseCursor cursor(unreadOnly);
+        assert(circBuffer.readDataReverse(cursor, readInfo));
+        assert(readInfo.timestamp == recordCount - 1 + pass);
+
+        CircularBufferSpiFlashRK::DataBuffer newBuffer(testSet.at((recordCount + pass) % stringCount).c_str());
+        assert(circBuffer.writeData(newBuffer, (uint32_t)(recordCount + pass)));
+
+        size_t count = 1;
+        uint32_t lastTimestamp = readInfo.timestamp;
+        while(circBuffer.readDataReverse(cursor, readInfo)) {
+            assert(readInfo.timestamp < lastTimestamp);
+            lastTimestamp = readInfo.timestamp;
+            count++;
+        }
+        if (unreadOnly) {
+            assert(lastTimestamp == readCount);
+            assert(count == recordCount + 1 - readCount);
+        }
+        else {
+            // Read records in sectors that have not been erased yet are included
+            assert(lastTimestamp < readCount);
+            assert(count > recordCount - readCount);
+        }
+    }
+
+    assert(circBuffer.readData(readInfo));
+    assert(readInfo.timestamp == readCount);
+}
+
+void testSnapshot(std::vector<String> &testSet) {
+    const uint16_t sectorCount = 16;
+    const size_t recordCount = 1000;
+    const size_t readCount = 100;
+    int stringCount = testSet.size();
+
+    CircularBufferSpiFlashRK circBuffer(&spiFlash, 0, sectorCount * 4096);
+    circBuffer.withSectorFooter().withReadAhead(64);
+    assert(circBuffer.format());
+
+    for(size_t ii = 0; ii < recordCount; ii++) {
+        CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(ii % stringCount).c_str());
+        assert(circBuffer.writeData(origBuffer, (uint32_t)ii));
+    }
+
+    CircularBufferSpiFlashRK::ReadInfo readInfo;
+    for(size_t ii = 0; ii < readCount; ii++) {
+        assert(circBuffer.readData(readInfo));
+        assert(circBuffer.markAsRead(readInfo));
+    }
+
+    // Unread records, with records written during the scan not included
+    {
+        CircularBufferSpiFlashRK::SnapshotCursor cursor;
+        assert(circBuffer.startSnapshot(cursor));
+
+        circBuffer.clearCache();
+        size_t startCount = spiFlash.readCount;
+        size_t count = 0;
+        while(circBuffer.readSnapshot(cursor, readInfo)) {
+            assert(readInfo.timestamp == readCount + count);
+            assert(strcmp(readInfo.c_str(), testSet.at(readInfo.timestamp % stringCount).c_str()) == 0);
+            count++;
+
+            if (count == 10) {
+                size_t writeStartCount = spiFlash.readCount;
+                CircularBufferSpiFlashRK::DataBuffer newBuffer(testSet.at(recordCount % stringCount).c_str());
+                assert(circBuffer.writeData(newBuffer, (uint32_t)recordCount));
+                startCount += spiFlash.readCount - writeStartCount;
+            }
+        }
+        size_t flashReads = spiFlash.readCount - startCount;
+        printf("testSnapshot count=%d flashReads=%d\n", (int)count, (int)flashReads);
+        assert(count == recordCount - readCount);
+        assert(flashReads < count / 4);
+    }
+
+    // The read position and read flags are not changed
+    assert(circBuffer.readData(readInfo));
+    assert(readInfo.timestamp == readCount);
+
+    // All records, including read records that have not been erased
+    {
+        CircularBufferSpiFlashRK::SnapshotCursor cursor;
+        assert(circBuffer.startSnapshot(cursor, 0, false));
+        size_t count = 0;
+        uint32_t firstTimestamp = 0;
+        while(circBuffer.readSnapshot(cursor, readInfo)) {
+            if (count == 0) {
+                firstTimestamp = readInfo.timestamp;
+            }
+            assert(readInfo.timestamp == firstTimestamp + count);
+            count++;
+        }
+        assert(firstTimestamp < readCount);
+        assert(firstTimestamp + count == recordCount + 1);
+    }
+
+    // Starting at a sector
+    {
+        CircularBufferSpiFlashRK::SnapshotCursor cursor;
+        assert(circBuffer.startSnapshot(cursor));
+        assert(circBuffer.readSnapshot(cursor, readInfo));
+        uint32_t nextSequence = readInfo.sectorCommon.sequence + 1;
+
+        assert(circBuffer.startSnapshot(cursor, nextSequence));
+        assert(circBuffer.readSnapshot(cursor, readInfo));
+        assert(readInfo.sectorCommon.sequence == nextSequence);
+        assert(readInfo.index == 0);
+    }
+}
+
+void testFlashImage(std::vector<String> &testSet) {
+    const size_t testFlashSize = 256 * 4096;
+    const char *path = "test01/flashImage.bin";
+    int stringCount = testSet.size();
+    int writeIndex = 0;
+
+    {
+        // Save a raw image of a RAM chip with records in it, like a dump from a device
+        uint8_t *testFlashBuffer = new uint8_t[testFlashSize];
+        SpiFlash testFlash(testFlashBuffer, testFlashSize);
+        testFlash.chipErase();
+
+        // The circular buffer does not start at the beginning of the chip
+        CircularBufferSpiFlashRK circBuffer(&testFlash, 16 * 4096, 64 * 4096);
+        assert(circBuffer.format());
+        for(writeIndex = 0; writeIndex < 100; writeIndex++) {
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(writeIndex % stringCount).c_str());
+            assert(circBuffer.writeData(origBuffer));
+        }
+
+        assert(testFlash.saveImage(path));
+        delete[] testFlashBuffer;
+    }
+
+    for(size_t pass = 0; pass < 3; pass++) {
+        // Pass 0 marks records as read in a read-only mapping, which does not change the file, so pass 1 sees the
+        // same records. Pass 1 marks them as read in the file, so pass 2 sees none.
+        SpiFlash imageFlash(path, 0, (pass == 0) ? SpiFlash::FileMode::OPEN_IMAGE_READ_ONLY : SpiFlash::FileMode::OPEN_IMAGE);
+        assert(imageFlash.isValid());
+        assert(imageFlash.size == testFlashSize);
+
+        CircularBufferSpiFlashRK circBuffer(&imageFlash, 16 * 4096, 64 * 4096);
+        assert(circBuffer.load());
+
+        int readIndex = 0;
+        while(true) {
+            CircularBufferSpiFlashRK::ReadInfo readInfo;
+            if (!circBuffer.readData(readInfo)) {
+                break;
+            }
+            CircularBufferSpiFlashRK::DataBuffer origBuffer(testSet.at(readIndex++ % stringCount).c_str());
+            assert(strcmp(origBuffer.c_str(), readInfo.c_str()) == 0);
+            assert(circBuffer.markAsRead(readInfo));
+        }
+        assert(readIndex == ((pass < 2) ? writeIndex : 0));
+    }
+
+    {
+        // NOR semantics: programming can only clear bits, erase sets them
+        SpiFlash imageFlash(path, 0, SpiFlash::FileMode::OPEN_IMAGE);
+        assert(imageFlash.isValid());
+        imageFlash.sectorErase(0);
+
+        uint8_t buf[4];
+        uint8_t value = 0x0f;
+        imageFlash.writeData(0, &value, 1);
+        value = 0xf3;
+        imageFlash.writeData(0, &value, 1);
+        imageFlash.readData(0, buf, sizeof(buf));
+        assert(buf[0] == 0x03);
+        assert(buf[1] == 0xff);
+    }
+
+    {
+        // A size larger than the image cannot be mapped
+        SpiFlash imageFlash(path, 2 * testFlashSize, SpiFlash::FileMode::OPEN_IMAGE);
+        assert(!imageFlash.isValid());
+    }
+    {
+        SpiFlash imageFlash("test01/doesNotExist.bin", 0, SpiFlash::FileMode::OPEN_IMAGE);
+        assert(!imageFlash.isValid());
+    }
+
+    unlink(path);
+}
+
+void runUnitTests() {
+    // Local unit tests only used off-device 
+
+    // generateRandomStrings();
+    readRandomStrings();
+
+    testDataBuffer();
+    
+    testUnitSectorAppend(randomStringSmall);
+    testUnitSectorAppend(randomString1024);
+
+    testUnitReadWrite(randomStringSmall);
+
+    
+    testUnitWrap(randomString1024);
+
+    testUsageStats(randomStringSmall);
+    testUsageStatsOverwrite(randomString1024);
+
+    testLargeSectors(4096);
+    testLargeSectors(32768);
+    testLargeSectors(65536);
+
+    testBlockErase();
+
+    testLargeChip(randomString1024);
+
+    testWriteBuffering(randomStringSmall);
+
+    testTailCache(randomStringSmall);
+
+    testReadAhead(randomStringSmall);
+
+    testReadIntoBuffer(randomString1024);
+
+    testRecordWriter(randomString1024);
+
+    testMetrics(randomString1024);
+
+    testTrace(randomString1024);
+
+    testSpiFlashTiming();
+
+    testFlashImage(randomStringSmall);
+
+    testSectorFooter(randomStringSmall);
+
+    testTimestamps(randomStringSmall);
+
+    testRecordTypes(randomStringSmall);
+
+    testExpireBefore(randomStringSmall);
+
+    testCompaction(randomStringSmall);
+
+    testPriorityTypes(randomStringSmall);
+
+    testLeases(randomStringSmall);
+
+    testRetainAfterRead(randomStringSmall);
+
+    testReadReverse(randomStringSmall);
+
+    testSnapshot(randomStringSmall);
 
 }
 
@@ -1,20 +1,140 @@
 #include "SpiFlashTester.h"
 
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+
+//                                                                     name           clockHz   overheadNs tBP1   tBP2  tPP      tSE    tBE1    tBE2    tCE
+const SpiFlashTiming SpiFlash::TIMING_WINBOND_W25Q128JV =           { "W25Q128JV",   30000000, 1000,      30000, 2500, 400000,  45000, 120000, 150000, 40000 };
+const SpiFlashTiming SpiFlash::TIMING_MACRONIX_MX25L12833F =        { "MX25L12833F", 30000000, 1000,      12000, 2000, 330000,  25000, 140000, 250000, 50000 };
+const SpiFlashTiming SpiFlash::TIMING_ISSI_IS25LP128F =             { "IS25LP128F",  30000000, 1000,       8000, 1000, 200000,  70000, 100000, 150000, 45000 };
+
 
 SpiFlash::SpiFlash(uint8_t *buffer, size_t size) : buffer(buffer), size(size) {
 
 }
 
+SpiFlash::SpiFlash(const char *path, size_t size, FileMode mode) : buffer(nullptr), size(size) {
+    int openFlags = O_RDWR;
+    int mmapFlags = MAP_SHARED;
+
+    switch(mode) {
+        case FileMode::CREATE_SPARSE:
+            openFlags |= O_CREAT | O_TRUNC;
+            inverted = true;
+            break;
+
+        case FileMode::OPEN_SPARSE:
+            inverted = true;
+            break;
+
+        case FileMode::OPEN_IMAGE:
+            break;
+
+        case FileMode::OPEN_IMAGE_READ_ONLY:
+            // Private mapping so writes and erases are not written back to the file
+            openFlags = O_RDONLY;
+            mmapFlags = MAP_PRIVATE;
+            break;
+    }
+
+    fd = open(path, openFlags, 0644);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+        return;
+    }
+    if (this->size == 0) {
+        this->size = (size_t) sb.st_size;
+    }
+
+    if ((size_t)sb.st_size < this->size) {
+        if (!inverted) {
+            // Accessing the mapping past the end of the image would fault
+            return;
+        }
+        // Extending a sparse file adds holes, which read as erased (0xff) when inverted
+        if (ftruncate(fd, this->size) != 0) {
+            return;
+        }
+    }
+    if (this->size == 0) {
+        return;
+    }
+
+    void *addr = mmap(nullptr, this->size, PROT_READ | PROT_WRITE, mmapFlags, fd, 0);
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    buffer = (uint8_t *)addr;
+}
+
+SpiFlash::~SpiFlash() {
+    if (fd >= 0) {
+        if (buffer) {
+            munmap(buffer, size);
+            buffer = nullptr;
+        }
+        close(fd);
+        fd = -1;
+    }
+}
+
 void SpiFlash::readData(size_t addr, void *buf, size_t bufLen) {
-    assert((addr + bufLen) < size);
+    assert((addr + bufLen) <= size);
+    readCount++;
+    readByteCount += bufLen;
 
-    for(size_t ii = 0; ii < bufLen; ii++) {
-        ((uint8_t *)buf)[ii] = buffer[addr + ii];
+    // Reads are a single transaction and continue across page and sector boundaries
+    readNs += transactionNs(1 + addressBytes() + bufLen);
+
+    if (inverted) {
+        for(size_t ii = 0; ii < bufLen; ii++) {
+            ((uint8_t *)buf)[ii] = ~buffer[addr + ii];
+        }
+        return;
     }
+
+    memcpy(buf, &buffer[addr], bufLen);
 }
 
 void SpiFlash::writeData(size_t addr, const void *buf, size_t bufLen) {
-    assert((addr + bufLen) < size);
+    assert((addr + bufLen) <= size);
+
+    // Each page touched requires a separate page program operation, because a page program 
+    // wraps around to the beginning of the page instead of continuing into the next page
+    writeCount++;
+    for(size_t offset = 0; offset < bufLen; ) {
+        size_t count = pageSize - ((addr + offset) % pageSize);
+        if (count > (bufLen - offset)) {
+            count = bufLen - offset;
+        }
+        pageProgramCount++;
+
+        uint64_t programTimeNs = timing.programFirstByteNs + (uint64_t)(count - 1) * timing.programNextByteNs;
+        if (programTimeNs > timing.pageProgramNs) {
+            programTimeNs = timing.pageProgramNs;
+        }
+
+        // Write enable, page program command with data, program time, read status
+        programNs += transactionNs(1) + transactionNs(1 + addressBytes() + count) + programTimeNs + transactionNs(2);
+
+        offset += count;
+    }
+
+    if (inverted) {
+        // NOR flash can only change bits from 1 to 0, which is setting bits in the inverted file
+        for(size_t ii = 0; ii < bufLen; ii++) {
+            buffer[addr + ii] |= ~((uint8_t *)buf)[ii];
+        }
+        return;
+    }
 
     for(size_t ii = 0; ii < bufLen; ii++) {
         uint8_t value = ((uint8_t *)buf)[ii];
@@ -24,19 +144,101 @@ void SpiFlash::writeData(size_t addr, const void *buf, size_t bufLen) {
 
 }
 
+void SpiFlash::eraseRange(size_t addr, size_t len) {
+    assert((addr + len) <= size);
+
+    if (inverted) {
+        // Deallocate the range so the file stays sparse. Holes read as 0 which is erased (0xff) when inverted.
+        // The shared mapping sees the hole immediately.
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, addr, len) != 0) {
+            memset(&buffer[addr], 0, len);
+        }
+        return;
+    }
+
+    // Set to 0xff
+    memset(&buffer[addr], 0xff, len);
+}
+
 void SpiFlash::sectorErase(size_t addr) {
     // Verify addr is at a sector boundary
     assert((addr % sectorSize) == 0);
+    sectorEraseCount++;
+    eraseNs += eraseOperationNs((uint64_t)timing.sectorEraseUs * 1000);
 
-    // Set to 0xff
-    for(size_t ii = addr; ii < (addr + sectorSize); ii++) {
-        buffer[ii] = 0xff;
-    }
+    eraseRange(addr, sectorSize);
 }
 
+void SpiFlash::blockErase32K(size_t addr) {
+    const size_t blockSize = 32768;
+    assert((addr % blockSize) == 0);
+    blockErase32KCount++;
+    eraseNs += eraseOperationNs((uint64_t)timing.blockErase32KUs * 1000);
+
+    eraseRange(addr, blockSize);
+}
+
+void SpiFlash::blockErase(size_t addr) {
+    const size_t blockSize = 65536;
+    assert((addr % blockSize) == 0);
+    blockErase64KCount++;
+    eraseNs += eraseOperationNs((uint64_t)timing.blockErase64KUs * 1000);
+
+    eraseRange(addr, blockSize);
+}
 
 void SpiFlash::chipErase() {
-    for(size_t ii = 0; ii < size; ii++) {
-        buffer[ii] = 0xff;
+    eraseNs += eraseOperationNs((uint64_t)timing.chipEraseMs * 1000000);
+    eraseRange(0, size);
+}
+
+void SpiFlash::resetCounters() {
+    readCount = readByteCount = writeCount = pageProgramCount = 0;
+    sectorEraseCount = blockErase32KCount = blockErase64KCount = 0;
+    readNs = programNs = eraseNs = 0;
+}
+
+void SpiFlash::printTiming(const char *msg) const {
+    printf("%s %s reads=%lu readUs=%lu pagePrograms=%lu programUs=%lu erases=%lu eraseUs=%lu totalUs=%lu\n", 
+        msg, timing.name, (unsigned long)readCount, (unsigned long)(readNs / 1000), 
+        (unsigned long)pageProgramCount, (unsigned long)(programNs / 1000),
+        (unsigned long)(sectorEraseCount + blockErase32KCount + blockErase64KCount), (unsigned long)(eraseNs / 1000),
+        (unsigned long)(getSimulatedNs() / 1000));
+}
+
+bool SpiFlash::saveImage(const char *path) const {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        return false;
     }
+
+    bool result = true;
+    std::vector<uint8_t> temp(65536);
+
+    for(size_t addr = 0; addr < size && result; addr += temp.size()) {
+        size_t count = size - addr;
+        if (count > temp.size()) {
+            count = temp.size();
+        }
+        for(size_t ii = 0; ii < count; ii++) {
+            temp[ii] = inverted ? ~buffer[addr + ii] : buffer[addr + ii];
+        }
+        if (fwrite(temp.data(), 1, count, fp) != count) {
+            result = false;
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        result = false;
+    }
+    return result;
+}
+
+uint64_t SpiFlash::transactionNs(size_t len) const {
+    return timing.transactionOverheadNs + ((uint64_t)len * 8 * 1000000000) / timing.clockHz;
+}
+
+uint64_t SpiFlash::eraseOperationNs(uint64_t eraseTimeNs) const {
+    // Write enable, erase command and address, erase time, read status
+    return transactionNs(1) + transactionNs(1 + addressBytes()) + eraseTimeNs + transactionNs(2);
 }
@@ -3,16 +3,73 @@
 
 #include "Particle.h"
 
+#include <vector>
+
+/**
+ * @brief Timing parameters for a flash chip, used to calculate simulated device time
+ * 
+ * Program and erase times are typical values from the datasheet, not maximums.
+ */
+struct SpiFlashTiming {
+    const char *name; //!< Part number
+    uint32_t clockHz; //!< SPI bus clock in Hz
+    uint32_t transactionOverheadNs; //!< Time for each transaction in addition to clocking the bytes (CS setup and hold, DMA setup)
+    uint32_t programFirstByteNs; //!< Program time for the first byte in a page program (tBP1)
+    uint32_t programNextByteNs; //!< Program time for each additional byte (tBP2)
+    uint32_t pageProgramNs; //!< Program time for a full page (tPP), the maximum for a page program
+    uint32_t sectorEraseUs; //!< 4K sector erase time (tSE)
+    uint32_t blockErase32KUs; //!< 32K block erase time (tBE1)
+    uint32_t blockErase64KUs; //!< 64K block erase time (tBE2)
+    uint32_t chipEraseMs; //!< Chip erase time (tCE)
+};
+
 class SpiFlash {
 public:
+    static const SpiFlashTiming TIMING_WINBOND_W25Q128JV; //!< Winbond W25Q128JV at 30 MHz (default)
+    static const SpiFlashTiming TIMING_MACRONIX_MX25L12833F; //!< Macronix MX25L12833F at 30 MHz
+    static const SpiFlashTiming TIMING_ISSI_IS25LP128F; //!< ISSI IS25LP128F at 30 MHz
+
+    /**
+     * @brief Simulated flash chip stored in a RAM buffer
+     * 
+     * @param buffer Buffer to hold the contents of the flash
+     * @param size Size of the buffer in bytes
+     */
     SpiFlash(uint8_t *buffer, size_t size);
 
+    /**
+     * @brief How the file is used by the file-backed constructor
+     */
+    enum class FileMode {
+        CREATE_SPARSE, //!< Create or truncate a sparse file. Data is stored inverted so holes read as erased (0xff).
+        OPEN_SPARSE, //!< Open an existing sparse file previously created using CREATE_SPARSE
+        OPEN_IMAGE, //!< Open a raw flash image, such as a dump from a device. Changes are written to the file.
+        OPEN_IMAGE_READ_ONLY //!< Open a raw flash image. Changes are kept in RAM and not written to the file.
+    };
+
+    /**
+     * @brief Simulated flash chip stored in a memory-mapped file
+     * 
+     * @param path Pathname of the file
+     * @param size Size of the flash chip in bytes. For the OPEN modes, 0 uses the size of the file.
+     * @param mode How the file is used, see FileMode. Default is CREATE_SPARSE.
+     * 
+     * With CREATE_SPARSE only sectors that have been written to use disk space, so this is used for 
+     * simulating flash chips that are too large to keep in RAM. The OPEN_IMAGE modes load a raw image 
+     * (erased bytes are 0xff) such as one pulled from a field unit or saved using saveImage(). 
+     * 
+     * NOR write semantics are preserved in all modes. Use isValid() to check if the file could be opened.
+     */
+    SpiFlash(const char *path, size_t size, FileMode mode = FileMode::CREATE_SPARSE);
+
+    virtual ~SpiFlash();
+
     void begin() {};
 
 	/**
 	 * @brief Returns true if there is a flash chip present and it appears to be the correct manufacturer code.
 	 */
-	bool isValid() { return true; };
+	bool isValid() { return buffer != nullptr; };
 
 	/**
 	 * @brief Gets the JEDEC ID for the flash device.
@@ -70,6 +127,22 @@ public:
 	 */
 	void sectorErase(size_t addr);
 
+	/**
+	 * @brief Erases a 32K block (command 0x52). Must be at a 32K boundary.
+	 *
+	 * @param addr Address of the beginning of the block.
+	 * 
+	 * SpiFlashRK does not have this method, so the circular buffer only uses it through withBlockErase32K().
+	 */
+	void blockErase32K(size_t addr);
+
+	/**
+	 * @brief Erases a 64K block. Must be at a 64K boundary. Same name as SpiFlashRK.
+	 *
+	 * @param addr Address of the beginning of the block.
+	 */
+	void blockErase(size_t addr);
+
 	/**
 	 * @brief Erases the entire chip.
 	 *
@@ -95,9 +168,81 @@ public:
 	 */
 	inline size_t getSectorSize() const { return sectorSize; };
 
+    /**
+     * @brief Set the timing parameters used to calculate simulated device time
+     * 
+     * @param timing Timing parameters, such as TIMING_WINBOND_W25Q128JV. A copy is made.
+     * @return SpiFlash& This object, for chaining
+     */
+    SpiFlash &withTiming(const SpiFlashTiming &timing) { this->timing = timing; return *this; };
+
+    /**
+     * @brief Get the total simulated device time for all operations in nanoseconds
+     */
+    uint64_t getSimulatedNs() const { return readNs + programNs + eraseNs; };
+
+    /**
+     * @brief Clear the operation counters and simulated times
+     */
+    void resetCounters();
+
+    /**
+     * @brief Print the operation counts and simulated times to stdout
+     * 
+     * @param msg Message to print at the beginning of the line
+     */
+    void printTiming(const char *msg) const;
+
+    /**
+     * @brief Save the contents of the flash to a raw image file (erased bytes are 0xff)
+     * 
+     * @param path Pathname of the file to create or overwrite
+     * @return true on success, false if the file could not be written
+     * 
+     * The file can be opened later using FileMode::OPEN_IMAGE, such as to save the state of a
+     * failed test for debugging. This does not affect the operation counters or simulated time.
+     */
+    bool saveImage(const char *path) const;
+
     size_t pageSize = 256;
     size_t sectorSize = 4096;
 
-    uint8_t *buffer;
+    SpiFlashTiming timing = TIMING_WINBOND_W25Q128JV; //!< Timing parameters, see withTiming()
+    uint64_t readNs = 0; //!< Simulated time for read operations in nanoseconds
+    uint64_t programNs = 0; //!< Simulated time for page program operations, including write enable and status polling
+    uint64_t eraseNs = 0; //!< Simulated time for erase operations, including write enable and status polling
+
+    size_t readCount = 0; //!< Number of calls to readData()
+    size_t readByteCount = 0; //!< Number of bytes read by readData()
+    size_t writeCount = 0; //!< Number of calls to writeData()
+    size_t pageProgramCount = 0; //!< Number of page program operations done by writeData()
+    size_t sectorEraseCount = 0; //!< Number of calls to sectorErase()
+    size_t blockErase32KCount = 0; //!< Number of calls to blockErase32K()
+    size_t blockErase64KCount = 0; //!< Number of calls to blockErase() (64K)
+
+    uint8_t *buffer; //!< Contents of the flash, or the memory-mapped file. nullptr if the file could not be opened.
     size_t size;
+    int fd = -1; //!< File descriptor when using the file constructor
+    bool inverted = false; //!< True if buffer stores the bitwise inverse of the flash contents (FileMode::CREATE_SPARSE and OPEN_SPARSE)
+
+protected:
+    /**
+     * @brief Used internally to set a range of bytes to 0xff
+     */
+    void eraseRange(size_t addr, size_t len);
+
+    /**
+     * @brief Simulated time for a SPI transaction of len bytes, including the command and address
+     */
+    uint64_t transactionNs(size_t len) const;
+
+    /**
+     * @brief Number of address bytes, 4 for chips larger than 16 Mbyte, otherwise 3
+     */
+    size_t addressBytes() const { return (size > 16 * 1024 * 1024) ? 4 : 3; };
+
+    /**
+     * @brief Simulated time for an erase, including write enable, the command, and status polling
+     */
+    uint64_t eraseOperationNs(uint64_t eraseTimeNs) const;
 };
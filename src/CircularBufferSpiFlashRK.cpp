@@ -8,25 +8,69 @@ static Logger _log("app.circ");
 #define FATAL_ASSERT(x)
 #endif
 
+// Metrics are only compiled in if CIRCULARBUFFERSPIFLASHRK_METRICS is 1. The lock must be held.
+#if CIRCULARBUFFERSPIFLASHRK_METRICS
+#define METRICS_SCOPE(op) MetricsScope _metricsScope(*this, Metrics::op)
+#define METRICS_ADD(field, n) metrics.field += (n)
+#define METRICS_OP_ADD(field, n) metrics.ops[metricsOp].field += (n)
+#else
+#define METRICS_SCOPE(op)
+#define METRICS_ADD(field, n)
+#define METRICS_OP_ADD(field, n)
+#endif
+
+// Trace entries are only compiled in if CIRCULARBUFFERSPIFLASHRK_TRACE is 1. The lock must be held.
+#if CIRCULARBUFFERSPIFLASHRK_TRACE
+#define TRACE_SCOPE(event, sectorNum, sequence) TraceScope _traceScope(*this, TraceEntry::event, sectorNum, sequence)
+#define TRACE_DATA(value) _traceScope.entry.data = (uint16_t)(value)
+#else
+#define TRACE_SCOPE(event, sectorNum, sequence)
+#define TRACE_DATA(value)
+#endif
+
 CircularBufferSpiFlashRK::CircularBufferSpiFlashRK(SpiFlash *spiFlash, size_t addrStart, size_t addrEnd) :
-    spiFlash(spiFlash), addrStart(addrStart), addrEnd(addrEnd) {
+    CircularBufferSpiFlashRK(spiFlash, addrStart, addrEnd, spiFlash->getSectorSize()) {
+
+}
+
+CircularBufferSpiFlashRK::CircularBufferSpiFlashRK(SpiFlash *spiFlash, size_t addrStart, size_t addrEnd, size_t sectorSize) :
+    spiFlash(spiFlash), addrStart(addrStart), addrEnd(addrEnd), sectorSize(sectorSize), deviceSectorSize(spiFlash->getSectorSize()) {
 
 #ifndef UNITTEST
     os_mutex_recursive_create(&mutex);
 #endif
 
-    if ((addrStart % spiFlash->getSectorSize()) != 0) {
-        _log.error("addrStart is not sector aligned addr=%d sectorSize=%d", (int)addrStart, (int)spiFlash->getSectorSize());
+    // Sector size must be a power of 2 so address calculations can be done using shifts
+    sectorShift = 0;
+    while(((size_t)1 << sectorShift) < sectorSize) {
+        sectorShift++;
+    }
+    if (((size_t)1 << sectorShift) != sectorSize) {
+        _log.error("sectorSize is not a power of 2 sectorSize=%d", (int)sectorSize);
+        FATAL_ASSERT(); // Only used for off-device unit tests
+    }
+    if (sectorSize < deviceSectorSize || (sectorSize % deviceSectorSize) != 0 || sectorSize > 65536) {
+        // The 16-bit fields in RecordCommon and SectorCommon limit the sector size to 64K
+        _log.error("sectorSize %d is not supported with device sectorSize=%d", (int)sectorSize, (int)deviceSectorSize);
+        FATAL_ASSERT(); // Only used for off-device unit tests
+    }
+
+    if ((addrStart & (sectorSize - 1)) != 0) {
+        _log.error("addrStart is not sector aligned addr=%d sectorSize=%d", (int)addrStart, (int)sectorSize);
     }
-    if ((addrEnd % spiFlash->getSectorSize()) != 0) {
-        _log.error("addrEnd is not sector aligned addr=%d sectorSize=%d", (int)addrEnd, (int)spiFlash->getSectorSize());
+    if ((addrEnd & (sectorSize - 1)) != 0) {
+        _log.error("addrEnd is not sector aligned addr=%d sectorSize=%d", (int)addrEnd, (int)sectorSize);
     }
-    sectorCount = (addrEnd - addrStart) / spiFlash->getSectorSize();
-    _log.trace("addrStart=0x%x addrEnd=0x%x sectorSize=%d sectorCount=%d", (int)addrStart, (int)addrEnd, (int)spiFlash->getSectorSize(), (int)sectorCount);
+    sectorCount = (addrEnd - addrStart) >> sectorShift;
+
+    pageSize = spiFlash->getPageSize();
+    pageBuf = new uint8_t[pageSize];
+    _log.trace("addrStart=0x%x addrEnd=0x%x sectorSize=%d sectorCount=%d", (int)addrStart, (int)addrEnd, (int)sectorSize, (int)sectorCount);
 
-    // SectorCommon structure is 8 bytes
-    // A 1 MB flash chip has 256 sectors (4096 bytes each), so sectorMeta would be 2048 bytes.
-    // This is a reasonable allocation as it greatly reduces the number of reads during normal operation.
+    // SectorCommon structure is 12 bytes
+    // A 1 MB flash chip has 256 sectors (4096 bytes each), so sectorMeta would be 3072 bytes. This greatly 
+    // reduces the number of reads during normal operation, but grows with the number of sectors: a 1 GB
+    // buffer needs 3 MB with 4096 byte sectors or 192 KB with 65536 byte sectors. See the README.
     sectorMeta = new SectorCommon[sectorCount];
     if (!sectorMeta) {
         _log.error("could not allocate sectorMeta sectorCount=%d", (int)sectorCount);
@@ -36,13 +80,42 @@ CircularBufferSpiFlashRK::CircularBufferSpiFlashRK(SpiFlash *spiFlash, size_t ad
 }
 
 CircularBufferSpiFlashRK::~CircularBufferSpiFlashRK() {
+    flushPageBuffer();
     clearCache();
 
+    if (pageBuf) {
+        delete[] pageBuf;
+        pageBuf = nullptr;
+    }
+    if (tailCache) {
+        delete[] tailCache;
+        tailCache = nullptr;
+    }
+    if (readAheadBuf) {
+        delete[] readAheadBuf;
+        readAheadBuf = nullptr;
+    }
+    if (leases) {
+        delete[] leases;
+        leases = nullptr;
+    }
+#if CIRCULARBUFFERSPIFLASHRK_TRACE
+    if (traceBuf) {
+        delete[] traceBuf;
+        traceBuf = nullptr;
+    }
+#endif
+
     if (sectorMeta) {
         delete[] sectorMeta;
         sectorMeta = nullptr;
     }
 
+    if (sectorTimeRanges) {
+        delete[] sectorTimeRanges;
+        sectorTimeRanges = nullptr;
+    }
+
 #ifndef UNITTEST
     os_mutex_recursive_destroy(&mutex);
 #endif
@@ -51,10 +124,27 @@ CircularBufferSpiFlashRK::~CircularBufferSpiFlashRK() {
 
 bool CircularBufferSpiFlashRK::load() {
 
+    WITH_LOCK(*this) {
+        if (recordWriterOpen) {
+            _log.error("%s not allowed while a record is open", "load");
+            return false;
+        }
+
+        // Write any buffered records so they're included in the reload
+        flushPageBuffer();
+    }
+
     clearCache();
 
     WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_OTHER);
+
         isValid = false;
+        tailCacheLen = 0;
+        readAheadLen = 0;
+        leaseCount = 0;
+        typeReadMask = 0;
+        priorityDoneSequence = 0;
 
         if (!sectorMeta) {
             _log.error("sectorMeta not allocated");
@@ -71,9 +161,32 @@ bool CircularBufferSpiFlashRK::load() {
         for(int sectorIndex = 0; sectorIndex < (int)sectorCount; sectorIndex++) {
             SectorHeader sectorHeader;
 
-            spiFlash->readData(addrStart + sectorIndex * spiFlash->getSectorSize(), &sectorHeader, sizeof(SectorHeader));
+            if (sectorTimeRanges && sectorIndex > 0) {
+                // The time range at the end of the previous sector is read with this header in a single read
+                struct {
+                    SectorTimeRange timeRange;
+                    SectorHeader sectorHeader;
+                } __attribute__((__packed__)) timeRangeAndHeader;
+
+                spiFlash->readData(sectorNumToAddr(sectorIndex) - sizeof(SectorTimeRange), &timeRangeAndHeader, sizeof(timeRangeAndHeader));
+                METRICS_OP_ADD(spiReads, 1);
+                METRICS_OP_ADD(spiReadBytes, sizeof(timeRangeAndHeader));
+                sectorTimeRanges[sectorIndex - 1] = timeRangeAndHeader.timeRange;
+                sectorHeader = timeRangeAndHeader.sectorHeader;
+            }
+            else {
+                spiFlash->readData(sectorNumToAddr(sectorIndex), &sectorHeader, sizeof(SectorHeader));
+                METRICS_OP_ADD(spiReads, 1);
+                METRICS_OP_ADD(spiReadBytes, sizeof(SectorHeader));
+            }
             sectorMeta[sectorIndex] = sectorHeader.c;
 
+            if (sectorHeader.sectorMagic == SECTOR_MAGIC && sectorHeader.c.sectorShift != sectorShift) {
+                _log.error("sector %d formatted with sectorSize=%d not %d", (int)sectorIndex, (int)(1 << sectorHeader.c.sectorShift), (int)sectorSize);
+                isValid = false;
+                break;
+            }
+
             if (sectorHeader.sectorMagic == SECTOR_MAGIC) {
                 if (sectorHeader.c.sequence < firstSequence) {
                     firstSequence = sectorHeader.c.sequence;
@@ -91,7 +204,12 @@ bool CircularBufferSpiFlashRK::load() {
                 // _log.trace("loading sectorIndex=%d sequence=%d flags=0x%x", sectorIndex, (int)sectorHeader.c.sequence, (int)sectorHeader.c.flags);
             }
             else {
-                _log.error("sector %d invalid magic 0x%x", (int)sectorIndex, (int)sectorHeader.sectorMagic);
+                if (sectorHeader.sectorMagic == SECTOR_MAGIC_V1) {
+                    _log.error("sector %d uses old format, must be formatted", (int)sectorIndex);
+                }
+                else {
+                    _log.error("sector %d invalid magic 0x%x", (int)sectorIndex, (int)sectorHeader.sectorMagic);
+                }
                 sectorMeta[sectorIndex].flags &= ~SECTOR_FLAG_CORRUPTED_MASK;
 
                 FATAL_ASSERT(); // Only used for off-device unit tests
@@ -123,6 +241,21 @@ bool CircularBufferSpiFlashRK::load() {
         }
 
 
+        if (isValid) {
+            // Sectors kept after all of their records were read are skipped by readData()
+            readSequence = firstSequence;
+            uint32_t sectorNum;
+            while(readSequence < writeSequence && sequenceToSectorNum(readSequence, sectorNum) && (sectorMeta[sectorNum].flags & SECTOR_FLAG_RETAINED_MASK) == 0) {
+                readSequence++;
+            }
+
+            rebuildUsageStats();
+        }
+
+        if (isValid && sectorTimeRanges) {
+            rebuildTimeIndex();
+        }
+
         _log.trace("firstSequence=%d writeSequence=%d lastSequence=%d", (int)firstSequence, (int)writeSequence, (int)lastSequence);
     }
 
@@ -134,10 +267,19 @@ bool CircularBufferSpiFlashRK::format() {
     bool bResult = false;
 
     WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_OTHER);
+
+        if (recordWriterOpen) {
+            _log.error("%s not allowed while a record is open", "format");
+            return false;
+        }
 
         uint32_t sequence = 1;
 
-        for(uint16_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
+        // Buffered records are discarded as the whole buffer is erased
+        pageBufLen = 0;
+
+        for(uint32_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
             writeSectorHeader(sectorNum, true /* erase */, sequence++);
         }
     }
@@ -168,7 +310,7 @@ bool CircularBufferSpiFlashRK::fsck(bool repair) {
 
 
 
-CircularBufferSpiFlashRK::Sector *CircularBufferSpiFlashRK::getSectorFromCache(uint16_t sectorNum) {
+CircularBufferSpiFlashRK::Sector *CircularBufferSpiFlashRK::getSectorFromCache(uint32_t sectorNum) {
     CircularBufferSpiFlashRK::Sector *pSector = nullptr;
     sectorNum %= sectorCount;
 
@@ -184,13 +326,17 @@ CircularBufferSpiFlashRK::Sector *CircularBufferSpiFlashRK::getSectorFromCache(u
 }
 
 
-CircularBufferSpiFlashRK::Sector *CircularBufferSpiFlashRK::getSector(uint16_t sectorNum) {
+CircularBufferSpiFlashRK::Sector *CircularBufferSpiFlashRK::getSector(uint32_t sectorNum) {
     sectorNum %= sectorCount;
 
     CircularBufferSpiFlashRK::Sector *pSector = getSectorFromCache(sectorNum);
 
-    if (!pSector) {
+    if (pSector) {
+        METRICS_ADD(sectorCacheHits, 1);
+    }
+    else {
         // Not found in cache
+        METRICS_ADD(sectorCacheMisses, 1);
         if (sectorCache.size() >= SECTOR_CACHE_SIZE) {
             delete sectorCache.back();
             sectorCache.pop_back();
@@ -212,7 +358,7 @@ CircularBufferSpiFlashRK::Sector *CircularBufferSpiFlashRK::getSector(uint16_t s
 
 
 
-bool CircularBufferSpiFlashRK::readSector(uint16_t sectorNum, Sector *sector) {
+bool CircularBufferSpiFlashRK::readSector(uint32_t sectorNum, Sector *sector) {
     sectorNum %= sectorCount;
 
     if (!isValid) {
@@ -220,11 +366,22 @@ bool CircularBufferSpiFlashRK::readSector(uint16_t sectorNum, Sector *sector) {
         return false;
     }
 
+    TRACE_SCOPE(EVENT_READ_SECTOR, sectorNum, sectorMeta[sectorNum].sequence);
+
     size_t addr = sectorNumToAddr(sectorNum);
 
     sector->clear(sectorNum);
 
     sector->c = sectorMeta[sectorNum];
+
+    if ((sector->c.flags & (SECTOR_FLAG_FINALIZED_MASK | SECTOR_FLAG_FOOTER_MASK)) == 0) {
+        // Finalized sector with a footer can be indexed with a single read
+        if (readSectorFooter(sectorNum, sector)) {
+            TRACE_DATA(sector->records.size());
+            return true;
+        }
+        sector->records.clear();
+    }
     /*
     // Read header
     SectorHeader sectorHeader;
@@ -242,12 +399,17 @@ bool CircularBufferSpiFlashRK::readSector(uint16_t sectorNum, Sector *sector) {
     */
     
     // Read records
-    uint16_t offset = sizeof(SectorHeader);
-    while((offset + sizeof(RecordCommon)) < spiFlash->getSectorSize()) {
+    uint32_t offset = sizeof(SectorHeader);
+    while((offset + sizeof(RecordCommon)) < sectorSize) {
         RecordCommon recordCommon;
-        spiFlash->readData(addr + offset, &recordCommon, sizeof(RecordCommon));
+        readFlash(addr + offset, &recordCommon, sizeof(RecordCommon));
         
         if (recordCommon.size == RECORD_SIZE_ERASED) {
+            if (recordCommon.flags != 0xff || recordCommon.typeTag != 0xff) {
+                // Record from openRecord() that was not committed, the space after it may contain
+                // partial data so nothing more can be written to this sector
+                sector->full = true;
+            }
             // Erased, no more data
             break;
         }
@@ -255,12 +417,12 @@ bool CircularBufferSpiFlashRK::readSector(uint16_t sectorNum, Sector *sector) {
         const char *corruptedError = nullptr;
 
 
-        if (recordCommon.size >= (spiFlash->getSectorSize() - sizeof(RecordCommon) - sizeof(SectorHeader))) {
+        if (recordCommon.size > getMaxRecordSize()) {
             corruptedError = "invalid size";
         }
 
-        uint16_t nextOffset = offset + sizeof(RecordCommon) + recordCommon.size;
-        if (nextOffset > spiFlash->getSectorSize()) {
+        uint32_t nextOffset = offset + sizeof(RecordCommon) + recordCommon.size;
+        if (nextOffset > sectorSize) {
             corruptedError = "invalid offset";
         }
 
@@ -276,22 +438,160 @@ bool CircularBufferSpiFlashRK::readSector(uint16_t sectorNum, Sector *sector) {
 
         offset = nextOffset;
     }
+
+    TRACE_DATA(sector->records.size());
     
     return true;
 }
 
-bool CircularBufferSpiFlashRK::writeSectorHeader(uint16_t sectorNum, bool erase, uint32_t sequence) {
+bool CircularBufferSpiFlashRK::readSectorFooter(uint32_t sectorNum, Sector *sector) {
+    size_t addr = sectorNumToAddr(sectorNum);
+
+    // recordCount in the sector header does not include aborted records, so it's usually the number of
+    // entries in the footer. If not, the footer has the actual count and it's read again.
+    size_t recordCount = sector->c.recordCount;
+
+    // The footer ends before the time range, if there is one
+    size_t footerEnd = CircularBufferFormat::getFooterEnd(sectorSize, sector->c.flags);
+
+    for(int tries = 0; tries < 2; tries++) {
+        size_t footerSize = CircularBufferFormat::getFooterSize(recordCount);
+        if ((sizeof(SectorHeader) + sizeof(RecordCommon) + footerSize) > footerEnd) {
+            break;
+        }
+
+        uint8_t *footerBuf = new uint8_t[footerSize];
+        if (!footerBuf) {
+            break;
+        }
+        readFlash(addr + footerEnd - footerSize, footerBuf, footerSize);
+
+        SectorFooter footer;
+        memcpy(&footer, &footerBuf[footerSize - sizeof(SectorFooter)], sizeof(SectorFooter));
+
+        if (footer.footerMagic != SECTOR_FOOTER_MAGIC) {
+            _log.error("%s invalid footer sectorNum=%d", "readSectorFooter", (int)sectorNum);
+            delete[] footerBuf;
+            break;
+        }
+        if (footer.recordCount != recordCount) {
+            // Has aborted records
+            recordCount = footer.recordCount;
+            delete[] footerBuf;
+            continue;
+        }
+
+        const uint8_t *bitmap = &footerBuf[recordCount * sizeof(RecordCommon)];
+        uint32_t offset = sizeof(SectorHeader);
+        bool bResult = true;
+
+        for(size_t index = 0; index < recordCount; index++) {
+            RecordCommon recordCommon;
+            memcpy(&recordCommon, &footerBuf[index * sizeof(RecordCommon)], sizeof(RecordCommon));
+
+            offset += sizeof(RecordCommon) + recordCommon.size;
+            if (recordCommon.size > getMaxRecordSize() || (offset + sizeof(RecordCommon) + footerSize) > footerEnd) {
+                _log.error("%s invalid record %d sectorNum=%d", "readSectorFooter", (int)index, (int)sectorNum);
+                bResult = false;
+                break;
+            }
+
+            if ((bitmap[index / 8] & (1 << (index % 8))) == 0) {
+                // Marked as read in the footer
+                recordCommon.flags &= ~RECORD_FLAG_READ_MASK;
+            }
+            sector->records.push_back(recordCommon);
+        }
+        delete[] footerBuf;
+
+        return bResult;
+    }
+
+    return false;
+}
+
+bool CircularBufferSpiFlashRK::writeSectorFooter(Sector *pSector) {
+    size_t recordCount = pSector->records.size();
+    size_t footerSize = CircularBufferFormat::getFooterSize(recordCount);
+    size_t footerEnd = CircularBufferFormat::getFooterEnd(sectorSize, pSector->c.flags);
+
+    // Leave at least one erased RecordCommon after the last record so walking the records stops there
+    if (!sectorFooter || recordCount == 0 || recordCount > 0xffff || pSector->full || (pSector->getLastOffset() + sizeof(RecordCommon) + footerSize) > footerEnd) {
+        return false;
+    }
+
+    uint8_t *footerBuf = new uint8_t[footerSize];
+    if (!footerBuf) {
+        return false;
+    }
+
+    for(size_t index = 0; index < recordCount; index++) {
+        memcpy(&footerBuf[index * sizeof(RecordCommon)], &pSector->records[index], sizeof(RecordCommon));
+    }
+
+    // The read bitmap starts out erased; records already read have the bit cleared in the RecordCommon copy
+    memset(&footerBuf[recordCount * sizeof(RecordCommon)], 0xff, (recordCount + 7) / 8);
+
+    SectorFooter footer;
+    footer.recordCount = (uint16_t) recordCount;
+    footer.footerMagic = SECTOR_FOOTER_MAGIC;
+    memcpy(&footerBuf[footerSize - sizeof(SectorFooter)], &footer, sizeof(SectorFooter));
+
+    programFlash(sectorNumToAddr(pSector->sectorNum) + footerEnd - footerSize, footerBuf, footerSize);
+
+    delete[] footerBuf;
+
+    return true;
+}
+
+bool CircularBufferSpiFlashRK::writeSectorTimeRange(Sector *pSector) {
+    if (!sectorTimeRanges || pSector->full) {
+        return false;
+    }
+
+    const SectorTimeRange &timeRange = sectorTimeRanges[pSector->sectorNum];
+    if (timeRange.minTimestamp > timeRange.maxTimestamp) {
+        // No records
+        return false;
+    }
+
+    // Leave at least one erased RecordCommon after the last record so walking the records stops there
+    if ((pSector->getLastOffset() + sizeof(RecordCommon) + sizeof(SectorTimeRange)) > sectorSize) {
+        return false;
+    }
+
+    programFlash(sectorNumToAddr(pSector->sectorNum) + sectorSize - sizeof(SectorTimeRange), &timeRange, sizeof(SectorTimeRange));
+
+    return true;
+}
+
+void CircularBufferSpiFlashRK::updateSectorTimeRange(uint32_t sectorNum, uint32_t timestamp) {
+    if (sectorTimeRanges) {
+        SectorTimeRange &timeRange = sectorTimeRanges[sectorNum];
+        if (timestamp < timeRange.minTimestamp) {
+            timeRange.minTimestamp = timestamp;
+        }
+        if (timestamp > timeRange.maxTimestamp) {
+            timeRange.maxTimestamp = timestamp;
+        }
+    }
+}
+
+bool CircularBufferSpiFlashRK::writeSectorHeader(uint32_t sectorNum, bool erase, uint32_t sequence) {
 
     // Don't check isValid here, because this function is used to format flash. before it's valid
 
     sectorNum %= sectorCount;
 
+    TRACE_SCOPE(EVENT_WRITE_SECTOR_HEADER, sectorNum, sequence);
+    TRACE_DATA(erase ? 1 : 0);
+
     size_t addr = sectorNumToAddr(sectorNum);
 
     // _log.trace("writeSectorHeader sectorNum=%d addr=0x%x sequence=%d", (int)sectorNum, (int)addr, (int)sequence);
 
     if (erase) {
-        spiFlash->sectorErase(addr);
+        eraseSector(sectorNum);
     }
 
     // Update SPI flash
@@ -299,13 +599,19 @@ bool CircularBufferSpiFlashRK::writeSectorHeader(uint16_t sectorNum, bool erase,
     sectorHeader.sectorMagic = SECTOR_MAGIC;
     sectorHeader.c.sequence = sequence;    
     sectorHeader.c.flags = ~0;
-    sectorHeader.c.reserved = ~0;
+    sectorHeader.c.sectorShift = sectorShift;
+    sectorHeader.c.typeBitmap = ~0;
     sectorHeader.c.recordCount = ~0;
     sectorHeader.c.dataSize = ~0;
-    spiFlash->writeData(addr, &sectorHeader, sizeof(SectorHeader));
+    programFlash(addr, &sectorHeader, sizeof(SectorHeader));
 
     // Update metadata in RAM
     sectorMeta[sectorNum] = sectorHeader.c;
+    if (sectorTimeRanges) {
+        // Empty, minTimestamp > maxTimestamp
+        sectorTimeRanges[sectorNum].minTimestamp = 0xffffffff;
+        sectorTimeRanges[sectorNum].maxTimestamp = 0;
+    }
 
     // Update cache
     Sector *pSector = getSectorFromCache(sectorNum);
@@ -319,7 +625,42 @@ bool CircularBufferSpiFlashRK::writeSectorHeader(uint16_t sectorNum, bool erase,
 
 
 
-bool CircularBufferSpiFlashRK::appendDataToSector(Sector *pSector, const DataBuffer &data, uint16_t flags) {
+void CircularBufferSpiFlashRK::eraseSector(uint32_t sectorNum) {
+    size_t addr = sectorNumToAddr(sectorNum);
+
+    if (pageBufLen && pageBufAddr >= addr && pageBufAddr < (addr + sectorSize)) {
+        // Buffered data for this sector no longer applies
+        pageBufLen = 0;
+    }
+    if (tailCacheLen && tailCacheAddr >= addr && tailCacheAddr < (addr + sectorSize)) {
+        tailCacheLen = 0;
+    }
+    if (readAheadLen && readAheadAddr >= addr && readAheadAddr < (addr + sectorSize)) {
+        readAheadLen = 0;
+    }
+
+    size_t offset = 0;
+    while(offset < sectorSize) {
+        size_t remaining = sectorSize - offset;
+
+        if (remaining >= 65536 && blockErase64K(spiFlash, addr + offset, 0)) {
+            offset += 65536;
+        }
+        else
+        if (remaining >= 32768 && blockErase32KFn) {
+            blockErase32KFn(addr + offset);
+            offset += 32768;
+        }
+        else {
+            spiFlash->sectorErase(addr + offset);
+            offset += deviceSectorSize;
+        }
+        METRICS_OP_ADD(spiErases, 1);
+    }
+}
+
+
+bool CircularBufferSpiFlashRK::appendDataToSector(Sector *pSector, const DataBuffer &data, uint16_t flags, uint32_t timestamp, uint8_t type) {
 
     if (!isValid) {
         _log.error("%s not isValid", "appendDataToSector");
@@ -329,33 +670,63 @@ bool CircularBufferSpiFlashRK::appendDataToSector(Sector *pSector, const DataBuf
 
     size_t addr = sectorNumToAddr(pSector->sectorNum);
 
-    uint16_t offset = pSector->getLastOffset();
+    uint32_t offset = pSector->getLastOffset();
+
+    RecordCommon recordCommon;
+    recordCommon.flags = flags;
+    recordCommon.typeTag = CircularBufferFormat::getTypeTag(type);
+
+    size_t timestampSize = CircularBufferFormat::getTimestampSize(recordCommon);
+    size_t size = timestampSize + data.size();
 
-    uint16_t spaceLeft = spiFlash->getSectorSize() - offset;
-    if ((data.size() + sizeof(RecordCommon)) > spaceLeft) {
+    size_t spaceLeft = sectorSize - offset;
+    if (pSector->full || (size + sizeof(RecordCommon)) > spaceLeft) {
         return false;
     }
 
-    if ((pSector->c.flags & SECTOR_FLAG_STARTED_MASK) == SECTOR_FLAG_STARTED_MASK) {
-        // First use of this sector
-        pSector->c.flags &= ~SECTOR_FLAG_STARTED_MASK;
-        sectorMeta[pSector->sectorNum] = pSector->c;
-        spiFlash->writeData(addr + offsetof(SectorHeader, c), &pSector->c, sizeof(SectorCommon));
-    }
+    startSector(pSector);
 
+    TRACE_SCOPE(EVENT_APPEND, pSector->sectorNum, pSector->c.sequence);
+    TRACE_DATA(size);
 
-    RecordCommon recordCommon;
-    recordCommon.flags = flags;
-    recordCommon.size = data.size();
+    recordCommon.size = size;
     pSector->records.push_back(recordCommon);
 
-    spiFlash->writeData(addr + offset, &recordCommon, sizeof(RecordCommon));
+    usageStats.recordCount++;
+    usageStats.dataSize += size;
+    writeSectorFree = sectorSize - (offset + sizeof(RecordCommon) + size);
+
+    updateSectorTimeRange(pSector->sectorNum, timestampSize ? timestamp : 0);
+    addSectorType(pSector, type);
 
-    spiFlash->writeData(addr + offset + sizeof(RecordCommon), data.getBuffer(), data.size());
+    // The RecordCommon, timestamp, and data are combined into one program operation per flash page
+    writeFlash(addr + offset, &recordCommon, sizeof(RecordCommon));
+    if (timestampSize) {
+        writeFlash(addr + offset + sizeof(RecordCommon), &timestamp, timestampSize);
+    }
+    writeFlash(addr + offset + sizeof(RecordCommon) + timestampSize, data.getBuffer(), data.size());
+
+    if (!writeBuffering) {
+        flushPageBuffer();
+    }
 
     return true;
 }
 
+void CircularBufferSpiFlashRK::addSectorType(Sector *pSector, uint8_t type) {
+    pSector->c.typeBitmap &= ~(1 << type);
+    sectorMeta[pSector->sectorNum].typeBitmap = pSector->c.typeBitmap;
+}
+
+void CircularBufferSpiFlashRK::startSector(Sector *pSector) {
+    if ((pSector->c.flags & SECTOR_FLAG_STARTED_MASK) == SECTOR_FLAG_STARTED_MASK) {
+        // First use of this sector
+        pSector->c.flags &= ~SECTOR_FLAG_STARTED_MASK;
+        sectorMeta[pSector->sectorNum] = pSector->c;
+        programFlash(sectorNumToAddr(pSector->sectorNum) + offsetof(SectorHeader, c), &pSector->c, sizeof(SectorCommon));
+    }
+}
+
 bool CircularBufferSpiFlashRK::finalizeSector(Sector *pSector) {
     if (!isValid) {
         _log.error("%s not isValid", "finalizeSector");
@@ -363,19 +734,48 @@ bool CircularBufferSpiFlashRK::finalizeSector(Sector *pSector) {
         return false;
     }
 
+    TRACE_SCOPE(EVENT_FINALIZE, pSector->sectorNum, pSector->c.sequence);
+
+    // Finalizing a sector is a durability point for buffered writes
+    flushPageBuffer();
+
+    if ((pSector->c.flags & SECTOR_FLAG_FINALIZED_MASK) != 0) {
+        usageStats.freeSectors--;
+    }
     pSector->c.flags &= ~SECTOR_FLAG_FINALIZED_MASK;
     pSector->c.recordCount = pSector->c.dataSize = 0;
 
     for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++) {
+        if ((iter->flags & RECORD_FLAG_ABORTED_MASK) == 0) {
+            // Aborted records are not counted
+            continue;
+        }
         pSector->c.recordCount++;
         pSector->c.dataSize += iter->size;
     }
 
     size_t addr = sectorNumToAddr(pSector->sectorNum);
-    spiFlash->writeData(addr + offsetof(SectorHeader, c), &pSector->c, sizeof(SectorCommon));
+    programFlash(addr + offsetof(SectorHeader, c), &pSector->c, sizeof(SectorCommon));
+
+    // The flags are cleared after the time range and footer are written, so ones interrupted by reset 
+    // are not used. The time range is written first because the footer ends before it.
+    unsigned int trailerFlags = 0;
+    if (writeSectorTimeRange(pSector)) {
+        trailerFlags |= SECTOR_FLAG_TIME_RANGE_MASK;
+        pSector->c.flags &= ~SECTOR_FLAG_TIME_RANGE_MASK;
+    }
+    if (writeSectorFooter(pSector)) {
+        trailerFlags |= SECTOR_FLAG_FOOTER_MASK;
+        pSector->c.flags &= ~SECTOR_FLAG_FOOTER_MASK;
+    }
+    if (trailerFlags) {
+        programFlash(addr + offsetof(SectorHeader, c), &pSector->c, sizeof(SectorCommon));
+    }
 
     sectorMeta[pSector->sectorNum] = pSector->c;
 
+    TRACE_DATA(pSector->c.recordCount);
+
     validateSector(pSector);
 
     return true;
@@ -395,11 +795,11 @@ bool CircularBufferSpiFlashRK::readDataFromSector(Sector *pSector, size_t index,
 
     size_t curIndex = 0;
 
-    uint16_t offset = sizeof(SectorHeader);
+    uint32_t offset = sizeof(SectorHeader);
     for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++, curIndex++) {
         if (index == curIndex) {
             uint8_t *dataBuf = data.allocate(iter->size);
-            spiFlash->readData(addr + offset + sizeof(RecordCommon), dataBuf, data.size());
+            readFlash(addr + offset + sizeof(RecordCommon), dataBuf, data.size());
 
             meta = *iter;
             bResult = true;
@@ -413,20 +813,20 @@ bool CircularBufferSpiFlashRK::readDataFromSector(Sector *pSector, size_t index,
 
 
 bool CircularBufferSpiFlashRK::validateSector(Sector *pSector) {
-#ifdef UNITTEST
+#if defined(UNITTEST) && !defined(UNITTEST_NO_VALIDATE)
     #define VALIDATE_SECTOR_ASSERT() do { pSector->log(LOG_LEVEL_TRACE, "validate"); assert(false); } while(0)
     if (!isValid) {
         _log.error("%s not isValid", "validateSector");
         return false;
     }
-    assert(sizeof(SectorHeader) == 12);
-    assert(sizeof(SectorCommon) == 8);
-    assert(sizeof(RecordCommon) == 2);
+    assert(sizeof(SectorHeader) == 16);
+    assert(sizeof(SectorCommon) == 12);
+    assert(sizeof(RecordCommon) == 4);
 
     size_t addr = sectorNumToAddr(pSector->sectorNum);
 
     SectorHeader sectorHeader;
-    spiFlash->readData(addr, &sectorHeader, sizeof(SectorHeader));
+    readFlash(addr, &sectorHeader, sizeof(SectorHeader));
 
     if (sectorHeader.sectorMagic != SECTOR_MAGIC) {
         _log.error("%s invalid sectorMagic=%08x sectorNum=%d", "validateSector", (int)sectorHeader.sectorMagic, (int)pSector->sectorNum);
@@ -458,13 +858,51 @@ bool CircularBufferSpiFlashRK::validateSector(Sector *pSector) {
         return false;
     }
 
+    if ((sectorHeader.c.flags & SECTOR_FLAG_FINALIZED_MASK) == 0 && sectorHeader.c.typeBitmap != sectorMeta[pSector->sectorNum].typeBitmap) {
+        _log.error("%s typeBitmap on flash 0x%x does not match sectorMeta 0x%x", "validateSector", (int)sectorHeader.c.typeBitmap, (int)sectorMeta[pSector->sectorNum].typeBitmap);
+        VALIDATE_SECTOR_ASSERT();
+        return false;
+    }
+
+    if ((sectorHeader.c.flags & (SECTOR_FLAG_FINALIZED_MASK | SECTOR_FLAG_TIME_RANGE_MASK)) == 0 && sectorTimeRanges) {
+        SectorTimeRange timeRange;
+        readFlash(addr + sectorSize - sizeof(SectorTimeRange), &timeRange, sizeof(SectorTimeRange));
+        if (timeRange.minTimestamp != sectorTimeRanges[pSector->sectorNum].minTimestamp || timeRange.maxTimestamp != sectorTimeRanges[pSector->sectorNum].maxTimestamp) {
+            _log.error("%s time range on flash %lu-%lu does not match sectorTimeRanges", "validateSector", (unsigned long)timeRange.minTimestamp, (unsigned long)timeRange.maxTimestamp);
+            VALIDATE_SECTOR_ASSERT();
+            return false;
+        }
+    }
+
+    // With a footer, the read flag is in the footer instead of the RecordCommon
+    bool hasFooter = (sectorHeader.c.flags & (SECTOR_FLAG_FINALIZED_MASK | SECTOR_FLAG_FOOTER_MASK)) == 0;
+    unsigned int ignoreFlags = hasFooter ? RECORD_FLAG_READ_MASK : 0;
+
+    if (hasFooter) {
+        Sector footerSector;
+        footerSector.clear(pSector->sectorNum);
+        footerSector.c = sectorHeader.c;
+        if (!readSectorFooter(pSector->sectorNum, &footerSector) || footerSector.records.size() != pSector->records.size()) {
+            _log.error("%s footer does not match records", "validateSector");
+            VALIDATE_SECTOR_ASSERT();
+            return false;
+        }
+        for(size_t ii = 0; ii < pSector->records.size(); ii++) {
+            if (footerSector.records[ii].size != pSector->records[ii].size || footerSector.records[ii].flags != pSector->records[ii].flags) {
+                _log.error("%s footer record %d does not match records", "validateSector", (int)ii);
+                VALIDATE_SECTOR_ASSERT();
+                return false;
+            }
+        }
+    }
+
     // Read records
-    uint16_t offset = sizeof(SectorHeader);
+    uint32_t offset = sizeof(SectorHeader);
     int recordNum = 0;
 
-    while((offset + sizeof(RecordCommon)) < spiFlash->getSectorSize()) {
+    while((offset + sizeof(RecordCommon)) < sectorSize) {
         RecordCommon recordCommon;
-        spiFlash->readData(addr + offset, &recordCommon, sizeof(RecordCommon));
+        readFlash(addr + offset, &recordCommon, sizeof(RecordCommon));
         
         if (recordCommon.size == RECORD_SIZE_ERASED) {
             // Erased, no more data
@@ -478,12 +916,12 @@ bool CircularBufferSpiFlashRK::validateSector(Sector *pSector) {
 
         const char *corruptedError = nullptr;
 
-        if (recordCommon.size >= (spiFlash->getSectorSize() - sizeof(RecordCommon) - sizeof(SectorHeader))) {
+        if (recordCommon.size > getMaxRecordSize()) {
             corruptedError = "invalid size";
         }
 
-        uint16_t nextOffset = offset + sizeof(RecordCommon) + recordCommon.size;
-        if (nextOffset > spiFlash->getSectorSize()) {
+        uint32_t nextOffset = offset + sizeof(RecordCommon) + recordCommon.size;
+        if (nextOffset > sectorSize) {
             corruptedError = "invalid offset";
         }
 
@@ -498,7 +936,7 @@ bool CircularBufferSpiFlashRK::validateSector(Sector *pSector) {
             VALIDATE_SECTOR_ASSERT();
             return false;
         }
-        if (recordCommon.flags != pSector->records.at(recordNum).flags) {
+        if ((recordCommon.flags | ignoreFlags) != (pSector->records.at(recordNum).flags | ignoreFlags)) {
             _log.error("%s record %d flags on flash 0x%x does not match records 0x%x", "validateSector", recordNum, (int)recordCommon.flags, (int)pSector->records.at(recordNum).flags);
             VALIDATE_SECTOR_ASSERT();
             return false;
@@ -518,272 +956,2125 @@ bool CircularBufferSpiFlashRK::validateSector(Sector *pSector) {
     return true;
 }
 
-bool CircularBufferSpiFlashRK::sequenceToSectorNum(uint32_t sequence, uint16_t &sectorNum) const {
-    bool bResult = false;
+bool CircularBufferSpiFlashRK::sequenceToSectorNum(uint32_t sequence, uint32_t &sectorNum) const {
+    // Sequence numbers are consecutive going around the ring (this is checked in load) and a
+    // sector is only ever reused with a sequence number sectorCount larger, so the sector number
+    // can be calculated from the sequence number of sector 0 instead of searching sectorMeta.
+    int64_t delta = (int64_t)sequence - (int64_t)sectorMeta[0].sequence;
+    uint32_t tempSectorNum = (uint32_t)(((delta % (int64_t)sectorCount) + (int64_t)sectorCount) % (int64_t)sectorCount);
 
-    for(uint16_t tempSectorNum = 0; tempSectorNum < sectorCount; tempSectorNum++) {
-        if (sectorMeta[tempSectorNum].sequence == sequence) {
-            sectorNum = tempSectorNum;
-            bResult = true;
-            break;
-        }   
+    if (sectorMeta[tempSectorNum].sequence != sequence) {
+        return false;
     }
-    return bResult;
+    sectorNum = tempSectorNum;
+    return true;
 }
 
-bool CircularBufferSpiFlashRK::readData(ReadInfo &readInfo) {
+bool CircularBufferSpiFlashRK::findNextRecord(ReadInfo &readInfo, Sector *&pSector) {
     bool bResult = false;
 
-    if (!isValid) {
-        _log.error("%s not isValid", "readData");
-        FATAL_ASSERT(); // Only used for off-device unit tests
+    if (!leaseAvailable()) {
         return false;
     }
 
-    WITH_LOCK(*this) {
-        for(int tries = 0; tries < 4; tries++) {
-            if (!sequenceToSectorNum(firstSequence, readInfo.sectorNum)) {
-                _log.error("%s firstSequence %d not found", "readData", (int)firstSequence);
-                FATAL_ASSERT(); // Only used for off-device unit tests
-                return false;
-            }
-
-            Sector *pSector = getSector(readInfo.sectorNum);
-            if (!pSector) {
-                _log.error("%s getSector %d failed", "readData", (int)readInfo.sectorNum);
-                FATAL_ASSERT(); // Only used for off-device unit tests
-                return false;
-            }
-
-            readInfo.sectorCommon = pSector->c;
-
-            size_t addr = sectorNumToAddr(readInfo.sectorNum);
+    // Each pass releases an empty finalized sector, or skips a sector whose unread records are all leased.
+    // There can be several in a row when records were read by type.
+    uint32_t sequence = getReadSequence();
+    for(size_t tries = 0; tries < sectorCount && sequence <= writeSequence; tries++) {
+        if (!sequenceToSectorNum(sequence, readInfo.sectorNum)) {
+            _log.error("%s sequence %d not found", "readData", (int)sequence);
+            FATAL_ASSERT(); // Only used for off-device unit tests
+            return false;
+        }
 
-            readInfo.index = 0;
+        pSector = getSector(readInfo.sectorNum);
+        if (!pSector) {
+            _log.error("%s getSector %d failed", "readData", (int)readInfo.sectorNum);
+            FATAL_ASSERT(); // Only used for off-device unit tests
+            return false;
+        }
 
-            uint16_t offset = sizeof(SectorHeader);
-            for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++, readInfo.index++) {
-                if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
-                    // Not marked as read
-                    uint8_t *dataBuf = readInfo.allocate(iter->size);
-                    spiFlash->readData(addr + offset + sizeof(RecordCommon), dataBuf, readInfo.size());
+        readInfo.sectorCommon = pSector->c;
 
-                    readInfo.recordCommon = *iter;
+        bool hasUnread = false;
+        uint32_t offset = sizeof(SectorHeader);
+        for(size_t index = 0; index < pSector->records.size(); index++) {
+            if ((pSector->records[index].flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+                // Not marked as read
+                hasUnread = true;
+                if (!isLeased(pSector, index)) {
+                    setReadInfo(readInfo, pSector, index, offset);
                     bResult = true;
                     break;
                 }
-                offset += sizeof(RecordCommon) + iter->size;
-            }
-            if (bResult) {
-                // Have data
-                break;
             }
+            offset += sizeof(RecordCommon) + pSector->records[index].size;
+        }
+        if (bResult) {
+            // Have data
+            addLease(readInfo);
+            break;
+        }
 
-            if ((pSector->c.flags & SECTOR_FLAG_FINALIZED_MASK) != 0) {
-                // No data yet and not finalized, wait for more
-                // _log.trace("%s not finalized in sector %d sequence=%d flags=0x%x firstSequence=%d writeSequence=%d", "readData", (int)readInfo.sectorNum, (int)pSector->c.sequence, (int)pSector->c.flags, (int)firstSequence, (int)writeSequence);        
-                break;
-            }
+        if ((pSector->c.flags & SECTOR_FLAG_FINALIZED_MASK) != 0) {
+            // No data yet and not finalized, wait for more
+            // _log.trace("%s not finalized in sector %d sequence=%d flags=0x%x firstSequence=%d writeSequence=%d", "readData", (int)readInfo.sectorNum, (int)pSector->c.sequence, (int)pSector->c.flags, (int)firstSequence, (int)writeSequence);        
+            break;
+        }
 
-            //_log.trace("%s called with no unread data in sector %d sequence=%d flags=0x%x firstSequence=%d writeSequence=%d", "readData", (int)readInfo.sectorNum, (int)pSector->c.sequence, (int)pSector->c.flags, (int)firstSequence, (int)writeSequence);        
-            //pSector->log(LOG_LEVEL_TRACE, "no data?");
+        //_log.trace("%s called with no unread data in sector %d sequence=%d flags=0x%x firstSequence=%d writeSequence=%d", "readData", (int)readInfo.sectorNum, (int)pSector->c.sequence, (int)pSector->c.flags, (int)firstSequence, (int)writeSequence);        
+        //pSector->log(LOG_LEVEL_TRACE, "no data?");
 
 
-            firstSequence++;
-            writeSectorHeader(readInfo.sectorNum, true /* erase */, ++lastSequence);
+        if (!hasUnread && sequence == getReadSequence()) {
+            releaseReadSector(pSector);
             //_log.trace("%s clearing finalized sector %d with no data, new empty seq %d", "readData", (int)readInfo.sectorNum, (int)lastSequence);            
         }
-
+        sequence++;
     }
 
     return bResult;
 }
 
-bool CircularBufferSpiFlashRK::markAsRead(const ReadInfo &readInfo) {
-    bool bResult = false;
-    if (!isValid) {
-        _log.error("%s not isValid", "markAsRead");
+bool CircularBufferSpiFlashRK::findNextRecordOfType(ReadInfo &readInfo, Sector *&pSector, uint16_t typeMask) {
+    if (!leaseAvailable()) {
         return false;
     }
 
-    WITH_LOCK(*this) {
+    // Sectors before typeReadSequence were already searched for these types. More records can only
+    // be added to the write sector, so the search resumes there at the latest.
+    uint32_t sequence = getReadSequence();
+    if (typeReadMask == typeMask && typeReadSequence > sequence && typeReadSequence <= writeSequence) {
+        sequence = typeReadSequence;
+    }
 
-        Sector *pSector = getSector(readInfo.sectorNum);
-        if (!pSector) {
-            _log.error("%s sector %d could not be read", "markAsRead", (int)readInfo.sectorNum);
+    bool bResult = false;
+
+    for(; sequence <= writeSequence; sequence++) {
+        uint32_t sectorNum;
+        if (!sequenceToSectorNum(sequence, sectorNum)) {
+            _log.error("%s sequence %d not found", "readData", (int)sequence);
             FATAL_ASSERT(); // Only used for off-device unit tests
             return false;
         }
 
-        if (pSector->c.sequence != readInfo.sectorCommon.sequence) {
-            _log.info("%s sector %d reused, not marking as read", "markAsRead", (int)readInfo.sectorNum);
-            return false;
+        if ((~sectorMeta[sectorNum].typeBitmap & typeMask) == 0) {
+            // No records of these types in this sector
+            continue;
         }
 
-        size_t addr = sectorNumToAddr(readInfo.sectorNum);
-
-        if ((readInfo.index + 1) >= pSector->records.size() && (pSector->c.flags & SECTOR_FLAG_FINALIZED_MASK) == 0) {
-            // This is the last record in the sector, erase the sector if finalized
-            firstSequence++;
-            writeSectorHeader(readInfo.sectorNum, true /* erase */, ++lastSequence);
+        pSector = getSector(sectorNum);
+        if (!pSector) {
+            _log.error("%s getSector %d failed", "readData", (int)sectorNum);
+            FATAL_ASSERT(); // Only used for off-device unit tests
+            return false;
         }
-        else {
-            // Just mark this record as read
-            size_t curIndex = 0;
-            uint16_t offset = sizeof(SectorHeader);
-            for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++, curIndex++) {
-                if (curIndex == readInfo.index) {
-                    iter->flags &= ~RECORD_FLAG_READ_MASK;
-                    spiFlash->writeData(addr + offset, &(*iter), sizeof(RecordCommon));
-                    
-                    break;
-                }
-                offset += sizeof(RecordCommon) + iter->size;
+
+        uint32_t offset = sizeof(SectorHeader);
+        for(size_t index = 0; index < pSector->records.size(); index++) {
+            if ((pSector->records[index].flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK && 
+                (typeMask & (1 << CircularBufferFormat::getRecordType(pSector->records[index]))) != 0 &&
+                !isLeased(pSector, index)) {
+                // Not marked as read, one of the requested types, and not leased
+                setReadInfo(readInfo, pSector, index, offset);
+                bResult = true;
+                break;
             }
+            offset += sizeof(RecordCommon) + pSector->records[index].size;
+        }
+        if (bResult) {
+            addLease(readInfo);
+            break;
+        }
+    }
+
+    typeReadMask = typeMask;
+    typeReadSequence = (sequence <= writeSequence) ? sequence : writeSequence;
+
+    return bResult;
+}
+
+void CircularBufferSpiFlashRK::setReadInfo(ReadInfo &readInfo, Sector *pSector, size_t index, uint32_t offset) {
+    readInfo.sectorNum = pSector->sectorNum;
+    readInfo.sectorCommon = pSector->c;
+    readInfo.index = index;
+    readInfo.offset = offset;
+    readInfo.recordCommon = pSector->records[index];
+    readInfo.recordCommon.size -= CircularBufferFormat::getTimestampSize(readInfo.recordCommon);
+    readInfo.timestamp = 0;
+}
+
+void CircularBufferSpiFlashRK::readRecordIntoReadInfo(ReadInfo &readInfo, Sector *pSector) {
+    size_t timestampSize = CircularBufferFormat::getTimestampSize(readInfo.recordCommon);
+
+    uint8_t *dataBuf = readInfo.allocate(timestampSize + readInfo.recordCommon.size);
+    readRecordData(pSector, readInfo.index, readInfo.offset, 0, dataBuf, timestampSize + readInfo.recordCommon.size);
+
+    if (timestampSize) {
+        // The timestamp is read with the data in a single read, then removed from the buffer
+        memcpy(&readInfo.timestamp, dataBuf, timestampSize);
+        memmove(dataBuf, &dataBuf[timestampSize], readInfo.recordCommon.size);
+        readInfo.truncate(readInfo.recordCommon.size);
+    }
+}
+
+uint32_t CircularBufferSpiFlashRK::readRecordTimestamp(Sector *pSector, size_t index, uint32_t offset) {
+    uint32_t timestamp = 0;
+
+    size_t timestampSize = CircularBufferFormat::getTimestampSize(pSector->records[index]);
+    if (timestampSize) {
+        readFlash(sectorNumToAddr(pSector->sectorNum) + offset + sizeof(RecordCommon), &timestamp, timestampSize);
+    }
+    return timestamp;
+}
+
+bool CircularBufferSpiFlashRK::readData(ReadInfo &readInfo) {
+    bool bResult = false;
+
+    if (!isValid) {
+        _log.error("%s not isValid", "readData");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_READ);
+
+        Sector *pSector;
+        bResult = findNextRecord(readInfo, pSector);
+        if (bResult) {
+            readRecordIntoReadInfo(readInfo, pSector);
+        }
+    }
+
+    return bResult;
+}
+
+bool CircularBufferSpiFlashRK::readData(ReadInfo &readInfo, uint16_t typeMask) {
+    bool bResult = false;
+
+    if (!isValid) {
+        _log.error("%s not isValid", "readData");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_READ);
+
+        Sector *pSector;
+        bResult = findNextRecordOfType(readInfo, pSector, typeMask);
+        if (bResult) {
+            readRecordIntoReadInfo(readInfo, pSector);
+        }
+    }
+
+    return bResult;
+}
+
+bool CircularBufferSpiFlashRK::readData(ReadInfo &readInfo, void *buf, size_t bufLen) {
+    bool bResult = false;
+
+    if (!isValid) {
+        _log.error("%s not isValid", "readData");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_READ);
+
+        // The data is not stored in readInfo
+        readInfo.free();
+
+        Sector *pSector;
+        bResult = findNextRecord(readInfo, pSector);
+        size_t timestampSize = bResult ? CircularBufferFormat::getTimestampSize(readInfo.recordCommon) : 0;
+        if (timestampSize) {
+            readRecordData(pSector, readInfo.index, readInfo.offset, 0, (uint8_t *)&readInfo.timestamp, timestampSize);
+        }
+        if (bResult && buf && bufLen) {
+            size_t len = readInfo.recordCommon.size;
+            if (len > bufLen) {
+                len = bufLen;
+            }
+            readRecordData(pSector, readInfo.index, readInfo.offset, timestampSize, (uint8_t *)buf, len);
+        }
+    }
+
+    return bResult;
+}
+
+bool CircularBufferSpiFlashRK::readDataChunk(const ReadInfo &readInfo, size_t dataOffset, void *buf, size_t len) {
+    bool bResult = false;
+
+    if (!isValid) {
+        _log.error("%s not isValid", "readDataChunk");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    if ((dataOffset + len) > readInfo.recordCommon.size) {
+        _log.error("%s out of range dataOffset=%d len=%d size=%d", "readDataChunk", (int)dataOffset, (int)len, (int)readInfo.recordCommon.size);
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_READ);
+
+        Sector *pSector = getSector(readInfo.sectorNum);
+        if (!pSector) {
+            _log.error("%s sector %d could not be read", "readDataChunk", (int)readInfo.sectorNum);
+            FATAL_ASSERT(); // Only used for off-device unit tests
+            return false;
+        }
+
+        if (pSector->c.sequence != readInfo.sectorCommon.sequence || readInfo.index >= pSector->records.size()) {
+            // The buffer was full and the sector was overwritten
+            _log.info("%s sector %d reused, data no longer available", "readDataChunk", (int)readInfo.sectorNum);
+            return false;
+        }
+
+        readRecordData(pSector, readInfo.index, readInfo.offset, CircularBufferFormat::getTimestampSize(readInfo.recordCommon) + dataOffset, (uint8_t *)buf, len);
+        bResult = true;
+    }
+
+    return bResult;
+}
+
+bool CircularBufferSpiFlashRK::readDataStream(ReadInfo &readInfo, void *chunkBuf, size_t chunkSize, std::function<bool(const uint8_t *data, size_t dataOffset, size_t len)> callback) {
+    if (!chunkBuf || chunkSize == 0) {
+        return false;
+    }
+
+    if (!readData(readInfo, nullptr, 0)) {
+        // No data available
+        return false;
+    }
+
+    // Each chunk obtains the lock separately so the callback is called without the buffer locked
+    for(size_t dataOffset = 0; dataOffset < readInfo.recordCommon.size; dataOffset += chunkSize) {
+        size_t len = readInfo.recordCommon.size - dataOffset;
+        if (len > chunkSize) {
+            len = chunkSize;
+        }
+        if (!readDataChunk(readInfo, dataOffset, chunkBuf, len)) {
+            return false;
+        }
+        if (!callback((const uint8_t *)chunkBuf, dataOffset, len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CircularBufferSpiFlashRK::markAsRead(const ReadInfo &readInfo) {
+    bool bResult = false;
+    if (!isValid) {
+        _log.error("%s not isValid", "markAsRead");
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_MARK_AS_READ);
+
+
+        Sector *pSector = getSector(readInfo.sectorNum);
+        if (!pSector) {
+            _log.error("%s sector %d could not be read", "markAsRead", (int)readInfo.sectorNum);
+            FATAL_ASSERT(); // Only used for off-device unit tests
+            return false;
+        }
+
+        if (pSector->c.sequence != readInfo.sectorCommon.sequence) {
+            _log.info("%s sector %d reused, not marking as read", "markAsRead", (int)readInfo.sectorNum);
+            removeLease(readInfo);
+            return false;
+        }
+
+        markRecordAsRead(pSector, readInfo.index);
+        removeLease(readInfo);
+
+        // pSector may no longer be in the cache after this
+        reclaimReadSectors();
+        bResult = true;
+    }
+
+    return bResult;
+}
+
+void CircularBufferSpiFlashRK::markRecordAsRead(Sector *pSector, size_t index) {
+    TRACE_SCOPE(EVENT_MARK_AS_READ, pSector->sectorNum, pSector->c.sequence);
+    TRACE_DATA(index);
+
+    size_t addr = sectorNumToAddr(pSector->sectorNum);
+
+    if (index < pSector->records.size() && (pSector->records[index].flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+        // Not previously marked as read
+        pSector->records[index].flags &= ~RECORD_FLAG_READ_MASK;
+        usageStats.recordCount--;
+        usageStats.dataSize -= pSector->records[index].size;
+    }
+
+    bool allRead = true;
+    for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++) {
+        if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+            allRead = false;
+            break;
+        }
+    }
+
+    bool isReadSector = (pSector->c.sequence == getReadSequence());
+
+    if (!isReadSector && (pSector->c.flags & SECTOR_FLAG_PARTIAL_READ_MASK) != 0) {
+        // Records were read out of order, so the unread count for this sector is no longer the header recordCount
+        pSector->c.flags &= ~SECTOR_FLAG_PARTIAL_READ_MASK;
+        sectorMeta[pSector->sectorNum].flags = pSector->c.flags;
+        programFlash(addr + offsetof(SectorHeader, c), &pSector->c, sizeof(SectorCommon));
+    }
+
+    bool releaseSector = allRead && isReadSector && (pSector->c.flags & SECTOR_FLAG_FINALIZED_MASK) == 0;
+
+    if (releaseSector && !retainAfterRead) {
+        // This is the last unread record in the oldest sector, erase the sector if finalized
+        reclaimSector(pSector);
+    }
+    else
+    if ((pSector->c.flags & (SECTOR_FLAG_FINALIZED_MASK | SECTOR_FLAG_FOOTER_MASK)) == 0) {
+        // Sector has a footer, clear the bit in the read bitmap
+        if (index < pSector->records.size()) {
+            uint8_t value = (uint8_t) ~(1 << (index % 8));
+            programFlash(addr + getFooterBitmapOffset(pSector->c, pSector->records.size()) + index / 8, &value, 1);
+        }
+    }
+    else {
+        // Just mark this record as read
+        size_t curIndex = 0;
+        uint32_t offset = sizeof(SectorHeader);
+        for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++, curIndex++) {
+            if (curIndex == index) {
+                iter->flags &= ~RECORD_FLAG_READ_MASK;
+                programFlash(addr + offset, &(*iter), sizeof(RecordCommon));
+                
+                break;
+            }
+            offset += sizeof(RecordCommon) + iter->size;
+        }
+    }
+
+    if (releaseSector && retainAfterRead) {
+        // The read flag is written first so replay does not depend on the retained flag
+        releaseReadSector(pSector);
+    }
+    validateSector(pSector);
+}
+
+
+
+void CircularBufferSpiFlashRK::ReadInfo::log(LogLevel level, const char *msg) const {
+    _log.log(level, "%s sectorNum=%d sequence=%d flags=0x%x, recordIndex=%d", msg, (int)sectorNum, (int)sectorCommon.sequence, (int)sectorCommon.flags, (int)index);
+}
+
+
+bool CircularBufferSpiFlashRK::writeData(const DataBuffer &data) {
+    return writeRecord(data, ~0, 0, 0);
+}
+
+bool CircularBufferSpiFlashRK::writeData(const DataBuffer &data, uint32_t timestamp) {
+    return writeRecord(data, (uint16_t) ~RECORD_FLAG_TIMESTAMP_MASK, timestamp, 0);
+}
+
+bool CircularBufferSpiFlashRK::writeTypedData(uint8_t type, const DataBuffer &data) {
+    return writeRecord(data, ~0, 0, type);
+}
+
+bool CircularBufferSpiFlashRK::writeTypedData(uint8_t type, const DataBuffer &data, uint32_t timestamp) {
+    return writeRecord(data, (uint16_t) ~RECORD_FLAG_TIMESTAMP_MASK, timestamp, type);
+}
+
+bool CircularBufferSpiFlashRK::writeRecord(const DataBuffer &data, uint16_t flags, uint32_t timestamp, uint8_t type) {
+    bool bResult = false;
+    if (!isValid) {
+        _log.error("%s not isValid", "writeData");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    if (type >= RECORD_TYPE_COUNT) {
+        _log.error("%s invalid type %d", "writeData", (int)type);
+        return false;
+    }
+
+    size_t size = data.size() + (((flags & RECORD_FLAG_TIMESTAMP_MASK) == 0) ? sizeof(uint32_t) : 0);
+    if (size > getMaxRecordSize()) {
+        _log.error("%s data too large size=%d max=%d", "writeData", (int)size, (int)getMaxRecordSize());
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_WRITE);
+
+        if (recordWriterOpen) {
+            _log.error("%s not allowed while a record is open", "writeData");
+            return false;
+        }
+
+        relocatePriorityRecords();
+
+        Sector *pSector = getWriteSector(size);
+        if (!pSector) {
+            return false;
+        }
+
+        bResult = appendDataToSector(pSector, data, flags, timestamp, type);
+        validateSector(pSector);
+    }
+
+    return bResult;
+}
+
+CircularBufferSpiFlashRK::Sector *CircularBufferSpiFlashRK::getWriteSector(size_t size) {
+    uint32_t sectorNum;
+    if (!sequenceToSectorNum(writeSequence, sectorNum)) {
+        _log.error("%s writeSequence %d not found", "writeData", (int)writeSequence);
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return nullptr;
+    }
+    
+    Sector *pSector = getSector(sectorNum);
+    if (!pSector) {
+        _log.error("%s getSector %d failed", "writeData", (int)sectorNum);
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return nullptr;
+    }
+
+    if (recordFits(pSector, size)) {
+        // Fits in the current sector
+        return pSector;
+    }
+
+    // Sector is full, finalize this sector
+    finalizeSector(pSector);
+    writeSequence++;
+
+    // Start a new one
+    // _log.trace("%s sector %d (seq %d) full, starting new sector", "writeData", (int)sectorNum, (int)writeSequence);
+
+    sectorNum++; // May wrap around
+
+    pSector = getSector(sectorNum);
+    if (!pSector) {
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return nullptr;
+    }
+
+    if ((pSector->c.flags & SECTOR_FLAG_STARTED_MASK) == 0) {
+        // Sector has been used and needs to be erased
+        reclaimSector(pSector);
+        // _log.trace("%s overwriting old sectorNum=%d, new sequence=%d", "writeData", (int)sectorNum, (int)lastSequence);
+
+        // _log.trace("pSector sectorNum=%d", (int)pSector->sectorNum);
+        validateSector(pSector);
+    }
+    // pSector->log(LOG_LEVEL_TRACE, "starting new sector");
+
+    writeSectorFree = sectorSize - pSector->getLastOffset();
+
+    return pSector;
+}
+
+bool CircularBufferSpiFlashRK::recordFits(Sector *pSector, size_t size) {
+    size_t spaceLeft = sectorSize - pSector->getLastOffset();
+    bool fits = !pSector->full && (sizeof(RecordCommon) + size) <= spaceLeft;
+
+    size_t trailerSize = 0;
+    if (sectorFooter) {
+        trailerSize += CircularBufferFormat::getFooterSize(pSector->records.size() + 1);
+    }
+    if (sectorTimeRanges) {
+        trailerSize += sizeof(SectorTimeRange);
+    }
+    if (fits && trailerSize && !pSector->records.empty()) {
+        // Leave room for the footer and time range and an erased RecordCommon before them
+        fits = (2 * sizeof(RecordCommon) + size + trailerSize) <= spaceLeft;
+    }
+    return fits;
+}
+
+void CircularBufferSpiFlashRK::reclaimSector(Sector *pSector) {
+    for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++) {
+        if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+            // Not read yet, the buffer was full
+            usageStats.recordCount--;
+            usageStats.dataSize -= iter->size;
+            usageStats.recordsLostToOverwrite++;
+            if ((priorityTypeMask & (1 << CircularBufferFormat::getRecordType(*iter))) != 0) {
+                usageStats.priorityRecordsLost++;
+            }
+        }
+    }
+    if ((pSector->c.flags & SECTOR_FLAG_FINALIZED_MASK) == 0) {
+        usageStats.freeSectors++;
+    }
+
+    if (firstSequence == pSector->c.sequence) {
+        firstSequence++;
+    }
+
+    // writeSectorHeader updates pSector since it will be in the cache
+    writeSectorHeader(pSector->sectorNum, true /* erase */, ++lastSequence);
+}
+
+bool CircularBufferSpiFlashRK::compactStep(size_t maxBytes, size_t maxUnreadPercent) {
+    bool bResult = false;
+
+    if (!isValid) {
+        _log.error("%s not isValid", "compactStep");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_OTHER);
+
+        if (recordWriterOpen || retainAfterRead) {
+            return false;
+        }
+
+        size_t bytesCopied = 0;
+
+        // Expire old leases so their records can be moved
+        leaseAvailable();
+
+        // There must be a sector after the write sector that isn't in use, otherwise starting a new write
+        // sector would erase the sector records are being moved from
+        while(firstSequence < writeSequence && (writeSequence - firstSequence + 1) < sectorCount) {
+            uint32_t sectorNum;
+            if (!sequenceToSectorNum(firstSequence, sectorNum)) {
+                _log.error("%s firstSequence %d not found", "compactStep", (int)firstSequence);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
+
+            Sector *pSector = getSector(sectorNum);
+            if (!pSector) {
+                _log.error("%s getSector %d failed", "compactStep", (int)sectorNum);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
+
+            // Leased records are not moved, otherwise marking the lease as read would leave the copy unread
+            size_t unreadSize = 0;
+            size_t unreadIndex = pSector->records.size();
+            bool hasLeased = false;
+            for(size_t index = 0; index < pSector->records.size(); index++) {
+                if ((pSector->records[index].flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+                    if (isLeased(pSector, index)) {
+                        hasLeased = true;
+                    }
+                    else
+                    if (unreadIndex == pSector->records.size()) {
+                        unreadIndex = index;
+                    }
+                    unreadSize += sizeof(RecordCommon) + pSector->records[index].size;
+                }
+            }
+
+            if (unreadIndex == pSector->records.size()) {
+                if (hasLeased) {
+                    // Only leased records are left, the sector is erased when they're marked as read
+                    break;
+                }
+
+                // All records are read but the sector was not erased
+                reclaimSector(pSector);
+                reclaimReadSectors();
+                bResult = true;
+                continue;
+            }
+
+            if ((unreadSize * 100) > (sectorSize * maxUnreadPercent)) {
+                // Mostly unread, leave it for readers
+                break;
+            }
+
+            if (bytesCopied && (bytesCopied + pSector->records[unreadIndex].size) > maxBytes) {
+                // I/O budget for this step is used up
+                break;
+            }
+            bytesCopied += pSector->records[unreadIndex].size;
+
+            if (!relocateRecord(sectorNum, unreadIndex)) {
+                break;
+            }
+            usageStats.recordsCompacted++;
+            bResult = true;
+
+            // Following sectors may have been completely read out of order
+            reclaimReadSectors();
+        }
+    }
+
+    return bResult;
+}
+
+bool CircularBufferSpiFlashRK::relocateRecord(uint32_t sectorNum, size_t index) {
+    Sector *pSector = getSector(sectorNum);
+    if (!pSector || index >= pSector->records.size()) {
+        return false;
+    }
+
+    uint32_t sequence = pSector->c.sequence;
+    RecordCommon recordCommon = pSector->records[index];
+
+    uint32_t offset = sizeof(SectorHeader);
+    for(size_t ii = 0; ii < index; ii++) {
+        offset += sizeof(RecordCommon) + pSector->records[ii].size;
+    }
+
+    // The timestamp is read with the data, then removed from the buffer
+    DataBuffer data;
+    size_t timestampSize = CircularBufferFormat::getTimestampSize(recordCommon);
+    uint8_t *dataBuf = data.allocate(recordCommon.size);
+    readRecordData(pSector, index, offset, 0, dataBuf, recordCommon.size);
+
+    uint32_t timestamp = 0;
+    if (timestampSize) {
+        memcpy(&timestamp, dataBuf, timestampSize);
+        memmove(dataBuf, &dataBuf[timestampSize], recordCommon.size - timestampSize);
+        data.truncate(recordCommon.size - timestampSize);
+    }
+
+    // This may remove pSector from the cache
+    Sector *pWriteSector = getWriteSector(recordCommon.size);
+    if (!pWriteSector) {
+        return false;
+    }
+    uint16_t flags = timestampSize ? (uint16_t) ~RECORD_FLAG_TIMESTAMP_MASK : (uint16_t) ~0;
+    if (!appendDataToSector(pWriteSector, data, flags, timestamp, CircularBufferFormat::getRecordType(recordCommon))) {
+        return false;
+    }
+    validateSector(pWriteSector);
+
+    pSector = getSector(sectorNum);
+    if (!pSector || pSector->c.sequence != sequence) {
+        _log.error("%s sector %d reused during relocate", "relocateRecord", (int)sectorNum);
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+    markRecordAsRead(pSector, index);
+
+    return true;
+}
+
+void CircularBufferSpiFlashRK::relocatePriorityRecords() {
+    if (!priorityTypeMask) {
+        return;
+    }
+
+    // Records are moved from the two sectors that will be erased next, so each sector's high priority records
+    // are moved over the writes that fill two sectors instead of one. Sectors before priorityDoneSequence are done.
+    uint32_t sequence = (priorityDoneSequence >= firstSequence) ? (priorityDoneSequence + 1) : firstSequence;
+    size_t bytesCopied = 0;
+
+    while(sequence < writeSequence && (writeSequence - sequence + 2) >= sectorCount) {
+        uint32_t sectorNum;
+        if (!sequenceToSectorNum(sequence, sectorNum)) {
+            return;
+        }
+
+        bool skippedLeased = false;
+        if ((~sectorMeta[sectorNum].typeBitmap & priorityTypeMask) != 0) {
+            // relocateRecord() may remove sectors from the cache and start a new write sector, so they're 
+            // looked up again each time
+            for(size_t index = 0; ; index++) {
+                Sector *pSector = getSector(sectorNum);
+                if (!pSector || pSector->c.sequence != sequence) {
+                    // Erased because all of its records are now read
+                    return;
+                }
+                if (index >= pSector->records.size()) {
+                    break;
+                }
+
+                RecordCommon recordCommon = pSector->records[index];
+                if ((recordCommon.flags & RECORD_FLAG_READ_MASK) == 0 || (priorityTypeMask & (1 << CircularBufferFormat::getRecordType(recordCommon))) == 0) {
+                    // Already read or not high priority
+                    continue;
+                }
+
+                if (isLeased(pSector, index)) {
+                    // Moving it would leave a copy after the lease is marked as read. Checked again on the next write
+                    // in case the lease is released.
+                    skippedLeased = true;
+                    continue;
+                }
+
+                if (bytesCopied && (bytesCopied + recordCommon.size) > priorityRelocateBytes) {
+                    // Limit for this write reached, continue on the next write
+                    return;
+                }
+
+                uint32_t writeSectorNum;
+                if (!sequenceToSectorNum(writeSequence, writeSectorNum)) {
+                    return;
+                }
+                Sector *pWriteSector = getSector(writeSectorNum);
+                if (!pWriteSector || (!recordFits(pWriteSector, recordCommon.size) && (writeSequence - sequence + 1) >= sectorCount)) {
+                    // Starting a new write sector would erase this sector. The records that are left are counted 
+                    // in UsageStats::priorityRecordsLost.
+                    return;
+                }
+
+                bytesCopied += recordCommon.size;
+                if (!relocateRecord(sectorNum, index)) {
+                    return;
+                }
+                usageStats.recordsRelocated++;
+            }
+        }
+
+        if (skippedLeased) {
+            return;
+        }
+        priorityDoneSequence = sequence++;
+    }
+}
+
+void CircularBufferSpiFlashRK::reclaimReadSectors() {
+    // Only sectors with SECTOR_FLAG_PARTIAL_READ_MASK cleared can be completely read before they're the oldest
+    while(getReadSequence() < writeSequence) {
+        uint32_t sectorNum;
+        if (!sequenceToSectorNum(getReadSequence(), sectorNum) || (sectorMeta[sectorNum].flags & SECTOR_FLAG_PARTIAL_READ_MASK) != 0) {
+            break;
+        }
+
+        Sector *pSector = getSector(sectorNum);
+        if (!pSector) {
+            break;
+        }
+        for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++) {
+            if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+                // Has unread records
+                return;
+            }
+        }
+        releaseReadSector(pSector);
+    }
+}
+
+uint32_t CircularBufferSpiFlashRK::getReadSequence() {
+    // readSequence is only moved forward by releaseReadSector(), so it falls behind firstSequence when
+    // retained sectors are not used or the oldest sectors are erased
+    if (readSequence < firstSequence) {
+        readSequence = firstSequence;
+    }
+    return readSequence;
+}
+
+void CircularBufferSpiFlashRK::releaseReadSector(Sector *pSector) {
+    if (!retainAfterRead) {
+        reclaimSector(pSector);
+        return;
+    }
+
+    if ((pSector->c.flags & SECTOR_FLAG_RETAINED_MASK) != 0) {
+        pSector->c.flags &= ~SECTOR_FLAG_RETAINED_MASK;
+        sectorMeta[pSector->sectorNum].flags = pSector->c.flags;
+        programFlash(sectorNumToAddr(pSector->sectorNum) + offsetof(SectorHeader, c), &pSector->c, sizeof(SectorCommon));
+    }
+    readSequence = pSector->c.sequence + 1;
+}
+
+bool CircularBufferSpiFlashRK::discardFirstSector(bool indexSector) {
+    uint32_t sectorNum;
+    if (firstSequence >= writeSequence || !sequenceToSectorNum(firstSequence, sectorNum)) {
+        return false;
+    }
+
+    bool isRetained = (sectorMeta[sectorNum].flags & SECTOR_FLAG_RETAINED_MASK) == 0;
+    if (isRetained) {
+        indexSector = false;
+    }
+    else
+    if ((sectorMeta[sectorNum].flags & SECTOR_FLAG_PARTIAL_READ_MASK) == 0 || firstSequence == getReadSequence()) {
+        // Records were marked as read out of order, or this is the sector being read from
+        indexSector = true;
+    }
+
+    Sector *pSector = indexSector ? getSector(sectorNum) : getSectorFromCache(sectorNum);
+    if (isRetained) {
+        // Retained sector, all records have been read so the usage stats do not change
+    }
+    else
+    if (pSector) {
+        for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++) {
+            if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+                usageStats.recordCount--;
+                usageStats.dataSize -= iter->size;
+            }
+        }
+    }
+    else {
+        // Only the oldest sector and ones with SECTOR_FLAG_PARTIAL_READ_MASK cleared can have records marked 
+        // as read, so all of the records in the header are unread
+        usageStats.recordCount -= sectorMeta[sectorNum].recordCount;
+        usageStats.dataSize -= sectorMeta[sectorNum].dataSize;
+    }
+
+    // Sectors before the write sector are always finalized
+    usageStats.freeSectors++;
+    firstSequence++;
+
+    return writeSectorHeader(sectorNum, true /* erase */, ++lastSequence);
+}
+
+bool CircularBufferSpiFlashRK::openRecord(RecordWriter &writer, size_t reserveSize, uint8_t type) {
+    if (!isValid) {
+        _log.error("%s not isValid", "openRecord");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    if (writer.isOpen()) {
+        _log.error("%s writer is already open", "openRecord");
+        return false;
+    }
+
+    if (reserveSize > getMaxRecordSize()) {
+        _log.error("%s reserveSize too large size=%d max=%d", "openRecord", (int)reserveSize, (int)getMaxRecordSize());
+        return false;
+    }
+
+    if (type >= RECORD_TYPE_COUNT) {
+        _log.error("%s invalid type %d", "openRecord", (int)type);
+        return false;
+    }
+
+    bool bResult = false;
+
+    // The space is reserved with the lock held, but the lock is not held until the record is closed.
+    // recordWriterOpen keeps other writers out of the write sector until then.
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_RECORD_WRITER);
+
+        if (recordWriterOpen) {
+            _log.error("%s another record is already open", "openRecord");
+            return false;
+        }
+
+        relocatePriorityRecords();
+
+        Sector *pSector = getWriteSector(reserveSize);
+        if (!pSector) {
+            return false;
+        }
+
+        startSector(pSector);
+
+        // The RecordCommon is programmed before any data so an uncommitted record can be detected 
+        // after a reset. The size is left erased and is programmed by commit or abort.
+        flushPageBuffer();
+
+        RecordCommon recordCommon;
+        recordCommon.size = RECORD_SIZE_ERASED;
+        recordCommon.flags = (uint8_t) ~RECORD_FLAG_OPEN_MASK;
+        recordCommon.typeTag = CircularBufferFormat::getTypeTag(type);
+
+        uint32_t offset = pSector->getLastOffset();
+        size_t addr = sectorNumToAddr(pSector->sectorNum) + offset;
+        programFlash(addr, &recordCommon, sizeof(RecordCommon));
+        tailCacheAppend(addr, &recordCommon, sizeof(RecordCommon));
+
+        writer.circBuffer = this;
+        writer.sectorNum = pSector->sectorNum;
+        writer.sequence = pSector->c.sequence;
+        writer.offset = offset;
+        writer.reserveSize = reserveSize;
+        writer.dataSize = 0;
+        writer.type = type;
+
+        recordWriterOpen = true;
+        bResult = true;
+    }
+
+    return bResult;
+}
+
+bool CircularBufferSpiFlashRK::recordWriterAppend(RecordWriter &writer, const void *buf, size_t len) {
+    if ((writer.dataSize + len) > writer.reserveSize) {
+        _log.error("%s exceeds reserveSize size=%d reserveSize=%d", "recordWriterAppend", (int)(writer.dataSize + len), (int)writer.reserveSize);
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_RECORD_WRITER);
+
+        if (sectorMeta[writer.sectorNum].sequence != writer.sequence) {
+            _log.error("%s sector %d not available", "recordWriterAppend", (int)writer.sectorNum);
+            FATAL_ASSERT(); // Only used for off-device unit tests
+            return false;
+        }
+
+        // Chunks are combined into page program operations; the page buffer is flushed on commit
+        writeFlash(sectorNumToAddr(writer.sectorNum) + writer.offset + sizeof(RecordCommon) + writer.dataSize, buf, len);
+        writer.dataSize += len;
+    }
+
+    return true;
+}
+
+bool CircularBufferSpiFlashRK::recordWriterClose(RecordWriter &writer, bool commit) {
+    bool bResult = false;
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_RECORD_WRITER);
+
+        Sector *pSector = getSector(writer.sectorNum);
+        if (pSector && pSector->c.sequence == writer.sequence && pSector->getLastOffset() == writer.offset) {
+            // The data must be on flash before the size makes the record visible
+            flushPageBuffer();
+
+            RecordCommon recordCommon;
+            recordCommon.size = writer.dataSize;
+            recordCommon.flags = (uint8_t) ~RECORD_FLAG_OPEN_MASK;
+            if (!commit) {
+                // Aborted records are treated as already read so readers skip them
+                recordCommon.flags &= ~(RECORD_FLAG_ABORTED_MASK | RECORD_FLAG_READ_MASK);
+            }
+            recordCommon.typeTag = CircularBufferFormat::getTypeTag(writer.type);
+
+            programFlash(sectorNumToAddr(writer.sectorNum) + writer.offset, &recordCommon, sizeof(RecordCommon));
+            pSector->records.push_back(recordCommon);
+
+            // If the sector was indexed again while the record was open, readSector() stopped at the
+            // open record and marked the sector as full
+            pSector->full = false;
+
+            if (commit) {
+                usageStats.recordCount++;
+                usageStats.dataSize += writer.dataSize;
+
+                // Records from openRecord() do not have a timestamp
+                updateSectorTimeRange(writer.sectorNum, 0);
+                addSectorType(pSector, writer.type);
+            }
+            writeSectorFree = sectorSize - (writer.offset + sizeof(RecordCommon) + writer.dataSize);
+
+            validateSector(pSector);
+            bResult = true;
+        }
+        else {
+            _log.error("%s sector %d not available", "recordWriterClose", (int)writer.sectorNum);
+            FATAL_ASSERT(); // Only used for off-device unit tests
+        }
+
+        writer.circBuffer = nullptr;
+        recordWriterOpen = false;
+    }
+
+    return bResult;
+}
+
+CircularBufferSpiFlashRK::RecordWriter::~RecordWriter() {
+    if (isOpen()) {
+        abort();
+    }
+}
+
+bool CircularBufferSpiFlashRK::RecordWriter::append(const void *buf, size_t len) {
+    if (!isOpen()) {
+        return false;
+    }
+    return circBuffer->recordWriterAppend(*this, buf, len);
+}
+
+bool CircularBufferSpiFlashRK::RecordWriter::commit() {
+    if (!isOpen()) {
+        return false;
+    }
+    return circBuffer->recordWriterClose(*this, true);
+}
+
+bool CircularBufferSpiFlashRK::RecordWriter::abort() {
+    if (!isOpen()) {
+        return false;
+    }
+    return circBuffer->recordWriterClose(*this, false);
+}
+
+bool CircularBufferSpiFlashRK::getUsageStats(UsageStats &usageStats) {
+    if (!isValid) {
+        _log.error("%s not isValid", "getUsageStats");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        usageStats = this->usageStats;
+        usageStats.oldestSequence = firstSequence;
+        usageStats.newestSequence = writeSequence;
+        usageStats.retainedSectors = getReadSequence() - firstSequence;
+
+        // The write sector is included in freeSectors
+        usageStats.bytesUntilOverwrite = writeSectorFree;
+        if (usageStats.freeSectors > 1) {
+            usageStats.bytesUntilOverwrite += (usageStats.freeSectors - 1) * (sectorSize - sizeof(SectorHeader));
+        }
+    }
+
+    return true;
+}
+
+void CircularBufferSpiFlashRK::rebuildUsageStats() {
+    // Calculate the number of events in the queue that are finalized
+    usageStats.recordCount = 0;
+    usageStats.dataSize = 0;
+    usageStats.freeSectors = 0;
+    usageStats.recordsLostToOverwrite = 0;
+    usageStats.recordsExpired = 0;
+    usageStats.recordsCompacted = 0;
+    usageStats.recordsRelocated = 0;
+    usageStats.priorityRecordsLost = 0;
+    writeSectorFree = 0;
+
+    uint32_t readSectorNum = SECTOR_NUM_INVALID;
+    sequenceToSectorNum(getReadSequence(), readSectorNum);
+
+    for(uint32_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
+        if ((sectorMeta[sectorNum].flags & SECTOR_FLAG_FINALIZED_MASK) == 0) {
+            if (sectorNum != readSectorNum) {
+                if ((sectorMeta[sectorNum].flags & SECTOR_FLAG_RETAINED_MASK) == 0) {
+                    // All records have been read
+                }
+                else
+                if ((sectorMeta[sectorNum].flags & SECTOR_FLAG_PARTIAL_READ_MASK) == 0) {
+                    // Some records were read out of order, so only the unread records are counted
+                    Sector *pSector = getSector(sectorNum);
+                    if (pSector) {
+                        for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++) {
+                            if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+                                usageStats.recordCount += 1;
+                                usageStats.dataSize += iter->size;
+                            }
+                        }
+                    }
+                }
+                else {
+                    // Add all finalized sectors that are not the read sector
+                    usageStats.recordCount += sectorMeta[sectorNum].recordCount;
+                    usageStats.dataSize += sectorMeta[sectorNum].dataSize;                
+                }
+            }
+        } 
+        else {
+            usageStats.freeSectors++;
+        }
+    }
+
+    Sector *pSector = (readSectorNum != SECTOR_NUM_INVALID) ? getSector(readSectorNum) : nullptr;
+    if (pSector) {
+        for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++) {
+            if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+                // Not marked as read, add to count
+                usageStats.recordCount += 1;
+                usageStats.dataSize += iter->size;
+            }
+        }
+    }
+
+    uint32_t writeSectorNum = SECTOR_NUM_INVALID;
+    if (sequenceToSectorNum(writeSequence, writeSectorNum)) {
+        Sector *pWriteSector = getSector(writeSectorNum);
+        if (pWriteSector) {
+            // The type bitmap of the write sector is only in RAM until it's finalized
+            pWriteSector->c.typeBitmap = sectorMeta[writeSectorNum].typeBitmap = 0xffff;
+            for(auto iter = pWriteSector->records.begin(); iter != pWriteSector->records.end(); iter++) {
+                if ((iter->flags & RECORD_FLAG_ABORTED_MASK) != 0) {
+                    addSectorType(pWriteSector, CircularBufferFormat::getRecordType(*iter));
+                }
+            }
+
+            if (readSectorNum != writeSectorNum) {
+                for(auto iter = pWriteSector->records.begin(); iter != pWriteSector->records.end(); iter++) {
+                    if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+                        // Not marked as read, add to count
+                        usageStats.recordCount += 1;
+                        usageStats.dataSize += iter->size;
+                    }
+                }
+            }
+            if (!pWriteSector->full) {
+                writeSectorFree = sectorSize - pWriteSector->getLastOffset();
+            }
+        }
+    }
+}
+
+void CircularBufferSpiFlashRK::rebuildTimeIndex() {
+    // The other time ranges were read with the header of the following sector
+    spiFlash->readData(sectorNumToAddr(sectorCount - 1) + sectorSize - sizeof(SectorTimeRange), &sectorTimeRanges[sectorCount - 1], sizeof(SectorTimeRange));
+    METRICS_OP_ADD(spiReads, 1);
+    METRICS_OP_ADD(spiReadBytes, sizeof(SectorTimeRange));
+
+    for(uint32_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
+        SectorTimeRange &timeRange = sectorTimeRanges[sectorNum];
+
+        if ((sectorMeta[sectorNum].flags & SECTOR_FLAG_FINALIZED_MASK) != 0) {
+            // Not finalized, the write sector is added below
+            timeRange.minTimestamp = 0xffffffff;
+            timeRange.maxTimestamp = 0;
+        }
+        else
+        if ((sectorMeta[sectorNum].flags & SECTOR_FLAG_TIME_RANGE_MASK) != 0) {
+            // Finalized without a time range, so it may contain any timestamp
+            timeRange.minTimestamp = 0;
+            timeRange.maxTimestamp = 0xffffffff;
+        }
+    }
+
+    uint32_t writeSectorNum;
+    if (sequenceToSectorNum(writeSequence, writeSectorNum)) {
+        Sector *pSector = getSector(writeSectorNum);
+        if (pSector) {
+            uint32_t offset = sizeof(SectorHeader);
+            for(size_t index = 0; index < pSector->records.size(); index++) {
+                if ((pSector->records[index].flags & RECORD_FLAG_ABORTED_MASK) != 0) {
+                    updateSectorTimeRange(writeSectorNum, readRecordTimestamp(pSector, index, offset));
+                }
+                offset += sizeof(RecordCommon) + pSector->records[index].size;
+            }
+        }
+    }
+}
+
+uint32_t CircularBufferSpiFlashRK::findTimeSequence(uint32_t timestamp) {
+    // Records moved by compactStep() or withPriorityTypes() keep their original timestamp, so maxTimestamp
+    // is not in sector order and a binary search could skip a sector. This only reads the time index in RAM.
+    // Empty sectors have a maxTimestamp of 0.
+    for(uint32_t sequence = firstSequence; sequence <= writeSequence; sequence++) {
+        uint32_t sectorNum;
+        if (!sequenceToSectorNum(sequence, sectorNum)) {
+            _log.error("%s sequence %d not found", "findTimeSequence", (int)sequence);
+            FATAL_ASSERT(); // Only used for off-device unit tests
+            return sequence;
+        }
+
+        if (sectorTimeRanges[sectorNum].maxTimestamp >= timestamp) {
+            return sequence;
+        }
+    }
+    return writeSequence + 1;
+}
+
+bool CircularBufferSpiFlashRK::seekToTime(uint32_t timestamp) {
+    if (!isValid) {
+        _log.error("%s not isValid", "seekToTime");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_MARK_AS_READ);
+
+        if (!sectorTimeRanges) {
+            _log.error("%s withTimeIndex() not enabled", "seekToTime");
+            return false;
+        }
+
+        // Sectors entirely before timestamp are erased without reading them. The first one may have
+        // records marked as read, so it's indexed to update the usage stats.
+        uint32_t timeSequence = findTimeSequence(timestamp);
+        for(bool indexSector = true; firstSequence < timeSequence; indexSector = false) {
+            if (!discardFirstSector(indexSector)) {
+                // Does not discard the write sector
+                break;
+            }
+        }
+
+        // Relocated records can be older than the records around them, so every sector whose time range
+        // starts before timestamp is checked, and all of its records, not just until a newer one is found
+        for(uint32_t sequence = getReadSequence(); sequence <= writeSequence; sequence++) {
+            uint32_t sectorNum;
+            if (sequence < firstSequence || !sequenceToSectorNum(sequence, sectorNum)) {
+                // Erased after its last record was marked as read
+                continue;
+            }
+
+            const SectorTimeRange &timeRange = sectorTimeRanges[sectorNum];
+            if (timeRange.minTimestamp > timeRange.maxTimestamp || timeRange.minTimestamp >= timestamp) {
+                // Empty, or no records before timestamp
+                continue;
+            }
+
+            Sector *pSector = getSector(sectorNum);
+            if (!pSector) {
+                _log.error("%s getSector %d failed", "seekToTime", (int)sectorNum);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
+
+            uint32_t offset = sizeof(SectorHeader);
+            for(size_t index = 0; index < pSector->records.size(); index++) {
+                uint32_t recordOffset = offset;
+                offset += sizeof(RecordCommon) + pSector->records[index].size;
+
+                if ((pSector->records[index].flags & RECORD_FLAG_READ_MASK) == 0) {
+                    // Already read
+                    continue;
+                }
+                if (readRecordTimestamp(pSector, index, recordOffset) >= timestamp) {
+                    continue;
+                }
+
+                // Erases the oldest sector after its last record
+                markRecordAsRead(pSector, index);
+                if (pSector->c.sequence != sequence) {
+                    break;
+                }
+            }
+        }
+
+        // Sectors after the oldest may now be completely read
+        reclaimReadSectors();
+    }
+
+    return true;
+}
+
+bool CircularBufferSpiFlashRK::nack(const ReadInfo &readInfo) {
+    bool bResult = false;
+
+    WITH_LOCK(*this) {
+        bResult = removeLease(readInfo);
+        if (bResult) {
+            // The record can be returned by readData(readInfo, typeMask) again
+            typeReadMask = 0;
+        }
+    }
+
+    return bResult;
+}
+
+bool CircularBufferSpiFlashRK::leaseAvailable() {
+    if (!leases) {
+        return true;
+    }
+
+    if (leaseTimeoutMs) {
+        // Expired leases return their records to the queue
+        unsigned long now = millis();
+        for(size_t ii = 0; ii < leaseCount; ) {
+            if ((now - leases[ii].leaseTime) >= leaseTimeoutMs) {
+                leases[ii] = leases[--leaseCount];
+                typeReadMask = 0;
+            }
+            else {
+                ii++;
+            }
+        }
+    }
+
+    return leaseCount < leaseMax;
+}
+
+bool CircularBufferSpiFlashRK::isLeased(const Sector *pSector, size_t index) const {
+    for(size_t ii = 0; ii < leaseCount; ii++) {
+        if (leases[ii].index == index && leases[ii].sectorNum == pSector->sectorNum && leases[ii].sequence == pSector->c.sequence) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CircularBufferSpiFlashRK::addLease(const ReadInfo &readInfo) {
+    if (leases && leaseCount < leaseMax) {
+        Lease &lease = leases[leaseCount++];
+        lease.sectorNum = readInfo.sectorNum;
+        lease.sequence = readInfo.sectorCommon.sequence;
+        lease.index = readInfo.index;
+        lease.leaseTime = millis();
+    }
+}
+
+bool CircularBufferSpiFlashRK::removeLease(const ReadInfo &readInfo) {
+    for(size_t ii = 0; ii < leaseCount; ii++) {
+        if (leases[ii].index == readInfo.index && leases[ii].sectorNum == readInfo.sectorNum && leases[ii].sequence == readInfo.sectorCommon.sequence) {
+            leases[ii] = leases[--leaseCount];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CircularBufferSpiFlashRK::expireBefore(uint32_t timestamp) {
+    if (!isValid) {
+        _log.error("%s not isValid", "expireBefore");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_MARK_AS_READ);
+
+        if (!sectorTimeRanges) {
+            _log.error("%s withTimeIndex() not enabled", "expireBefore");
+            return false;
+        }
+
+        size_t recordCount = usageStats.recordCount;
+
+        // The first sector may have records marked as read, so it's indexed to update the usage stats
+        for(bool indexSector = true; firstSequence < writeSequence; indexSector = false) {
+            uint32_t sectorNum;
+            if (!sequenceToSectorNum(firstSequence, sectorNum)) {
+                _log.error("%s firstSequence %d not found", "expireBefore", (int)firstSequence);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
+
+            if (sectorTimeRanges[sectorNum].maxTimestamp >= timestamp) {
+                // Sector has records that have not expired. Sectors finalized without a time range have a
+                // maxTimestamp of 0xffffffff so they're never expired.
+                break;
+            }
+
+            if (!discardFirstSector(indexSector)) {
+                break;
+            }
+        }
+
+        usageStats.recordsExpired += recordCount - usageStats.recordCount;
+    }
+
+    return true;
+}
+
+bool CircularBufferSpiFlashRK::readDataInTimeRange(TimeRangeCursor &cursor, ReadInfo &readInfo) {
+    bool bResult = false;
+
+    if (!isValid) {
+        _log.error("%s not isValid", "readDataInTimeRange");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_READ);
+
+        if (!sectorTimeRanges) {
+            _log.error("%s withTimeIndex() not enabled", "readDataInTimeRange");
+            return false;
+        }
+
+        if (cursor.sequence < firstSequence) {
+            // First call, or the sector the cursor was in has been erased
+            cursor.sequence = findTimeSequence(cursor.startTime);
+            cursor.index = 0;
+        }
+
+        while(cursor.sequence <= writeSequence) {
+            uint32_t sectorNum;
+            if (!sequenceToSectorNum(cursor.sequence, sectorNum)) {
+                _log.error("%s sequence %d not found", "readDataInTimeRange", (int)cursor.sequence);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
+
+            const SectorTimeRange &timeRange = sectorTimeRanges[sectorNum];
+            bool isEmpty = timeRange.minTimestamp > timeRange.maxTimestamp;
+            // Relocated records can be older than the records around them, so a sector after the range does
+            // not mean that later sectors are too
+            if (!isEmpty && timeRange.minTimestamp <= cursor.endTime && timeRange.maxTimestamp >= cursor.startTime) {
+                // Sector overlaps the range, so it needs to be indexed
+                Sector *pSector = getSector(sectorNum);
+                if (!pSector) {
+                    _log.error("%s getSector %d failed", "readDataInTimeRange", (int)sectorNum);
+                    FATAL_ASSERT(); // Only used for off-device unit tests
+                    return false;
+                }
+
+                uint32_t offset = sizeof(SectorHeader);
+                for(size_t index = 0; index < pSector->records.size(); index++) {
+                    if (index >= cursor.index && (pSector->records[index].flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+                        uint32_t timestamp = readRecordTimestamp(pSector, index, offset);
+                        if (timestamp >= cursor.startTime && timestamp <= cursor.endTime) {
+                            setReadInfo(readInfo, pSector, index, offset);
+                            readRecordIntoReadInfo(readInfo, pSector);
+                            cursor.index = index + 1;
+                            bResult = true;
+                            break;
+                        }
+                    }
+                    offset += sizeof(RecordCommon) + pSector->records[index].size;
+                }
+                if (bResult) {
+                    break;
+                }
+                cursor.index = pSector->records.size();
+            }
+
+            if (cursor.sequence == writeSequence) {
+                // More records may be added to this sector later
+                break;
+            }
+            cursor.sequence++;
+            cursor.index = 0;
+        }
+    }
+
+    return bResult;
+}
+
+bool CircularBufferSpiFlashRK::rewind(ReplayCursor &cursor, uint32_t sequence) {
+    if (!isValid) {
+        _log.error("%s not isValid", "rewind");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        cursor.sequence = (sequence < firstSequence) ? firstSequence : sequence;
+        cursor.index = 0;
+        cursor.startTime = 0;
+    }
+
+    return true;
+}
+
+bool CircularBufferSpiFlashRK::rewindToTime(ReplayCursor &cursor, uint32_t timestamp) {
+    if (!isValid) {
+        _log.error("%s not isValid", "rewindToTime");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_OTHER);
+
+        if (!sectorTimeRanges) {
+            _log.error("%s withTimeIndex() not enabled", "rewindToTime");
+            return false;
+        }
+
+        cursor.sequence = findTimeSequence(timestamp);
+        cursor.index = 0;
+        cursor.startTime = timestamp;
+    }
+
+    return true;
+}
+
+bool CircularBufferSpiFlashRK::readReplay(ReplayCursor &cursor, ReadInfo &readInfo) {
+    bool bResult = false;
+
+    if (!isValid) {
+        _log.error("%s not isValid", "readReplay");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
+
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_READ);
+
+        if (cursor.sequence < firstSequence) {
+            // The sector the cursor was in has been overwritten
+            cursor.sequence = firstSequence;
+            cursor.index = 0;
+        }
+
+        // Records are replayed up to the oldest unread record, which is in the sector at getReadSequence()
+        while(cursor.sequence <= getReadSequence()) {
+            uint32_t sectorNum;
+            if (!sequenceToSectorNum(cursor.sequence, sectorNum)) {
+                _log.error("%s sequence %d not found", "readReplay", (int)cursor.sequence);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
+
+            Sector *pSector = getSector(sectorNum);
+            if (!pSector) {
+                _log.error("%s getSector %d failed", "readReplay", (int)sectorNum);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
+
+            bool isRetained = cursor.sequence < getReadSequence();
+            bool foundUnread = false;
+
+            uint32_t offset = sizeof(SectorHeader);
+            for(size_t index = 0; index < pSector->records.size(); index++) {
+                const RecordCommon &recordCommon = pSector->records[index];
+                if (index >= cursor.index && (recordCommon.flags & RECORD_FLAG_ABORTED_MASK) != 0) {
+                    if (!isRetained && (recordCommon.flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
+                        // Not read yet, continue from here after it's read
+                        cursor.index = index;
+                        foundUnread = true;
+                        break;
+                    }
+
+                    // Records are in timestamp order, so the timestamp is only checked until one is found
+                    if (cursor.startTime == 0 || readRecordTimestamp(pSector, index, offset) >= cursor.startTime) {
+                        cursor.startTime = 0;
+                        setReadInfo(readInfo, pSector, index, offset);
+                        readRecordIntoReadInfo(readInfo, pSector);
+                        cursor.index = index + 1;
+                        bResult = true;
+                        break;
+                    }
+                }
+                offset += sizeof(RecordCommon) + pSector->records[index].size;
+            }
+            if (bResult || foundUnread) {
+                break;
+            }
+            cursor.index = pSector->records.size();
+
+            if (cursor.sequence == writeSequence) {
+                // More records may be written to this sector later
+                break;
+            }
+            cursor.sequence++;
+            cursor.index = 0;
         }
-        validateSector(pSector);
-        bResult = true;
     }
 
     return bResult;
 }
 
+bool CircularBufferSpiFlashRK::readDataReverse(ReverseCursor &cursor, ReadInfo &readInfo) {
+    bool bResult = false;
 
+    if (!isValid) {
+        _log.error("%s not isValid", "readDataReverse");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
 
-void CircularBufferSpiFlashRK::ReadInfo::log(LogLevel level, const char *msg) const {
-    _log.log(level, "%s sectorNum=%d sequence=%d flags=0x%x, recordIndex=%d", msg, (int)sectorNum, (int)sectorCommon.sequence, (int)sectorCommon.flags, (int)index);
-}
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_READ);
 
+        if (!cursor.started) {
+            // Records written after this are not returned
+            cursor.started = true;
+            cursor.sequence = writeSequence;
+            cursor.index = SIZE_MAX;
+        }
 
-bool CircularBufferSpiFlashRK::writeData(const DataBuffer &data) {
-    bool bResult = false;
+        while(cursor.sequence >= firstSequence && cursor.sequence <= writeSequence) {
+            if (cursor.unreadOnly && cursor.sequence < getReadSequence()) {
+                // This and all older sectors are retained, so there are no unread records
+                break;
+            }
+
+            uint32_t sectorNum;
+            if (!sequenceToSectorNum(cursor.sequence, sectorNum)) {
+                _log.error("%s sequence %d not found", "readDataReverse", (int)cursor.sequence);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
+
+            Sector *pSector = getSector(sectorNum);
+            if (!pSector) {
+                _log.error("%s getSector %d failed", "readDataReverse", (int)sectorNum);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
+
+            if (cursor.index > pSector->records.size()) {
+                cursor.index = pSector->records.size();
+            }
+
+            // Records only have a forward link (the size), so the offsets are calculated from the index in RAM
+            uint32_t offset = sizeof(SectorHeader);
+            for(size_t index = 0; index < cursor.index; index++) {
+                offset += sizeof(RecordCommon) + pSector->records[index].size;
+            }
+
+            while(cursor.index > 0) {
+                size_t index = --cursor.index;
+                const RecordCommon &recordCommon = pSector->records[index];
+                offset -= sizeof(RecordCommon) + recordCommon.size;
+
+                if ((recordCommon.flags & RECORD_FLAG_ABORTED_MASK) == 0) {
+                    continue;
+                }
+                if (cursor.unreadOnly && (recordCommon.flags & RECORD_FLAG_READ_MASK) == 0) {
+                    continue;
+                }
+
+                setReadInfo(readInfo, pSector, index, offset);
+                readRecordIntoReadInfo(readInfo, pSector);
+                bResult = true;
+                break;
+            }
+            if (bResult) {
+                break;
+            }
+
+            cursor.sequence--;
+            cursor.index = SIZE_MAX;
+        }
+    }
+
+    return bResult;
+}
+
+bool CircularBufferSpiFlashRK::startSnapshot(SnapshotCursor &cursor, uint32_t startSequence, bool unreadOnly) {
     if (!isValid) {
-        _log.error("%s not isValid", "writeData");
+        _log.error("%s not isValid", "startSnapshot");
         FATAL_ASSERT(); // Only used for off-device unit tests
         return false;
     }
 
     WITH_LOCK(*this) {
-        
-        uint16_t sectorNum;
-        if (!sequenceToSectorNum(writeSequence, sectorNum)) {
-            _log.error("%s writeSequence %d not found", "writeData", (int)writeSequence);
+        METRICS_SCOPE(OP_OTHER);
+
+        uint32_t writeSectorNum;
+        if (!sequenceToSectorNum(writeSequence, writeSectorNum)) {
+            _log.error("%s writeSequence %d not found", "startSnapshot", (int)writeSequence);
             FATAL_ASSERT(); // Only used for off-device unit tests
             return false;
         }
-       
-        Sector *pSector = getSector(sectorNum);
+
+        Sector *pSector = getSector(writeSectorNum);
         if (!pSector) {
-            _log.error("%s getSector %d failed", "writeData", (int)sectorNum);
+            _log.error("%s getSector %d failed", "startSnapshot", (int)writeSectorNum);
             FATAL_ASSERT(); // Only used for off-device unit tests
             return false;
         }
 
-        bResult = appendDataToSector(pSector, data, ~0);
-        if (!bResult) {
-            // Sector is full, finalize this sector
-            finalizeSector(pSector);
-            writeSequence++;
+        // Retained sectors do not have any unread records
+        uint32_t minSequence = unreadOnly ? getReadSequence() : firstSequence;
+
+        cursor.unreadOnly = unreadOnly;
+        cursor.sequence = (startSequence < minSequence) ? minSequence : startSequence;
+        cursor.index = 0;
+        cursor.endSequence = writeSequence;
+        cursor.endIndex = pSector->records.size();
+    }
+
+    return true;
+}
 
-            // Start a new one
-            // _log.trace("%s sector %d (seq %d) full, starting new sector", "writeData", (int)sectorNum, (int)writeSequence);
+bool CircularBufferSpiFlashRK::readSnapshot(SnapshotCursor &cursor, ReadInfo &readInfo) {
+    bool bResult = false;
 
-            sectorNum++; // May wrap around
+    if (!isValid) {
+        _log.error("%s not isValid", "readSnapshot");
+        FATAL_ASSERT(); // Only used for off-device unit tests
+        return false;
+    }
 
-            pSector = getSector(sectorNum);
-            if (!pSector) {
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_READ);
+
+        uint32_t minSequence = cursor.unreadOnly ? getReadSequence() : firstSequence;
+        if (cursor.sequence < minSequence) {
+            // The sector the cursor was in has been erased or all of its records were read
+            cursor.sequence = minSequence;
+            cursor.index = 0;
+        }
+
+        while(cursor.sequence <= cursor.endSequence) {
+            uint32_t sectorNum;
+            if (!sequenceToSectorNum(cursor.sequence, sectorNum)) {
+                _log.error("%s sequence %d not found", "readSnapshot", (int)cursor.sequence);
                 FATAL_ASSERT(); // Only used for off-device unit tests
                 return false;
             }
 
-            if ((pSector->c.flags & SECTOR_FLAG_STARTED_MASK) == 0) {
-                // Sector has been used and needs to be erased
-                if (firstSequence == pSector->c.sequence) {
-                    firstSequence++;
-                }
+            Sector *pSector = getSector(sectorNum);
+            if (!pSector) {
+                _log.error("%s getSector %d failed", "readSnapshot", (int)sectorNum);
+                FATAL_ASSERT(); // Only used for off-device unit tests
+                return false;
+            }
 
-                // writeSectorHeader updates pSector since it will be in the cache
-                writeSectorHeader(sectorNum, true /* erase */, ++lastSequence);
-                // _log.trace("%s overwriting old sectorNum=%d, new sequence=%d", "writeData", (int)sectorNum, (int)lastSequence);
+            size_t endIndex = pSector->records.size();
+            if (cursor.sequence == cursor.endSequence && cursor.endIndex < endIndex) {
+                // Written after the snapshot was started
+                endIndex = cursor.endIndex;
+            }
 
-                // _log.trace("pSector sectorNum=%d", (int)pSector->sectorNum);
-                validateSector(pSector);
+            uint32_t offset = sizeof(SectorHeader);
+            for(size_t index = 0; index < endIndex; index++) {
+                const RecordCommon &recordCommon = pSector->records[index];
+                if (index >= cursor.index && (recordCommon.flags & RECORD_FLAG_ABORTED_MASK) != 0 &&
+                    (!cursor.unreadOnly || (recordCommon.flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK)) {
+                    setReadInfo(readInfo, pSector, index, offset);
+                    readRecordIntoReadInfo(readInfo, pSector);
+                    cursor.index = index + 1;
+                    bResult = true;
+                    break;
+                }
+                offset += sizeof(RecordCommon) + pSector->records[index].size;
+            }
+            if (bResult) {
+                break;
             }
-            // pSector->log(LOG_LEVEL_TRACE, "starting new sector");
 
-            // Write data to the new sector
-            bResult = appendDataToSector(pSector, data, ~0);
+            if (cursor.sequence == cursor.endSequence) {
+                cursor.index = endIndex;
+                break;
+            }
+            cursor.sequence++;
+            cursor.index = 0;
         }
-        validateSector(pSector);
     }
 
     return bResult;
 }
 
-bool CircularBufferSpiFlashRK::getUsageStats(UsageStats &usageStats) {
-    bool bResult = false;
-    if (!isValid) {
-        _log.error("%s not isValid", "writeData");
-        FATAL_ASSERT(); // Only used for off-device unit tests
-        return false;
+bool CircularBufferSpiFlashRK::flush() {
+    WITH_LOCK(*this) {
+        METRICS_SCOPE(OP_OTHER);
+
+        flushPageBuffer();
     }
+    return true;
+}
 
+CircularBufferSpiFlashRK &CircularBufferSpiFlashRK::withTailCache(size_t size) {
     WITH_LOCK(*this) {
-        // Calculate the number of events in the queue that are finalized
-        usageStats.recordCount = 0;
-        usageStats.dataSize = 0;
-        usageStats.freeSectors = 0;
+        if (size > TAIL_CACHE_MAX_SIZE) {
+            size = TAIL_CACHE_MAX_SIZE;
+        }
+        if (tailCache) {
+            delete[] tailCache;
+            tailCache = nullptr;
+        }
+        tailCacheSize = tailCacheLen = 0;
 
-        uint16_t readSectorNum = 0xfff;
-        sequenceToSectorNum(firstSequence, readSectorNum);
+        if (size > 0) {
+            tailCache = new uint8_t[size];
+            if (tailCache) {
+                tailCacheSize = size;
+            }
+            else {
+                _log.error("could not allocate tailCache size=%d", (int)size);
+            }
+        }
+    }
+    return *this;
+}
 
+CircularBufferSpiFlashRK &CircularBufferSpiFlashRK::withLeases(size_t maxLeases, unsigned long timeoutMs) {
+    WITH_LOCK(*this) {
+        if (leases) {
+            delete[] leases;
+            leases = nullptr;
+        }
+        leaseMax = leaseCount = 0;
+        leaseTimeoutMs = timeoutMs;
 
-        for(uint16_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
-            if ((sectorMeta[sectorNum].flags & SECTOR_FLAG_FINALIZED_MASK) == 0) {
-                if (sectorNum != readSectorNum) {
-                    // Add all finalized sectors that are not the read sector
-                    usageStats.recordCount += sectorMeta[sectorNum].recordCount;
-                    usageStats.dataSize += sectorMeta[sectorNum].dataSize;                
-                }
-            } 
+        if (maxLeases > 0) {
+            leases = new Lease[maxLeases];
+            if (leases) {
+                leaseMax = maxLeases;
+            }
             else {
-                usageStats.freeSectors++;
+                _log.error("could not allocate leases count=%d", (int)maxLeases);
             }
         }
+    }
+    return *this;
+}
+
+CircularBufferSpiFlashRK &CircularBufferSpiFlashRK::withReadAhead(size_t records, size_t bufferSize) {
+    WITH_LOCK(*this) {
+        if (readAheadBuf) {
+            delete[] readAheadBuf;
+            readAheadBuf = nullptr;
+        }
+        readAheadSize = readAheadLen = 0;
+        readAheadRecords = records;
 
-        Sector *pSector = getSector(readSectorNum);
-        if (pSector) {
-            uint16_t offset = sizeof(SectorHeader);
-            for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++) {
-                if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
-                    // Not marked as read, add to count
-                    usageStats.recordCount += 1;
-                    usageStats.dataSize += iter->size;
-                }
+        if (records > 0 && bufferSize > 0) {
+            readAheadBuf = new uint8_t[bufferSize];
+            if (readAheadBuf) {
+                readAheadSize = bufferSize;
+            }
+            else {
+                _log.error("could not allocate readAheadBuf size=%d", (int)bufferSize);
             }
         }
+    }
+    return *this;
+}
 
-        uint16_t writeSectorNum = 0xfff;
-        if (sequenceToSectorNum(writeSequence, writeSectorNum) && readSectorNum != writeSectorNum) {
-            pSector = getSector(writeSectorNum);
-            if (pSector) {
-                uint16_t offset = sizeof(SectorHeader);
-                for(auto iter = pSector->records.begin(); iter != pSector->records.end(); iter++) {
-                    if ((iter->flags & RECORD_FLAG_READ_MASK) == RECORD_FLAG_READ_MASK) {
-                        // Not marked as read, add to count
-                        usageStats.recordCount += 1;
-                        usageStats.dataSize += iter->size;
+CircularBufferSpiFlashRK &CircularBufferSpiFlashRK::withTimeIndex(bool enable) {
+    WITH_LOCK(*this) {
+        if (sectorTimeRanges) {
+            delete[] sectorTimeRanges;
+            sectorTimeRanges = nullptr;
+        }
+
+        if (enable) {
+            // 8 bytes per sector, loaded by load()
+            sectorTimeRanges = new SectorTimeRange[sectorCount];
+            if (!sectorTimeRanges) {
+                _log.error("could not allocate sectorTimeRanges sectorCount=%d", (int)sectorCount);
+                return *this;
+            }
+
+            // Until the ranges are read, each sector may contain any timestamp, so expireBefore() and 
+            // seekToTime() never erase a sector based on uninitialized values
+            for(uint32_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
+                sectorTimeRanges[sectorNum].minTimestamp = 0;
+                sectorTimeRanges[sectorNum].maxTimestamp = 0xffffffff;
+            }
+
+            if (isValid) {
+                METRICS_SCOPE(OP_OTHER);
+
+                // Already loaded, so read the time ranges that load() reads with the sector headers
+                for(uint32_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
+                    if ((sectorMeta[sectorNum].flags & (SECTOR_FLAG_FINALIZED_MASK | SECTOR_FLAG_TIME_RANGE_MASK)) == 0) {
+                        readFlash(sectorNumToAddr(sectorNum) + sectorSize - sizeof(SectorTimeRange), &sectorTimeRanges[sectorNum], sizeof(SectorTimeRange));
                     }
                 }
+                rebuildTimeIndex();
             }
         }
+    }
+    return *this;
+}
+
+CircularBufferSpiFlashRK &CircularBufferSpiFlashRK::withTrace(size_t entries) {
+#if CIRCULARBUFFERSPIFLASHRK_TRACE
+    WITH_LOCK(*this) {
+        if (traceBuf) {
+            delete[] traceBuf;
+            traceBuf = nullptr;
+        }
+        traceSize = traceStart = traceCount = 0;
 
-        bResult = true;
+        if (entries > 0) {
+            traceBuf = new TraceEntry[entries];
+            if (traceBuf) {
+                traceSize = entries;
+            }
+            else {
+                _log.error("could not allocate trace entries=%d", (int)entries);
+            }
+        }
     }
+#else
+    _log.error("%s CIRCULARBUFFERSPIFLASHRK_TRACE not enabled", "withTrace");
+#endif
+    return *this;
+}
 
-    return bResult;
+size_t CircularBufferSpiFlashRK::readTrace(TraceEntry *entries, size_t maxEntries) {
+    size_t count = 0;
+#if CIRCULARBUFFERSPIFLASHRK_TRACE
+    WITH_LOCK(*this) {
+        while(count < maxEntries && traceCount > 0) {
+            entries[count++] = traceBuf[traceStart];
+            traceStart = (traceStart + 1) % traceSize;
+            traceCount--;
+        }
+    }
+#endif
+    return count;
+}
+
+#if CIRCULARBUFFERSPIFLASHRK_TRACE
+CircularBufferSpiFlashRK::TraceScope::TraceScope(CircularBufferSpiFlashRK &circBuffer, uint8_t event, uint32_t sectorNum, uint32_t sequence) : circBuffer(circBuffer) {
+    entry.timestampUs = micros();
+    entry.durationUs = 0;
+    entry.sectorNum = sectorNum;
+    entry.sequence = sequence;
+    entry.data = 0;
+    entry.event = event;
+    entry.reserved = 0;
+}
+
+CircularBufferSpiFlashRK::TraceScope::~TraceScope() {
+    if (circBuffer.traceSize) {
+        entry.durationUs = micros() - entry.timestampUs;
+
+        // Overwrite the oldest entry when full
+        circBuffer.traceBuf[(circBuffer.traceStart + circBuffer.traceCount) % circBuffer.traceSize] = entry;
+        if (circBuffer.traceCount < circBuffer.traceSize) {
+            circBuffer.traceCount++;
+        }
+        else {
+            circBuffer.traceStart = (circBuffer.traceStart + 1) % circBuffer.traceSize;
+        }
+    }
+}
+#endif // CIRCULARBUFFERSPIFLASHRK_TRACE
+
+bool CircularBufferSpiFlashRK::getReadAheadStats(ReadAheadStats &readAheadStats) {
+    WITH_LOCK(*this) {
+        readAheadStats = this->readAheadStats;
+    }
+    return true;
+}
+
+void CircularBufferSpiFlashRK::readRecordData(Sector *pSector, size_t index, uint32_t offset, size_t dataOffset, uint8_t *buf, size_t len) {
+    size_t dataAddr = sectorNumToAddr(pSector->sectorNum) + offset + sizeof(RecordCommon);
+    size_t dataLen = pSector->records[index].size;
+
+    bool inTailCache = tailCacheLen && dataAddr >= tailCacheAddr && (dataAddr + dataLen) <= (tailCacheAddr + tailCacheLen);
+
+    if (readAheadBuf && !inTailCache) {
+        if (readAheadLen && dataAddr >= readAheadAddr && (dataAddr + dataLen) <= (readAheadAddr + readAheadLen)) {
+            readAheadStats.hits++;
+        }
+        else {
+            readAheadStats.misses++;
+
+            // Read this record and up to readAheadRecords following records in this sector in a single read,
+            // as long as they fit in the buffer. This includes the RecordCommon between records.
+            size_t readLen = dataLen;
+            for(size_t ii = index + 1; ii < pSector->records.size() && (ii - index) <= readAheadRecords; ii++) {
+                size_t nextLen = readLen + sizeof(RecordCommon) + pSector->records[ii].size;
+                if (nextLen > readAheadSize) {
+                    break;
+                }
+                readLen = nextLen;
+            }
+
+            if (readLen <= readAheadSize) {
+                readFlash(dataAddr, readAheadBuf, readLen);
+                readAheadAddr = dataAddr;
+                readAheadLen = readLen;
+                readAheadStats.bytesRead += readLen;
+            }
+        }
+    }
+
+    readFlash(dataAddr + dataOffset, buf, len);
+}
+
+void CircularBufferSpiFlashRK::writeFlash(size_t addr, const void *buf, size_t len) {
+    const uint8_t *src = (const uint8_t *)buf;
+
+    tailCacheAppend(addr, buf, len);
+
+    while(len > 0) {
+        size_t pageOffset = addr & (pageSize - 1);
+        size_t count = pageSize - pageOffset;
+        if (count > len) {
+            count = len;
+        }
+
+        if (pageBufLen && addr != (pageBufAddr + pageBufLen)) {
+            // Not contiguous with the buffered data
+            flushPageBuffer();
+        }
+        if (pageBufLen == 0) {
+            pageBufAddr = addr;
+        }
+        memcpy(&pageBuf[pageOffset], src, count);
+        pageBufLen += count;
+
+        if ((pageOffset + count) == pageSize) {
+            // Page is full, program it
+            flushPageBuffer();
+        }
+
+        addr += count;
+        src += count;
+        len -= count;
+    }
+}
+
+void CircularBufferSpiFlashRK::flushPageBuffer() {
+    if (pageBufLen) {
+        spiFlash->writeData(pageBufAddr, &pageBuf[pageBufAddr & (pageSize - 1)], pageBufLen);
+        METRICS_OP_ADD(spiPrograms, 1);
+        METRICS_OP_ADD(spiProgramBytes, pageBufLen);
+        pageBufLen = 0;
+    }
+}
+
+void CircularBufferSpiFlashRK::programFlash(size_t addr, const void *buf, size_t len) {
+    spiFlash->writeData(addr, buf, len);
+    METRICS_OP_ADD(spiPrograms, 1);
+    METRICS_OP_ADD(spiProgramBytes, len);
+
+    if (tailCacheLen && addr < (tailCacheAddr + tailCacheLen) && (addr + len) > tailCacheAddr) {
+        // Keep the tail cache the same as flash (AND, like a flash program)
+        size_t start = (addr > tailCacheAddr) ? addr : tailCacheAddr;
+        size_t end = ((addr + len) < (tailCacheAddr + tailCacheLen)) ? (addr + len) : (tailCacheAddr + tailCacheLen);
+        for(size_t curAddr = start; curAddr < end; curAddr++) {
+            tailCache[curAddr - tailCacheAddr] &= ((const uint8_t *)buf)[curAddr - addr];
+        }
+    }
+    if (readAheadLen && addr < (readAheadAddr + readAheadLen) && (addr + len) > readAheadAddr) {
+        // Also update the copy in the read ahead buffer (typically RecordCommon flags from markAsRead)
+        size_t start = (addr > readAheadAddr) ? addr : readAheadAddr;
+        size_t end = ((addr + len) < (readAheadAddr + readAheadLen)) ? (addr + len) : (readAheadAddr + readAheadLen);
+        for(size_t curAddr = start; curAddr < end; curAddr++) {
+            readAheadBuf[curAddr - readAheadAddr] &= ((const uint8_t *)buf)[curAddr - addr];
+        }
+    }
+}
+
+void CircularBufferSpiFlashRK::tailCacheAppend(size_t addr, const void *buf, size_t len) {
+    if (!tailCache) {
+        return;
+    }
+    const uint8_t *src = (const uint8_t *)buf;
+
+    if (tailCacheLen == 0 || addr != (tailCacheAddr + tailCacheLen)) {
+        // Not contiguous (new sector), start over
+        tailCacheAddr = addr;
+        tailCacheLen = 0;
+    }
+
+    if (len >= tailCacheSize) {
+        // Only the end of the data fits
+        memcpy(tailCache, &src[len - tailCacheSize], tailCacheSize);
+        tailCacheAddr = addr + len - tailCacheSize;
+        tailCacheLen = tailCacheSize;
+        return;
+    }
+
+    if ((tailCacheLen + len) > tailCacheSize) {
+        // Discard the oldest data to make room
+        size_t discard = tailCacheLen + len - tailCacheSize;
+        memmove(tailCache, &tailCache[discard], tailCacheLen - discard);
+        tailCacheAddr += discard;
+        tailCacheLen -= discard;
+    }
+
+    memcpy(&tailCache[tailCacheLen], src, len);
+    tailCacheLen += len;
 }
 
+void CircularBufferSpiFlashRK::readFlash(size_t addr, void *buf, size_t len) {
+    if (tailCacheLen && addr >= tailCacheAddr && (addr + len) <= (tailCacheAddr + tailCacheLen)) {
+        // Recently written data, including data in the page buffer, can be read from RAM
+        memcpy(buf, &tailCache[addr - tailCacheAddr], len);
+        METRICS_ADD(tailCacheHits, 1);
+        return;
+    }
+    if (readAheadLen && addr >= readAheadAddr && (addr + len) <= (readAheadAddr + readAheadLen)) {
+        memcpy(buf, &readAheadBuf[addr - readAheadAddr], len);
+        METRICS_ADD(readAheadHits, 1);
+        return;
+    }
+
+    spiFlash->readData(addr, buf, len);
+    METRICS_ADD(readCacheMisses, 1);
+    METRICS_OP_ADD(spiReads, 1);
+    METRICS_OP_ADD(spiReadBytes, len);
+
+    if (pageBufLen && addr < (pageBufAddr + pageBufLen) && (addr + len) > pageBufAddr) {
+        // Overlaps buffered data that has not been written to flash yet. The flash is 0xff at those 
+        // locations, except for bits cleared by direct writes like markAsRead, so AND like a flash program would.
+        size_t start = (addr > pageBufAddr) ? addr : pageBufAddr;
+        size_t end = ((addr + len) < (pageBufAddr + pageBufLen)) ? (addr + len) : (pageBufAddr + pageBufLen);
+        for(size_t curAddr = start; curAddr < end; curAddr++) {
+            ((uint8_t *)buf)[curAddr - addr] &= pageBuf[curAddr & (pageSize - 1)];
+        }
+    }
+}
 
 void CircularBufferSpiFlashRK::clearCache() {
     while(!sectorCache.empty()) {
@@ -792,21 +3083,126 @@ void CircularBufferSpiFlashRK::clearCache() {
     }
 }
 
+bool CircularBufferSpiFlashRK::getMetrics(Metrics &metrics) {
+#if CIRCULARBUFFERSPIFLASHRK_METRICS
+    WITH_LOCK(*this) {
+        metrics = this->metrics;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void CircularBufferSpiFlashRK::resetMetrics() {
+#if CIRCULARBUFFERSPIFLASHRK_METRICS
+    WITH_LOCK(*this) {
+        metrics = Metrics();
+    }
+#endif
+}
+
+#if CIRCULARBUFFERSPIFLASHRK_METRICS
+CircularBufferSpiFlashRK::MetricsScope::MetricsScope(CircularBufferSpiFlashRK &circBuffer, size_t op) : circBuffer(circBuffer) {
+    if (!circBuffer.metricsScopeActive) {
+        outer = true;
+        circBuffer.metricsScopeActive = true;
+        circBuffer.metricsOp = op;
+        startUs = micros();
+    }
+}
+
+CircularBufferSpiFlashRK::MetricsScope::~MetricsScope() {
+    if (outer) {
+        uint32_t elapsedUs = micros() - startUs;
+
+        Metrics::OperationMetrics &opMetrics = circBuffer.metrics.ops[circBuffer.metricsOp];
+        opMetrics.calls++;
+        opMetrics.latencyTotalUs += elapsedUs;
+        if (elapsedUs > opMetrics.latencyMaxUs) {
+            opMetrics.latencyMaxUs = elapsedUs;
+        }
+
+        size_t bucket = 0;
+        for(uint32_t limit = Metrics::LATENCY_BUCKET_FIRST_US; elapsedUs >= limit && bucket < (Metrics::LATENCY_BUCKET_COUNT - 1); limit <<= 1) {
+            bucket++;
+        }
+        opMetrics.latencyHistogram[bucket]++;
+
+        circBuffer.metricsOp = Metrics::OP_OTHER;
+        circBuffer.metricsScopeActive = false;
+    }
+}
+
+void CircularBufferSpiFlashRK::metricsLockAcquired(uint32_t waitUs) {
+    metrics.lockCount++;
+    metrics.lockWaitTotalUs += waitUs;
+    if (waitUs > metrics.lockWaitMaxUs) {
+        metrics.lockWaitMaxUs = waitUs;
+    }
+}
+#endif // CIRCULARBUFFERSPIFLASHRK_METRICS
+
+const char *CircularBufferSpiFlashRK::Metrics::getOperationName(size_t op) {
+    switch(op) {
+        case OP_WRITE:
+            return "write";
+        case OP_RECORD_WRITER:
+            return "recordWriter";
+        case OP_READ:
+            return "read";
+        case OP_MARK_AS_READ:
+            return "markAsRead";
+        case OP_OTHER:
+            return "other";
+        default:
+            return "unknown";
+    }
+}
+
+void CircularBufferSpiFlashRK::Metrics::log(LogLevel level, const char *msg) const {
+    _log.log(level, "%s sectorCacheHits=%lu sectorCacheMisses=%lu tailCacheHits=%lu readAheadHits=%lu readCacheMisses=%lu lockCount=%lu lockWaitTotalUs=%lu lockWaitMaxUs=%lu", 
+        msg, (unsigned long)sectorCacheHits, (unsigned long)sectorCacheMisses, (unsigned long)tailCacheHits, (unsigned long)readAheadHits, (unsigned long)readCacheMisses,
+        (unsigned long)lockCount, (unsigned long)lockWaitTotalUs, (unsigned long)lockWaitMaxUs);
+
+    for(size_t op = 0; op < OP_COUNT; op++) {
+        const OperationMetrics &opMetrics = ops[op];
+
+        _log.log(level, "%s %s calls=%lu spiReads=%lu spiReadBytes=%lu spiPrograms=%lu spiProgramBytes=%lu spiErases=%lu latencyTotalUs=%lu latencyMaxUs=%lu", 
+            msg, getOperationName(op), (unsigned long)opMetrics.calls, (unsigned long)opMetrics.spiReads, (unsigned long)opMetrics.spiReadBytes,
+            (unsigned long)opMetrics.spiPrograms, (unsigned long)opMetrics.spiProgramBytes, (unsigned long)opMetrics.spiErases,
+            (unsigned long)opMetrics.latencyTotalUs, (unsigned long)opMetrics.latencyMaxUs);
+
+        char histogram[LATENCY_BUCKET_COUNT * 12];
+        size_t histogramLen = 0;
+        for(size_t bucket = 0; bucket < LATENCY_BUCKET_COUNT; bucket++) {
+            histogramLen += snprintf(&histogram[histogramLen], sizeof(histogram) - histogramLen, "%s%lu", (bucket ? "," : ""), (unsigned long)opMetrics.latencyHistogram[bucket]);
+        }
+        _log.log(level, "%s %s latencyHistogram=%s", msg, getOperationName(op), histogram);
+    }
+}
+
+void CircularBufferSpiFlashRK::ReadAheadStats::log(LogLevel level, const char *msg) const {
+    _log.log(level, "%s hits=%d misses=%d bytesRead=%d", msg, (int)hits, (int)misses, (int)bytesRead);
+}
+
 void CircularBufferSpiFlashRK::UsageStats::log(LogLevel level, const char *msg) const {
-    _log.log(level, "%s recordCount=%d dataSize=%d freeSectors=%d", msg, (int)recordCount, (int)dataSize, (int)freeSectors);
+    _log.log(level, "%s recordCount=%d dataSize=%d freeSectors=%d oldestSequence=%d newestSequence=%d bytesUntilOverwrite=%d recordsLostToOverwrite=%d recordsExpired=%d recordsCompacted=%d recordsRelocated=%d priorityRecordsLost=%d retainedSectors=%d", 
+        msg, (int)recordCount, (int)dataSize, (int)freeSectors, (int)oldestSequence, (int)newestSequence, (int)bytesUntilOverwrite, (int)recordsLostToOverwrite, (int)recordsExpired, (int)recordsCompacted, (int)recordsRelocated, (int)priorityRecordsLost, (int)retainedSectors);
     
 }
 
 
-void CircularBufferSpiFlashRK::Sector::clear(uint16_t sectorNum) {
+void CircularBufferSpiFlashRK::Sector::clear(uint32_t sectorNum) {
     this->sectorNum = sectorNum;
     this->records.clear();
+    this->full = false;
     memset(&this->c, 0, sizeof(SectorCommon));
 }
 
 
-uint16_t CircularBufferSpiFlashRK::Sector::getLastOffset() const {
-    uint16_t lastOffset = sizeof(SectorHeader);
+uint32_t CircularBufferSpiFlashRK::Sector::getLastOffset() const {
+    uint32_t lastOffset = sizeof(SectorHeader);
     for(auto iter = records.begin(); iter != records.end(); iter++) {
         lastOffset += sizeof(RecordCommon) + iter->size;
     }
@@ -816,7 +3212,7 @@ uint16_t CircularBufferSpiFlashRK::Sector::getLastOffset() const {
 
 
 void CircularBufferSpiFlashRK::Sector::log(LogLevel level, const char *msg, bool includeData) const {
-    uint16_t lastOffset = getLastOffset();
+    uint32_t lastOffset = getLastOffset();
 
     // bool isPrintable = true;
     if (includeData) {
@@ -830,7 +3226,7 @@ void CircularBufferSpiFlashRK::Sector::log(LogLevel level, const char *msg, bool
     }
 
 
-    uint16_t offset = sizeof(SectorHeader);
+    uint32_t offset = sizeof(SectorHeader);
     for(auto iter = records.begin(); iter != records.end(); iter++) {
         _log.log(level, " record offset=%d size=%d flags=%x", (int)offset, (int)iter->size, (int)iter->flags);        
         offset += sizeof(RecordCommon) + iter->size;
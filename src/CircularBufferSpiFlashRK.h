@@ -11,6 +11,29 @@
 
 #include <vector>
 #include <deque>
+#include <functional>
+
+#include "CircularBufferSpiFlashRKFormat.h"
+#include "CircularBufferSpiFlashRKTrace.h"
+
+#ifndef CIRCULARBUFFERSPIFLASHRK_METRICS
+/**
+ * @brief Set to 1 to collect metrics, see getMetrics()
+ * 
+ * This changes the size of the class, so if you enable it, define it for all source files using a 
+ * compiler option, not in a single source file.
+ */
+#define CIRCULARBUFFERSPIFLASHRK_METRICS 0
+#endif
+
+#ifndef CIRCULARBUFFERSPIFLASHRK_TRACE
+/**
+ * @brief Set to 1 to include support for the trace ring, see withTrace()
+ * 
+ * As with CIRCULARBUFFERSPIFLASHRK_METRICS, define it for all source files using a compiler option.
+ */
+#define CIRCULARBUFFERSPIFLASHRK_TRACE 0
+#endif
 
 class CircularBufferSpiFlashRK {
 public:
@@ -222,43 +245,29 @@ public:
     };
 
     /**
-     * @brief Data stored in flash for each record in the sector
-     * 
-     * This 2 byte (16 bit) structure is stored packed after the SectorHeader.
-     * If the size is all 1 bits (RECORD_SIZE_ERASED, 0xfff) then this record
-     * has not been written yet. (SPI NOR flash sectors are initialized to all
-     * 1s during sector or chip erase.)
+     * @brief Data stored in flash for each record in the sector (4 bytes), see CircularBufferSpiFlashRKFormat.h
      */
-    struct RecordCommon { // 2 bytes
-        unsigned int size : 12; //!< Number of bytes (0 - 4094, though less with overhead)
-        unsigned int flags : 4; //!< Flag bits
-    } __attribute__((__packed__));
+    typedef CircularBufferRecordCommon RecordCommon;
 
     /**
-     * @brief Data stored after the magic bytes in flash
-     * 
-     * A copy of this is kept in RAM as well, so the library will use 8 bytes of
-     * RAM for each sector.
+     * @brief Data stored after the magic bytes in flash (12 bytes), see CircularBufferSpiFlashRKFormat.h
      */
-    struct SectorCommon { // 8 bytes
-        uint32_t sequence; //!< Monotonically increasing sequence number for sector used
-        unsigned int flags:4; //!< Various flag bits
-        unsigned int reserved:7; //!< Reserved for future use
-        unsigned int recordCount:9; //!< Number of records, set during finalize
-        unsigned int dataSize:12; //!< Number of bytes of data in records, set during finalize
-    } __attribute__((__packed__));
+    typedef CircularBufferSectorCommon SectorCommon;
 
     /**
-     * @brief Structure store at the beginning of each sector
-     * 
-     * This is separate from SectorCommon since we store information about each
-     * sector in the circular buffer. The magic bytes are necessary in flash but
-     * not in RAM, so not storing it in RAM saves 4 bytes per sector.
+     * @brief Structure store at the beginning of each sector (16 bytes), see CircularBufferSpiFlashRKFormat.h
+     */
+    typedef CircularBufferSectorHeader SectorHeader;
+
+    /**
+     * @brief Trailer at the end of a finalized sector with a footer (4 bytes), see withSectorFooter()
+     */
+    typedef CircularBufferSectorFooter SectorFooter;
+
+    /**
+     * @brief Oldest and newest timestamps in a sector (8 bytes), see withTimeIndex()
      */
-    struct SectorHeader { // 12 bytes
-        uint32_t sectorMagic; //!< Magic bytes SECTOR_MAGIC = 0x0ceb6443
-        SectorCommon c; //!< SectorCommon structure (8 bytes)
-    } __attribute__((__packed__));
+    typedef CircularBufferSectorTimeRange SectorTimeRange;
 
 
     /**
@@ -283,14 +292,14 @@ public:
          * 
          * @param sectorNum 
          */
-        void clear(uint16_t sectorNum = 0);
+        void clear(uint32_t sectorNum = 0);
 
         /**
          * @brief Get the offset within the sector after the last record
          * 
-         * @return uint16_t 
+         * @return uint32_t 
          */
-        uint16_t getLastOffset() const;
+        uint32_t getLastOffset() const;
 
         /**
          * @brief Log information about the sector to _log.
@@ -301,9 +310,10 @@ public:
          */
         void log(LogLevel level, const char *msg, bool includeData = false) const;
 
-        uint16_t sectorNum = 0; //!< Sector number this object contains
+        uint32_t sectorNum = 0; //!< Sector number this object contains
         std::vector<RecordCommon> records; //!< The RecordCommon structure for each record in this sector
         SectorCommon c; //!< The SectorCommon structure for this sector
+        bool full = false; //!< No more records can be appended, set when a record from openRecord() was never committed
     };
 
 
@@ -316,11 +326,226 @@ public:
      */
     CircularBufferSpiFlashRK(SpiFlash *spiFlash, size_t addrStart, size_t addrEnd);
 
+    /**
+     * @brief Construct a new circular buffer object with a larger logical sector size
+     *
+     * @param spiFlash The SpiFlashRK object for the SPI NOR flash chip.
+     * @param addrStart Address to start at (typically 0). Must be aligned to sectorSize.
+     * @param addrEnd Address to end at (not inclusive). Must be aligned to sectorSize.
+     * @param sectorSize Logical sector size: 4096, 32768, or 65536 bytes.
+     * 
+     * Larger logical sectors are erased using the 32K or 64K block erase command, which is
+     * much faster per byte than erasing 4K sectors, and allow larger records. sectorMeta uses
+     * 12 bytes of RAM per sector (plus 8 with withTimeIndex()), so they use much less RAM for
+     * large buffers, but the sector is the unit of reclaiming space, so more data is discarded 
+     * at once when the buffer is full.
+     */
+    CircularBufferSpiFlashRK(SpiFlash *spiFlash, size_t addrStart, size_t addrEnd, size_t sectorSize);
+
     /**
      * @brief Destroy the object
      */
     virtual ~CircularBufferSpiFlashRK();
 
+    /**
+     * @brief Get the sector size in bytes
+     * 
+     * @return size_t Sector size, typically 4096
+     */
+    size_t getSectorSize() const { return sectorSize; };
+
+    /**
+     * @brief Get the number of sectors in this circular buffer
+     * 
+     * @return size_t 
+     */
+    size_t getSectorCount() const { return sectorCount; };
+
+    /**
+     * @brief Get the largest record that can be stored by writeData()
+     * 
+     * @return size_t Number of bytes. This is the sector size minus the SectorHeader and one RecordCommon.
+     */
+    size_t getMaxRecordSize() const { return sectorSize - sizeof(SectorHeader) - sizeof(RecordCommon); };
+
+    /**
+     * @brief Buffer small records in RAM until a full flash page can be programmed
+     * 
+     * @param enable true to enable buffering (default: false)
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * The RecordCommon and data for a record are always combined into one program operation per
+     * flash page. With buffering enabled, records are also kept in a page-sized RAM buffer until 
+     * the page is full, so several small records are programmed in a single operation. 
+     * 
+     * Buffered records are read normally, but are not in flash until they are written, so they
+     * will be lost on reset or power loss. They're written when the page fills, when the sector
+     * is finalized, and by flush(), load(), and the destructor. Call flush() before sleep or reset.
+     */
+    CircularBufferSpiFlashRK &withWriteBuffering(bool enable = true) { writeBuffering = enable; return *this; };
+
+    /**
+     * @brief Keep a copy of the most recently written data in RAM
+     * 
+     * @param size Size of the cache in bytes, up to 4096. 0 disables the cache (default).
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * When the consumer keeps up with the producer, readData() typically reads records 
+     * that were just written by writeData(). With the tail cache, these are read from RAM
+     * instead of over SPI. Only the most recent size bytes of the sector currently being 
+     * written to are cached, so older data is still read from flash.
+     */
+    CircularBufferSpiFlashRK &withTailCache(size_t size);
+
+    static const size_t READ_AHEAD_REST_OF_SECTOR = SIZE_MAX; //!< Pass to withReadAhead() to read ahead as many records as fit
+
+    /**
+     * @brief Read upcoming records in the read sector in a single SPI read
+     * 
+     * @param records Number of records after the one being read to prefetch. 0 disables read ahead (default).
+     * Use READ_AHEAD_REST_OF_SECTOR to read as much of the rest of the sector as fits in the buffer.
+     * @param bufferSize Size of the read ahead buffer in bytes (default: 4096)
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * When readData() needs a record that's not in the read ahead buffer, it reads that record and
+     * the following records into the buffer with one SPI transaction. Following calls to readData()
+     * are served from RAM. Use getReadAheadStats() to find the hit rate.
+     */
+    CircularBufferSpiFlashRK &withReadAhead(size_t records, size_t bufferSize = 4096);
+
+    /**
+     * @brief Allow several records to be read before they're marked as read, such as for pipelined uploads
+     * 
+     * @param maxLeases Maximum number of records that can be leased at once. 0 disables leases (default).
+     * @param timeoutMs Time in milliseconds after which a leased record is returned to the queue. 0 for no timeout.
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * Normally readData() returns the oldest unread record until it's passed to markAsRead(). With leases, each
+     * record returned by readData() is leased and following calls skip leased records, so several records can be
+     * in progress at once. Pass each one to markAsRead() when done, in any order, or to nack() to return it to the
+     * queue. A lease that is not acknowledged within timeoutMs expires and the record is returned again. readData()
+     * returns false when maxLeases records are leased. Leases are only kept in RAM (16 bytes each), so after a 
+     * reset all unacknowledged records are returned again.
+     */
+    CircularBufferSpiFlashRK &withLeases(size_t maxLeases, unsigned long timeoutMs = 60000);
+
+    /**
+     * @brief Write an index of the records at the end of each sector when it's finalized
+     * 
+     * @param enable true to write footers (default: false)
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * Indexing a sector after a sector cache miss or reboot normally requires a SPI read for each record.
+     * With a footer, a finalized sector is indexed with a single read. Space for the footer (4 bytes per 
+     * record plus a bit for the read flag) is reserved when writing, so fewer records fit in each sector. 
+     * Marking a record as read in a sector with a footer clears a bit in the footer instead of the record.
+     * 
+     * Sectors without a footer, such as ones written before enabling this option, are indexed by reading
+     * each record as before. Buffers with footers can be read by versions of this library that support
+     * them even if the option is not enabled.
+     */
+    CircularBufferSpiFlashRK &withSectorFooter(bool enable = true) { sectorFooter = enable; return *this; };
+
+    /**
+     * @brief Keep the oldest and newest record timestamp for each sector, for seekToTime() and readDataInTimeRange()
+     * 
+     * @param enable true to keep the time index (default: false)
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * This is normally called before load() or format(). If the buffer is already loaded, the time ranges are 
+     * read from flash immediately, one read per sector. It allocates 8 bytes of RAM per sector, next to sectorMeta,
+     * and each sector's time range is written in the last 8 bytes of the sector when it's finalized. Records without
+     * a timestamp are counted as timestamp 0, so seekToTime() discards them. Records moved by compactStep() or 
+     * withPriorityTypes() keep their timestamp, which is included in the time range of the sector they're moved to.
+     * Sectors finalized without a time range, such as ones written before enabling this option, are treated as 
+     * possibly containing any timestamp, so they're always indexed.
+     */
+    CircularBufferSpiFlashRK &withTimeIndex(bool enable = true);
+
+    /**
+     * @brief Keep records of some types when the buffer is full by moving them forward before their sector is erased
+     * 
+     * @param typeMask Bit n is set if records of type n are high priority, see writeTypedData(). 0 disables.
+     * @param maxRelocateBytes Maximum bytes of high priority records moved per writeData() or openRecord() call
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * Normally when the buffer is full, the oldest sector is erased regardless of what it contains. With this option,
+     * once there is at most one unused sector, each write also copies unread high priority records from the two sectors
+     * that will be erased next to the write sector and marks the originals as read, so each sector's records are moved 
+     * over the writes that fill two sectors. Whether a sector has high priority records is known from its type bitmap 
+     * in RAM, so writes are not slowed down when it doesn't. The amount copied by each write is limited by 
+     * maxRelocateBytes so write latency stays predictable; if high priority records are written faster than they can
+     * be moved, such as a sector that is entirely high priority records with a small maxRelocateBytes, the ones that 
+     * weren't moved are lost as usual and counted in UsageStats::priorityRecordsLost. Moved records are returned after
+     * records written after them. Leased records, see withLeases(), are not moved.
+     */
+    CircularBufferSpiFlashRK &withPriorityTypes(uint16_t typeMask, size_t maxRelocateBytes = 512) { priorityTypeMask = typeMask; priorityRelocateBytes = maxRelocateBytes; return *this; };
+
+    /**
+     * @brief Keep sectors after all of their records have been read, until the space is needed, so they can be replayed
+     * 
+     * @param retain true to keep read sectors, false to erase them when the last record is marked as read (default)
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * Normally a sector is erased as soon as all of its records are marked as read. In this mode, the sector is
+     * marked as retained in its header instead and is only erased when the buffer wraps around to it, so the 
+     * records that have been read recently can be sent again using rewind() and readReplay(). readData() starts at
+     * the oldest sector that is not retained, so reading unread records is not slower. Retained sectors are 
+     * overwritten before unread records are lost, and compactStep() does nothing in this mode.
+     */
+    CircularBufferSpiFlashRK &withRetainAfterRead(bool retain = true) { retainAfterRead = retain; return *this; };
+
+    /**
+     * @brief Set a function to erase a 32K block, used with 32K logical sectors
+     * 
+     * @param fn Function that erases the 32K block at addr (32K aligned) and waits for it to complete
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * SpiFlashRK has sectorErase() (4K) and blockErase() (64K) but no 32K block erase, so without this, each
+     * 32K sector is erased with 8 sectorErase() calls. Most chips support it as command 0x52, so if your
+     * SpiFlash driver has a 32K erase, pass a function that calls it, for example:
+     * `circBuffer.withBlockErase32K([](size_t addr) { spiFlash.blockErase32K(addr); });`
+     */
+    CircularBufferSpiFlashRK &withBlockErase32K(std::function<void(size_t addr)> fn) { blockErase32KFn = fn; return *this; };
+
+    typedef CircularBufferTraceEntry TraceEntry; //!< Entry in the trace ring, see withTrace()
+
+    /**
+     * @brief Record internal steps in a ring buffer in RAM
+     * 
+     * @param entries Number of entries (20 bytes each) to keep. 0 disables the trace (default).
+     * @return CircularBufferSpiFlashRK& This object, for chaining options, fluent-style
+     * 
+     * Each readSector, appendDataToSector, finalizeSector, writeSectorHeader (including the erase), 
+     * and markAsRead is recorded with a timestamp, sector, sequence, and duration. When the ring is 
+     * full the oldest entries are overwritten. Use readTrace() to get the entries. 
+     * 
+     * This is only available if CIRCULARBUFFERSPIFLASHRK_TRACE is defined to 1. Otherwise it does nothing.
+     */
+    CircularBufferSpiFlashRK &withTrace(size_t entries);
+
+    /**
+     * @brief Remove entries from the trace ring, oldest first
+     * 
+     * @param entries Buffer to copy the entries to
+     * @param maxEntries Maximum number of entries to copy
+     * @return size_t Number of entries copied, 0 if the trace is empty or not enabled
+     * 
+     * Write the entries to a file as-is and use tools/trace2chrome to convert them into a 
+     * timeline that can be viewed in the Chrome trace viewer or Perfetto.
+     */
+    size_t readTrace(TraceEntry *entries, size_t maxEntries);
+
+    /**
+     * @brief Write any buffered records to flash
+     * 
+     * @return true on success or false on failure
+     * 
+     * This is only necessary if withWriteBuffering() is enabled. When this returns, all records
+     * written by writeData() are stored in flash.
+     */
+    bool flush();
+
     /**
      * @brief Load the metadata for the file system
      * 
@@ -364,10 +589,17 @@ public:
          * @param msg 
          */
         void log(LogLevel level, const char *msg) const;
-        uint16_t sectorNum; //!< sector number that was read from
+        uint32_t sectorNum; //!< sector number that was read from
         SectorCommon sectorCommon; //!< Information about the sector. The sequence is what's used from this currently.
         size_t index; //!< The record index that was read
-        RecordCommon recordCommon; //!< Information about the record that was read
+        uint32_t offset; //!< Offset of the RecordCommon for this record within the sector
+        RecordCommon recordCommon; //!< Information about the record that was read. The size does not include the timestamp.
+        uint32_t timestamp; //!< Timestamp passed to writeData(), or 0 if the record does not have one
+
+        /**
+         * @brief Get the record type (0 - 15) passed to writeTypedData() or openRecord()
+         */
+        uint8_t getType() const { return CircularBufferFormat::getRecordType(recordCommon); };
     };
 
     /**
@@ -382,223 +614,1278 @@ public:
     bool readData(ReadInfo &readInfo);
 
     /**
-     * @brief Mark the data from readData as read
+     * @brief Read the next unread record whose type is in typeMask
      * 
      * @param readInfo 
-     * @return true on success or false on failure
+     * @param typeMask Bit n is set to return records of type n, for example (1 << 3) | (1 << 5)
+     * @return true on success or false if there are no unread records of those types
      * 
-     * This method works properly even if the sector was overwritten because the 
-     * buffer was full and additional data was written to it. It will ignore the
-     * mark as read in this case, because the data no longer exists.
+     * Each sector's type bitmap is kept in RAM, so sectors that don't contain any of the types are skipped
+     * without reading them, and records of other types are skipped using the sector index without reading 
+     * their data. Records of other types are left unread. As with readData(), pass readInfo to markAsRead()
+     * after processing the record.
      */
-    bool markAsRead(const ReadInfo &readInfo);
+    bool readData(ReadInfo &readInfo, uint16_t typeMask);
 
     /**
-     * @brief Write data to the circular buffer
+     * @brief Read the next unread data into a buffer you provide
      * 
-     * @param data 
-     * @return true on success or false on failure
+     * @param readInfo Filled in with information about the record. The data is not stored in readInfo.
+     * @param buf Buffer to copy the data into
+     * @param bufLen Size of buf in bytes
+     * @return true on success or false on failure (no data)
      * 
-     * Data is always written to the buffer. If the circular buffer is full, the oldest
-     * sector is deleted to make room for new data.
+     * This avoids allocating a buffer on the heap for each record. The size of the record is
+     * readInfo.recordCommon.size. If this is larger than bufLen, only the first bufLen bytes
+     * are copied. If buf is null or bufLen is 0, only readInfo is filled in and the data can be 
+     * read using readDataChunk().
      * 
-     * If there is a read in progress on the oldest sector, it will continue, however
-     * a markAsRead will be ignored since the underlying data will already have been
-     * deleted. 
+     * As with readData(ReadInfo &), pass readInfo to markAsRead() after processing the data.
      */
-    bool writeData(const DataBuffer &data);
+    bool readData(ReadInfo &readInfo, void *buf, size_t bufLen);
 
     /**
-     * @brief Class for various stats about the circular buffer usage
+     * @brief Read part of the data for a record returned by readData
+     * 
+     * @param readInfo The readInfo from readData
+     * @param dataOffset Offset into the record data
+     * @param buf Buffer to copy the data into
+     * @param len Number of bytes to read. dataOffset + len must not be larger than readInfo.recordCommon.size.
+     * @return true on success or false on failure
+     * 
+     * This fails if the sector has been overwritten since readData was called because the buffer was full.
      */
-    class UsageStats {
-    public:
-        /**
-         * @brief 
-         * 
-         * @param level The log level, such as LOG_LEVEL_TRACE or LOG_LEVEL_INFO
-         * @param msg 
-         */
-        void log(LogLevel level, const char *msg) const;
+    bool readDataChunk(const ReadInfo &readInfo, size_t dataOffset, void *buf, size_t len);
 
-        size_t recordCount; //!< Number of records in the circular buffer
-        size_t dataSize; //!< Number of bytes used for data in the circular buffer (does not include overhead)
-        size_t freeSectors; //!< Number of sectors free (includes partially filled sectors)
-    };
+    /**
+     * @brief Read the next unread data, passing it to a callback in chunks
+     * 
+     * @param readInfo Filled in with information about the record. The data is not stored in readInfo.
+     * @param chunkBuf Buffer used to read each chunk
+     * @param chunkSize Size of chunkBuf in bytes, the maximum size passed to the callback
+     * @param callback Called for each chunk in order with the data, offset into the record data, and length. 
+     * Return false to stop reading.
+     * @return true if the whole record was passed to the callback, false if there was no data, an error,
+     * or the callback returned false.
+     * 
+     * This allows a large record to be processed without holding the whole record in RAM. The buffer is 
+     * not locked while the callback is called. As with readData(ReadInfo &), pass readInfo to markAsRead()
+     * after processing the data.
+     */
+    bool readDataStream(ReadInfo &readInfo, void *chunkBuf, size_t chunkSize, std::function<bool(const uint8_t *data, size_t dataOffset, size_t len)> callback);
 
     /**
-     * @brief Get the usage statistics
+     * @brief Mark the data from readData as read
      * 
-     * @param usageStats 
+     * @param readInfo 
      * @return true on success or false on failure
      * 
-     * This method isn't const because it needs to obtain a lock on this object.
+     * This method works properly even if the sector was overwritten because the 
+     * buffer was full and additional data was written to it. It will ignore the
+     * mark as read in this case, because the data no longer exists.
+     * 
+     * With withLeases(), this also releases the lease, and leased records can be marked as read in any order.
      */
-    bool getUsageStats(UsageStats &usageStats);
-
+    bool markAsRead(const ReadInfo &readInfo);
 
-#ifndef UNITTEST
-protected:
-#endif
     /**
-     * @brief Get the Sector object for a sector if it exists in the cache
+     * @brief Return a leased record to the queue so it will be returned by readData() again
      * 
-     * @param sectorNum 
-     * @return Sector* Object if it exists, or nullptr if not
-     * 
-     * The Sector object is just the metadata and an index of the records in it. It does not
-     * contain a copy of the data, so it's relatively small.
+     * @param readInfo The readInfo from readData()
+     * @return true if the record was leased, false if not
      * 
-     * Do not delete the object returned by this method; it's owned by the cache and is
-     * not a copy!
+     * @see withLeases()
      */
-    Sector *getSectorFromCache(uint16_t sectorNum);
+    bool nack(const ReadInfo &readInfo);
 
     /**
-     * @brief Get the Sector object for a sector, allocating and reading it if not in the cache
+     * @brief Write data to the circular buffer
      * 
-     * @param sectorNum 
-     * @return Sector* 
+     * @param data 
+     * @return true on success or false on failure
      * 
-     * The Sector object is just the metadata and an index of the records in it. It does not
-     * contain a copy of the data, so it's relatively small.
+     * Data is always written to the buffer. If the circular buffer is full, the oldest
+     * sector is deleted to make room for new data.
      * 
-     * Do not delete the object returned by this method; it's owned by the cache and is
-     * not a copy!
+     * If there is a read in progress on the oldest sector, it will continue, however
+     * a markAsRead will be ignored since the underlying data will already have been
+     * deleted. 
      */
-    Sector *getSector(uint16_t sectorNum);
+    bool writeData(const DataBuffer &data);
 
     /**
-     * @brief Used internally to read the data from SPI flash. Use getSector() instead!
+     * @brief Write data with a timestamp to the circular buffer
      * 
-     * @param sectorNum 
-     * @param sector 
+     * @param data 
+     * @param timestamp Timestamp for the record, typically Time.now(). Any monotonically increasing 32-bit value can be used.
      * @return true on success or false on failure
+     * 
+     * The timestamp is stored in 4 bytes before the data and returned in ReadInfo::timestamp. The data can be up to
+     * getMaxRecordSize() - 4 bytes. seekToTime() and readDataInTimeRange() are most efficient when records are
+     * written in timestamp order, but do not require it.
      */
-    bool readSector(uint16_t sectorNum, Sector *sector);
+    bool writeData(const DataBuffer &data, uint32_t timestamp);
 
     /**
-     * @brief Used internally to write a sector header. Use writeData() instead!
+     * @brief Write data with a record type to the circular buffer
      * 
-     * @param sectorNum 
-     * @param erase 
-     * @param sequence 
+     * @param type Record type, 0 - 15. Records written by writeData() are type 0.
+     * @param data 
      * @return true on success or false on failure
+     * 
+     * The type is stored in the RecordCommon, so it does not use any space. It's returned by ReadInfo::getType()
+     * and can be used to read only some types of records with readData(readInfo, typeMask).
      */
-    bool writeSectorHeader(uint16_t sectorNum, bool erase, uint32_t sequence);
+    bool writeTypedData(uint8_t type, const DataBuffer &data);
 
     /**
-     * @brief Used internally to append data to an existing sector. Use writeData() instead!
+     * @brief Write data with a record type and a timestamp to the circular buffer
      * 
-     * @param sector 
+     * @param type Record type, 0 - 15
      * @param data 
-     * @param flags 
+     * @param timestamp Timestamp for the record, see writeData(data, timestamp)
      * @return true on success or false on failure
      */
-    bool appendDataToSector(Sector *sector, const DataBuffer &data, uint16_t flags);
-    
+    bool writeTypedData(uint8_t type, const DataBuffer &data, uint32_t timestamp);
+
     /**
-     * @brief Used internally when a sector is full and a new sector needs to be used. Use writeData() instead!
+     * @brief Mark unread records with a timestamp before timestamp as read
      * 
-     * @param sector 
-     * @return true on success or false on failure
+     * @param timestamp Records older than this are discarded
+     * @return true on success or false on failure, including if withTimeIndex() is not enabled
+     * 
+     * The oldest sectors whose newest timestamp is before timestamp are erased without reading them, using the
+     * time index in RAM. Then every record with a timestamp before timestamp in the remaining sectors whose time 
+     * range starts before timestamp is marked as read, not just the ones before the first newer record, because 
+     * records moved by compactStep() or withPriorityTypes() are older than the records around them. Records 
+     * without a timestamp are counted as timestamp 0, so they're discarded even if they were written after 
+     * timestamp.
      */
-    bool finalizeSector(Sector *sector);
+    bool seekToTime(uint32_t timestamp);
 
     /**
-     * @brief Used internally to read a record from a sector. Use readData() instead!
+     * @brief Erase the oldest sectors if all of their records have a timestamp before timestamp
      * 
-     * @param sector 
-     * @param index 
-     * @param data 
-     * @param meta 
-     * @return true on success or false on failure
+     * @param timestamp Records older than this are expired, for example Time.now() - 7 * 86400 to keep 7 days
+     * @return true on success or false on failure, including if withTimeIndex() is not enabled
+     * 
+     * Unlike seekToTime(), only whole sectors are discarded, so no records are read or marked as read.
+     * Sectors are erased from the oldest one using the newest timestamp in the time index in RAM, stopping
+     * at the first sector that has a record that has not expired, so the time taken depends only on the number of
+     * sectors expired. The write sector is never erased. The number of unread records discarded is added to 
+     * UsageStats::recordsExpired.
      */
-    bool readDataFromSector(Sector *sector, size_t index, DataBuffer &data, RecordCommon &meta);
+    bool expireBefore(uint32_t timestamp);
 
     /**
-     * @brief Used internally to validate as sector. Only used for off-device unit tests.
+     * @brief Do one step of compaction, moving unread records out of the oldest sector if it's mostly read
      * 
-     * @param pSector 
-     * @return true on success or false on failure
+     * @param maxBytes Maximum number of bytes of record data to copy in this step. At least one record is copied,
+     * even if it's larger.
+     * @param maxUnreadPercent The oldest sector is only compacted if its unread data is at most this percentage of
+     * the sector size
+     * @return true if a record was moved or a sector was erased, so calling again may do more work, or false if 
+     * there is nothing to compact
      * 
-     * This method validates all of the fields in the sector and assures that the data on flash
-     * matches the internal cache. It's only used during off-device unit tests, and will assert
-     * if the sector is not valid.
+     * A sector is only erased when all of its records are read. When records are read by type or out of order, 
+     * a few unread records can keep the oldest sector, and the sectors after it, from being reused. This copies 
+     * those records, with their type and timestamp, to the end of the buffer and marks the originals as read, 
+     * which erases the sector. The moved records will be returned after records that were written after them. 
      * 
-     * On-device it just always returns true.
+     * Call it periodically, such as from loop(), to reclaim space incrementally. Each step holds the lock for a 
+     * bounded amount of I/O so writers are not blocked for long. Nothing is done if the sector after the write 
+     * sector is the oldest sector, since moving records would overwrite the sector they're being moved from, or
+     * while a record from openRecord() is open. Leased records, see withLeases(), are not moved, so a sector with
+     * leased records is not erased until they are marked as read or their leases expire. If the device resets 
+     * after a record is copied but before the original is marked as read, the record will be returned twice.
      */
-    bool validateSector(Sector *pSector);
+    bool compactStep(size_t maxBytes = 1024, size_t maxUnreadPercent = 25);
 
     /**
-     * @brief Used internally to find a sector number for a sequence number
-     * 
-     * @param sequence 
-     * @param sectorNum 
-     * @return true on success or false on failure
+     * @brief Position for iterating records in a time range, see readDataInTimeRange()
      */
-    bool sequenceToSectorNum(uint32_t sequence, uint16_t &sectorNum) const;
+    class TimeRangeCursor {
+    public:
+        /**
+         * @brief Construct a cursor for records with startTime <= timestamp <= endTime
+         * 
+         * @param startTime Oldest timestamp to return
+         * @param endTime Newest timestamp to return
+         */
+        TimeRangeCursor(uint32_t startTime, uint32_t endTime) : startTime(startTime), endTime(endTime) {};
 
+        uint32_t startTime; //!< Oldest timestamp to return
+        uint32_t endTime; //!< Newest timestamp to return
+
+#ifndef UNITTEST
+    protected:
+#endif
+        uint32_t sequence = 0; //!< Sequence number of the sector to continue in, 0 before the first call
+        size_t index = 0; //!< Record index to continue at in that sector
+
+        friend class CircularBufferSpiFlashRK;
+    };
 
     /**
-     * @brief Convert a sector number to an address
+     * @brief Read the next unread record in a time range, without marking it as read
      * 
-     * @param sectorNum 0 is the first sector of this buffer, not the device! 
-     * @return uint32_t The byte address in in the device for the beginning of this sector
+     * @param cursor The time range and position. Use a new cursor to start over.
+     * @param readInfo Filled in with the record and its data, as with readData()
+     * @return true if a record was returned, false if there are no more records in the range now
+     * 
+     * The first sector that may contain startTime is found using the time index in RAM and sectors that do not 
+     * overlap the range are skipped without reading them. Records are returned in the order they're stored, so 
+     * records moved by compactStep() or withPriorityTypes() are returned after newer records. After the newest 
+     * record is reached, this returns false. If more records are written, calling it again with the 
+     * same cursor continues where it left off.
+     * 
+     * The records are not marked as read. Use seekToTime() to discard older records. Passing readInfo to
+     * markAsRead() is only safe for the oldest unread record, because the sector is erased when its last 
+     * record is marked as read. Requires withTimeIndex().
      */
-    uint32_t sectorNumToAddr(uint16_t sectorNum) const { return addrStart + sectorNum * spiFlash->getSectorSize(); };
+    bool readDataInTimeRange(TimeRangeCursor &cursor, ReadInfo &readInfo);
 
     /**
-     * @brief Remove entries from the sector cache
+     * @brief Position for replaying records that have already been read, see rewind() and readReplay()
      */
-    void clearCache();
+    class ReplayCursor {
+    public:
+        /**
+         * @brief Construct a cursor. Pass it to rewind() or rewindToTime() to set the position.
+         */
+        ReplayCursor() {};
 
-    static const uint32_t SECTOR_MAGIC = 0x0ceb6443; //!< Magic bytes stored at beginning of SectorHeader structure
-    static const uint32_t SECTOR_MAGIC_ERASED = 0xffffffff; //!< Magic bytes value if the sector is erased and not formatted.
-    static const unsigned int SECTOR_FLAG_STARTED_MASK = 0x01; //!< Bit that is cleared when a sector is first written to after formatting
-    static const unsigned int SECTOR_FLAG_FINALIZED_MASK = 0x02; //!< Bit that is cleared when a sector has been fully written to
-    static const unsigned int SECTOR_FLAG_CORRUPTED_MASK = 0x04; //!< Bit that is cleared when a sector has invalid record structures
+#ifndef UNITTEST
+    protected:
+#endif
+        uint32_t sequence = 0; //!< Sequence number of the sector to continue in
+        size_t index = 0; //!< Record index to continue at in that sector
+        uint32_t startTime = 0; //!< Records before this timestamp are skipped, see rewindToTime(). 0 once one is found.
 
-    static const unsigned int RECORD_SIZE_ERASED = 0xfff; //!< Record size value when there is no record at this location. This is the value of the 12-bit value when the sector is erased.
-    static const unsigned int RECORD_FLAG_READ_MASK = 0x1; //!< Bit that is cleared when a record has been read.
+        friend class CircularBufferSpiFlashRK;
+    };
 
-    
     /**
-     * @brief Number of cached Sector structures used by getSector
+     * @brief Set a replay cursor to the first record in a sector
      * 
-     * The Sector structure does not contain the data, so this is not a lot of RAM, but can add up
-     * especially if you are storing small records because there's a vector of RecordCommon structures,
-     * one for each record.
+     * @param cursor The cursor to set
+     * @param sequence Sector sequence number, such as readInfo.sectorCommon.sequence. If that sector has
+     * already been erased, the cursor starts at the oldest sector.
+     * @return true on success or false on failure
      * 
-     * The cache exists because indexing a Sector requires n + 2 SPI reads where n is the number 
-     * of records, so this can be a lot of transactions if you have small records.
+     * Use withRetainAfterRead() so sectors are not erased as soon as their records are read.
      */
-    static const size_t SECTOR_CACHE_SIZE = 8;
+    bool rewind(ReplayCursor &cursor, uint32_t sequence);
 
-public:
-#ifndef UNITTEST
     /**
-     * @brief Locks the mutex that protects shared resources
+     * @brief Set a replay cursor to the first record with a timestamp >= timestamp
      * 
-     * This is compatible with `WITH_LOCK(*this)`.
+     * @param cursor The cursor to set
+     * @param timestamp Oldest timestamp to replay, for example Time.now() - 3600 to resend the last hour
+     * @return true on success or false on failure, including if withTimeIndex() is not enabled
      * 
-     * The mutex is not recursive so do not lock it within a locked section.
+     * The sector is found using the time index in RAM, as with seekToTime(). Replay continues in the order records
+     * are stored from the first record >= timestamp, so records moved by compactStep() or withPriorityTypes() 
+     * may be older than timestamp.
      */
-    void lock() { os_mutex_recursive_lock(mutex); };
+    bool rewindToTime(ReplayCursor &cursor, uint32_t timestamp);
 
     /**
-     * @brief Attempts to lock the mutex that protects shared resources
+     * @brief Read the next record that has already been read, starting at the position set by rewind()
      * 
-     * @return true if the mutex was locked or false if it was busy already.
+     * @param cursor The position, which is updated
+     * @param readInfo Filled in with the record and its data, as with readData()
+     * @return true if a record was returned, false if there are no more read records now
+     * 
+     * Replay stops at the oldest unread record, which readData() will return, and continues from there after
+     * it has been marked as read, so the unread part of the buffer is not read. The read flags are not changed
+     * and readInfo should not be passed to markAsRead(). If the sector the cursor is in is overwritten, replay
+     * continues from the oldest sector.
      */
-    bool tryLock() { return os_mutex_recursive_trylock(mutex); };
+    bool readReplay(ReplayCursor &cursor, ReadInfo &readInfo);
 
     /**
-     * @brief Unlocks the mutex that protects shared resources
+     * @brief Position for reading records newest first, see readDataReverse()
      */
-    void unlock() { os_mutex_recursive_unlock(mutex); };
+    class ReverseCursor {
+    public:
+        /**
+         * @brief Construct a cursor that starts at the newest record
+         * 
+         * @param unreadOnly true to return only unread records, false to return all records still in the buffer (default)
+         */
+        ReverseCursor(bool unreadOnly = false) : unreadOnly(unreadOnly) {};
+
+        bool unreadOnly; //!< Only return unread records
+
+#ifndef UNITTEST
+    protected:
+#endif
+        bool started = false; //!< Set on the first call to readDataReverse()
+        uint32_t sequence = 0; //!< Sequence number of the sector to continue in
+        size_t index = 0; //!< Records before this index in that sector have not been returned yet
+
+        friend class CircularBufferSpiFlashRK;
+    };
+
+    /**
+     * @brief Read the next record going from the newest record to the oldest, without marking it as read
+     * 
+     * @param cursor The position, which is updated. Use a new cursor to start over at the newest record.
+     * @param readInfo Filled in with the record and its data, as with readData()
+     * @return true if a record was returned, false if there are no more records
+     * 
+     * The first call starts at the newest record at that time, so records written after that are not returned.
+     * Records are found from the sector index, going back to the previous sector when one is done, so getting
+     * the newest K records reads K records plus the index of each sector they're in. With withSectorFooter(),
+     * indexing a finalized sector is a single read. 
+     * 
+     * Read records are only kept until their sector is erased, see withRetainAfterRead(). The read flags are not
+     * changed; only pass readInfo to markAsRead() if you want that record to be skipped by readData().
+     */
+    bool readDataReverse(ReverseCursor &cursor, ReadInfo &readInfo);
+
+    /**
+     * @brief Position and end of a forward iteration over the records in the buffer, see startSnapshot()
+     */
+    class SnapshotCursor {
+    public:
+        /**
+         * @brief Construct a cursor. Pass it to startSnapshot() before readSnapshot().
+         */
+        SnapshotCursor() {};
+
+#ifndef UNITTEST
+    protected:
+#endif
+        bool unreadOnly = true; //!< Only return unread records
+        uint32_t sequence = 0; //!< Sequence number of the sector to continue in
+        size_t index = 0; //!< Record index to continue at in that sector
+        uint32_t endSequence = 0; //!< Sequence number of the write sector when the snapshot was started
+        size_t endIndex = 0; //!< Number of records in that sector when the snapshot was started
+
+        friend class CircularBufferSpiFlashRK;
+    };
+
+    /**
+     * @brief Start iterating over the records in the buffer, oldest first, without marking them as read
+     * 
+     * @param cursor The cursor to start
+     * @param startSequence Sector sequence number to start at, such as readInfo.sectorCommon.sequence. The default
+     * of 0 starts at the oldest record.
+     * @param unreadOnly true to return only unread records (default), false to also return read records that have
+     * not been erased, including retained sectors (see withRetainAfterRead())
+     * @return true on success or false on failure
+     * 
+     * The end is the newest record at the time this is called, so records written while iterating are not 
+     * returned. Use readSnapshot() to get the records.
+     */
+    bool startSnapshot(SnapshotCursor &cursor, uint32_t startSequence = 0, bool unreadOnly = true);
+
+    /**
+     * @brief Read the next record in a snapshot started by startSnapshot()
+     * 
+     * @param cursor The position, which is updated
+     * @param readInfo Filled in with the record and its data, as with readData()
+     * @return true if a record was returned, false if the end of the snapshot has been reached
+     * 
+     * This does not use or change the read position of readData() or the read flags. Sectors are walked using
+     * the sector index, and with withReadAhead(), following records are read into RAM with a single read so a 
+     * full scan reads the flash mostly sequentially. Records marked as read after the snapshot was started are 
+     * skipped if unreadOnly was set. If the buffer wraps around to the sector being read, the records that were 
+     * overwritten are skipped.
+     */
+    bool readSnapshot(SnapshotCursor &cursor, ReadInfo &readInfo);
+
+    /**
+     * @brief Handle for writing a record in pieces, see openRecord()
+     * 
+     * If the object is destroyed while the record is still open, the record is aborted.
+     */
+    class RecordWriter {
+    public:
+        /**
+         * @brief Construct a writer that is not open. Pass it to openRecord() to start a record.
+         */
+        RecordWriter() {};
+
+        /**
+         * @brief Aborts the record if it is still open
+         */
+        virtual ~RecordWriter();
+
+        /**
+         * @brief This class is not copyable
+         */
+        RecordWriter(const RecordWriter&) = delete;
+
+        /**
+         * @brief This class is not copyable
+         */
+        RecordWriter &operator=(const RecordWriter&) = delete;
+
+        /**
+         * @brief Append data to the end of the record
+         * 
+         * @param buf Data to append
+         * @param len Number of bytes. The total must not exceed the reserveSize passed to openRecord().
+         * @return true on success or false on failure
+         */
+        bool append(const void *buf, size_t len);
+
+        /**
+         * @brief Make the record visible to readers and allow other records to be written
+         * 
+         * @return true on success or false on failure
+         */
+        bool commit();
+
+        /**
+         * @brief Discard the record and allow other records to be written
+         * 
+         * @return true on success or false on failure
+         * 
+         * The space already used in the sector is not reclaimed until the sector is erased.
+         */
+        bool abort();
+
+        /**
+         * @brief Returns true if openRecord() succeeded and neither commit() nor abort() has been called
+         */
+        bool isOpen() const { return circBuffer != nullptr; };
+
+        /**
+         * @brief Returns the number of bytes appended so far
+         */
+        size_t getSize() const { return dataSize; };
+
+#ifndef UNITTEST
+    protected:
+#endif
+        CircularBufferSpiFlashRK *circBuffer = nullptr; //!< Circular buffer this record is being written to, nullptr if not open
+        uint32_t sectorNum = 0; //!< Sector the record is in
+        uint32_t sequence = 0; //!< Sequence number of that sector
+        uint32_t offset = 0; //!< Offset of the RecordCommon for this record within the sector
+        size_t reserveSize = 0; //!< Maximum number of bytes that can be appended
+        size_t dataSize = 0; //!< Number of bytes appended so far
+        uint8_t type = 0; //!< Record type passed to openRecord()
+
+        friend class CircularBufferSpiFlashRK;
+    };
+
+    /**
+     * @brief Start writing a record that is built in pieces, such as a header, a sensor sample, and a location
+     * 
+     * @param writer The writer object, which must not already be open
+     * @param reserveSize Maximum size of the record data. Must be <= getMaxRecordSize().
+     * @param type Record type, 0 - 15, see writeTypedData()
+     * @return true on success or false on failure
+     * 
+     * The space is reserved in the current write sector, or a new sector is started if it does not fit.
+     * Use writer.append() to add data, which is combined into page program operations, then writer.commit()
+     * to make the record visible to readers, or writer.abort() to discard it. If the device resets before
+     * the record is committed, the record is ignored and writing continues in the next sector.
+     * 
+     * The circular buffer is only locked while openRecord(), append(), commit(), and abort() run, not 
+     * between them, so the writer can be used from any thread and reads are not blocked while the record 
+     * is open. Only one record can be open at a time; writeData(), openRecord(), compactStep(), load(), 
+     * and format() fail while a record is open.
+     */
+    bool openRecord(RecordWriter &writer, size_t reserveSize, uint8_t type = 0);
+
+    /**
+     * @brief Class for various stats about the circular buffer usage
+     */
+    class UsageStats {
+    public:
+        /**
+         * @brief 
+         * 
+         * @param level The log level, such as LOG_LEVEL_TRACE or LOG_LEVEL_INFO
+         * @param msg 
+         */
+        void log(LogLevel level, const char *msg) const;
+
+        size_t recordCount = 0; //!< Number of records in the circular buffer
+        size_t dataSize = 0; //!< Number of bytes used for data in the circular buffer (does not include overhead)
+        size_t freeSectors = 0; //!< Number of sectors free (includes partially filled sectors)
+        uint32_t oldestSequence = 0; //!< Sequence number of the sector containing the oldest data
+        uint32_t newestSequence = 0; //!< Sequence number of the sector currently being written to
+        size_t bytesUntilOverwrite = 0; //!< Bytes that can be written before the oldest sector is overwritten (includes the 4 byte per record overhead)
+        size_t recordsLostToOverwrite = 0; //!< Number of unread records discarded because the buffer was full, since load() or format()
+        size_t recordsExpired = 0; //!< Number of unread records discarded by expireBefore(), since load() or format()
+        size_t recordsCompacted = 0; //!< Number of unread records moved by compactStep(), since load() or format()
+        size_t recordsRelocated = 0; //!< Number of high priority records moved before their sector was erased, see withPriorityTypes()
+        size_t priorityRecordsLost = 0; //!< Number of unread high priority records discarded because the buffer was full, also counted in recordsLostToOverwrite
+        size_t retainedSectors = 0; //!< Number of sectors whose records have all been read but are kept for replay, see withRetainAfterRead()
+    };
+
+    /**
+     * @brief Statistics for the read ahead buffer, see withReadAhead()
+     */
+    class ReadAheadStats {
+    public:
+        /**
+         * @brief Write the statistics to the log
+         * 
+         * @param level The log level, such as LOG_LEVEL_TRACE or LOG_LEVEL_INFO
+         * @param msg 
+         */
+        void log(LogLevel level, const char *msg) const;
+
+        size_t hits = 0; //!< Number of records read from the read ahead buffer
+        size_t misses = 0; //!< Number of records that required reading from flash into the read ahead buffer
+        size_t bytesRead = 0; //!< Number of bytes read from flash into the read ahead buffer
+    };
+
+    /**
+     * @brief Get the read ahead statistics
+     * 
+     * @param readAheadStats Filled in with the statistics since the object was constructed
+     * @return true on success or false on failure
+     */
+    bool getReadAheadStats(ReadAheadStats &readAheadStats);
+
+    /**
+     * @brief Get the usage statistics
+     * 
+     * @param usageStats 
+     * @return true on success or false on failure
+     * 
+     * The statistics are updated as records are written, read, and discarded, and are calculated
+     * from the sector headers in load(), so this method does not access the flash.
+     * 
+     * This method isn't const because it needs to obtain a lock on this object.
+     */
+    bool getUsageStats(UsageStats &usageStats);
+
+    /**
+     * @brief Counters and latency histograms, see getMetrics()
+     * 
+     * The counters are 32-bit and wrap around. Use resetMetrics() to start over.
+     */
+    class Metrics {
+    public:
+        /**
+         * @brief Operations that metrics are kept for. Use as an index into ops.
+         */
+        enum {
+            OP_WRITE = 0, //!< writeData()
+            OP_RECORD_WRITER, //!< openRecord() and RecordWriter append(), commit(), and abort()
+            OP_READ, //!< readData(), readDataChunk(), and readDataStream() (each chunk is a separate call)
+            OP_MARK_AS_READ, //!< markAsRead()
+            OP_OTHER, //!< load(), format(), flush(), and flash access not done by one of the other operations
+            OP_COUNT //!< Number of operations, not an operation
+        };
+
+        static const size_t LATENCY_BUCKET_COUNT = 12; //!< Number of buckets in latencyHistogram
+        static const uint32_t LATENCY_BUCKET_FIRST_US = 64; //!< Upper limit of the first bucket in microseconds. Each bucket after that doubles.
+
+        /**
+         * @brief Metrics for one type of operation
+         */
+        class OperationMetrics {
+        public:
+            uint32_t calls = 0; //!< Number of API calls
+            uint32_t spiReads = 0; //!< Number of SPI flash read operations
+            uint32_t spiReadBytes = 0; //!< Number of bytes read from SPI flash
+            uint32_t spiPrograms = 0; //!< Number of SPI flash program (write) operations
+            uint32_t spiProgramBytes = 0; //!< Number of bytes programmed to SPI flash
+            uint32_t spiErases = 0; //!< Number of sector or block erase operations
+            uint32_t latencyTotalUs = 0; //!< Total time in microseconds, with the lock held
+            uint32_t latencyMaxUs = 0; //!< Longest call in microseconds, with the lock held
+
+            /**
+             * @brief Number of calls by duration. Bucket 0 is less than LATENCY_BUCKET_FIRST_US microseconds, 
+             * and each bucket after that has twice the upper limit. The last bucket has all longer calls.
+             */
+            uint32_t latencyHistogram[LATENCY_BUCKET_COUNT] = {0};
+        };
+
+        /**
+         * @brief Write the metrics to the log
+         * 
+         * @param level The log level, such as LOG_LEVEL_TRACE or LOG_LEVEL_INFO
+         * @param msg A message to insert at the beginning of each log message
+         */
+        void log(LogLevel level, const char *msg) const;
+
+        /**
+         * @brief Get a readable name for an operation, such as "write" for OP_WRITE
+         * 
+         * @param op The operation, such as OP_WRITE
+         * @return const char* The name
+         */
+        static const char *getOperationName(size_t op);
+
+        OperationMetrics ops[OP_COUNT]; //!< Metrics for each operation type
+
+        uint32_t sectorCacheHits = 0; //!< getSector() found the sector in the cache
+        uint32_t sectorCacheMisses = 0; //!< getSector() had to read the sector from flash to index it
+        uint32_t tailCacheHits = 0; //!< Flash reads done from the tail cache
+        uint32_t readAheadHits = 0; //!< Flash reads done from the read ahead buffer
+        uint32_t readCacheMisses = 0; //!< Flash reads that required reading the SPI flash
+
+        uint32_t lockCount = 0; //!< Number of times the lock was obtained
+        uint32_t lockWaitTotalUs = 0; //!< Total time in microseconds waiting to obtain the lock
+        uint32_t lockWaitMaxUs = 0; //!< Longest time in microseconds waiting to obtain the lock
+    };
+
+    /**
+     * @brief Get a copy of the metrics
+     * 
+     * @param metrics Filled in with the metrics since the object was constructed or resetMetrics() was called
+     * @return true on success or false if metrics are not enabled
+     * 
+     * Metrics are only collected if CIRCULARBUFFERSPIFLASHRK_METRICS is defined to 1. Otherwise, no
+     * RAM or time is used for metrics and this method returns false.
+     */
+    bool getMetrics(Metrics &metrics);
+
+    /**
+     * @brief Clear the metrics
+     */
+    void resetMetrics();
+
+
+#ifndef UNITTEST
+protected:
+#endif
+    /**
+     * @brief Get the Sector object for a sector if it exists in the cache
+     * 
+     * @param sectorNum 
+     * @return Sector* Object if it exists, or nullptr if not
+     * 
+     * The Sector object is just the metadata and an index of the records in it. It does not
+     * contain a copy of the data, so it's relatively small.
+     * 
+     * Do not delete the object returned by this method; it's owned by the cache and is
+     * not a copy!
+     */
+    Sector *getSectorFromCache(uint32_t sectorNum);
+
+    /**
+     * @brief Get the Sector object for a sector, allocating and reading it if not in the cache
+     * 
+     * @param sectorNum 
+     * @return Sector* 
+     * 
+     * The Sector object is just the metadata and an index of the records in it. It does not
+     * contain a copy of the data, so it's relatively small.
+     * 
+     * Do not delete the object returned by this method; it's owned by the cache and is
+     * not a copy!
+     */
+    Sector *getSector(uint32_t sectorNum);
+
+    /**
+     * @brief Used internally to read the data from SPI flash. Use getSector() instead!
+     * 
+     * @param sectorNum 
+     * @param sector 
+     * @return true on success or false on failure
+     */
+    bool readSector(uint32_t sectorNum, Sector *sector);
+
+    /**
+     * @brief Used internally by readSector() to index a finalized sector from its footer
+     * 
+     * @param sectorNum 
+     * @param sector 
+     * @return true on success or false if the footer could not be read, in which case the records are walked
+     */
+    bool readSectorFooter(uint32_t sectorNum, Sector *sector);
+
+    /**
+     * @brief Used internally by finalizeSector() to write the footer, if enabled and it fits
+     * 
+     * @param sector 
+     * @return true if the footer was written
+     */
+    bool writeSectorFooter(Sector *sector);
+
+    /**
+     * @brief Offset of the read bitmap in a sector with a footer
+     * 
+     * @param recordCount Number of records in the footer
+     */
+    uint32_t getFooterBitmapOffset(const SectorCommon &c, size_t recordCount) const { return CircularBufferFormat::getFooterEnd(sectorSize, c.flags) - sizeof(SectorFooter) - (recordCount + 7) / 8; };
+
+    /**
+     * @brief Used internally by finalizeSector() to write the time range, if enabled and it fits
+     * 
+     * @param sector 
+     * @return true if the time range was written
+     */
+    bool writeSectorTimeRange(Sector *sector);
+
+    /**
+     * @brief Used internally to add a record timestamp to the time index for a sector
+     * 
+     * @param sectorNum 
+     * @param timestamp The record timestamp, or 0 for records without a timestamp
+     */
+    void updateSectorTimeRange(uint32_t sectorNum, uint32_t timestamp);
+
+    /**
+     * @brief Used internally to find the first sector whose newest timestamp is >= timestamp
+     * 
+     * @param timestamp 
+     * @return uint32_t Sequence number between firstSequence and writeSequence + 1
+     * 
+     * This is a linear search of the time index in RAM and does not access the flash. All sectors before 
+     * the one returned only have records older than timestamp.
+     */
+    uint32_t findTimeSequence(uint32_t timestamp);
+
+    /**
+     * @brief Used internally to read the timestamp of a record
+     * 
+     * @param pSector Sector containing the record
+     * @param index Record index in pSector->records
+     * @param offset Offset of the RecordCommon for this record within the sector
+     * @return uint32_t The timestamp, or 0 if the record does not have one
+     */
+    uint32_t readRecordTimestamp(Sector *pSector, size_t index, uint32_t offset);
+
+    /**
+     * @brief Used internally to write a sector header. Use writeData() instead!
+     * 
+     * @param sectorNum 
+     * @param erase 
+     * @param sequence 
+     * @return true on success or false on failure
+     */
+    bool writeSectorHeader(uint32_t sectorNum, bool erase, uint32_t sequence);
+
+    /**
+     * @brief Used internally to erase a sector. Uses block erase if available.
+     * 
+     * @param sectorNum 
+     * 
+     * 64K sectors are erased with SpiFlash::blockErase() and 32K sectors with the function set by 
+     * withBlockErase32K(), if set. Otherwise each device sector is erased using sectorErase().
+     */
+    void eraseSector(uint32_t sectorNum);
+
+    /**
+     * @brief Used internally to erase a 64K block using blockErase(addr), as in SpiFlashRK
+     * 
+     * @param spiFlash The SpiFlash object. This is a template so it can be tested with other classes.
+     * @param addr Address of the block, which must be 64K aligned
+     * @return true if the block was erased, false if T does not have blockErase()
+     * 
+     * Call with 0 as the last parameter. If T does not have blockErase(size_t), this overload is removed
+     * by SFINAE and the one taking a long is used.
+     */
+    template<class T>
+    static auto blockErase64K(T *spiFlash, size_t addr, int) -> decltype(spiFlash->blockErase(addr), bool()) {
+        spiFlash->blockErase(addr);
+        return true;
+    }
+
+    /**
+     * @brief Used internally when the SpiFlash class does not have blockErase(), see above
+     */
+    template<class T>
+    static bool blockErase64K(T *spiFlash, size_t addr, long) {
+        return false;
+    }
+
+    /**
+     * @brief Used internally to read the data for a record, using the read ahead buffer if enabled
+     * 
+     * @param pSector Sector containing the record
+     * @param index Record index in pSector->records
+     * @param offset Offset of the RecordCommon for this record within the sector
+     * @param dataOffset Offset into the record data to start reading at
+     * @param buf Buffer to store the data in
+     * @param len Number of bytes to read
+     */
+    void readRecordData(Sector *pSector, size_t index, uint32_t offset, size_t dataOffset, uint8_t *buf, size_t len);
+
+    /**
+     * @brief Used internally to find the next unread record. Lock must be held.
+     * 
+     * @param readInfo Filled in with information about the record, but not the data
+     * @param pSector Filled in with the sector containing the record
+     * @return true if there is an unread record or false if not
+     * 
+     * Empty finalized sectors at the beginning of the buffer are erased. With withLeases(), leased records
+     * are skipped and the record found is leased.
+     */
+    bool findNextRecord(ReadInfo &readInfo, Sector *&pSector);
+
+    /**
+     * @brief Used internally to find the next unread record whose type is in typeMask. Lock must be held.
+     * 
+     * @param readInfo Filled in with information about the record, but not the data
+     * @param pSector Filled in with the sector containing the record
+     * @param typeMask Bit n is set to find records of type n
+     * @return true if there is an unread record of those types or false if not
+     * 
+     * Sectors whose type bitmap in sectorMeta does not include any of the types are skipped without indexing them.
+     */
+    bool findNextRecordOfType(ReadInfo &readInfo, Sector *&pSector, uint16_t typeMask);
+
+    /**
+     * @brief Used internally to fill in readInfo for a record. Lock must be held.
+     * 
+     * @param readInfo Filled in with information about the record, but not the data
+     * @param pSector Sector containing the record
+     * @param index Record index in pSector->records
+     * @param offset Offset of the RecordCommon for this record within the sector
+     */
+    void setReadInfo(ReadInfo &readInfo, Sector *pSector, size_t index, uint32_t offset);
+
+    /**
+     * @brief Used internally to read the data and timestamp for the record in readInfo into readInfo
+     * 
+     * @param readInfo From setReadInfo()
+     * @param pSector Sector containing the record
+     */
+    void readRecordIntoReadInfo(ReadInfo &readInfo, Sector *pSector);
+
+    /**
+     * @brief Used internally to mark a record as read. Lock must be held.
+     * 
+     * @param pSector Sector containing the record
+     * @param index Record index in pSector->records
+     * 
+     * If this is the last unread record in the oldest sector and it's finalized, the sector is erased.
+     * If the sector is not the oldest sector, SECTOR_FLAG_PARTIAL_READ_MASK is cleared in the sector
+     * header so load() and discardFirstSector() know to index it.
+     */
+    void markRecordAsRead(Sector *pSector, size_t index);
+
+    /**
+     * @brief Used internally to write record data through the page buffer
+     * 
+     * @param addr Flash address to write to
+     * @param buf Data to write
+     * @param len Length of data in bytes
+     * 
+     * Contiguous writes are combined so each flash page is programmed once. A full page is
+     * written immediately; a partial page stays in the buffer until flushPageBuffer().
+     */
+    void writeFlash(size_t addr, const void *buf, size_t len);
+
+    /**
+     * @brief Used internally to write the page buffer to flash
+     */
+    void flushPageBuffer();
+
+    /**
+     * @brief Used internally to write to flash directly, bypassing the page buffer
+     * 
+     * @param addr Flash address to write to
+     * @param buf Data to write
+     * @param len Length of data in bytes
+     * 
+     * Used for sector headers and flag changes. Also updates the tail cache.
+     */
+    void programFlash(size_t addr, const void *buf, size_t len);
+
+    /**
+     * @brief Used internally to add data written to flash to the tail cache
+     * 
+     * @param addr Flash address the data was written to
+     * @param buf Data
+     * @param len Length of data in bytes
+     */
+    void tailCacheAppend(size_t addr, const void *buf, size_t len);
+
+    /**
+     * @brief Used internally to read from flash, including data in the page buffer not written yet
+     * 
+     * @param addr Flash address to read from
+     * @param buf Buffer to store data in
+     * @param len Length of data in bytes
+     */
+    void readFlash(size_t addr, void *buf, size_t len);
+
+    /**
+     * @brief Used internally to append data to an existing sector. Use writeData() instead!
+     * 
+     * @param sector 
+     * @param data 
+     * @param flags 
+     * @param timestamp Written before the data if RECORD_FLAG_TIMESTAMP_MASK is cleared in flags
+     * @param type Record type, 0 - 15
+     * @return true on success or false on failure
+     */
+    bool appendDataToSector(Sector *sector, const DataBuffer &data, uint16_t flags, uint32_t timestamp = 0, uint8_t type = 0);
+
+    /**
+     * @brief Used internally to add a record type to the type bitmap of a sector in RAM
+     * 
+     * @param pSector The sector, which is updated along with sectorMeta
+     * @param type Record type, 0 - 15
+     * 
+     * The bitmap is written to flash when the sector is finalized and recalculated for the write sector by load().
+     */
+    void addSectorType(Sector *pSector, uint8_t type);
+
+    /**
+     * @brief Used internally by writeData()
+     * 
+     * @param data 
+     * @param flags RECORD_FLAG_TIMESTAMP_MASK is cleared if the record has a timestamp
+     * @param timestamp 
+     * @param type Record type, 0 - 15
+     * @return true on success or false on failure
+     */
+    bool writeRecord(const DataBuffer &data, uint16_t flags, uint32_t timestamp, uint8_t type);
+
+    /**
+     * @brief Used internally to get the write sector, starting a new sector if there's not room for the record
+     * 
+     * @param size Size of the record data in bytes
+     * @return Sector* The sector to write to, or nullptr on error
+     * 
+     * Must be called with the lock held.
+     */
+    Sector *getWriteSector(size_t size);
+
+    /**
+     * @brief Used internally to clear the started flag in the sector header when writing the first record
+     * 
+     * @param sector 
+     */
+    void startSector(Sector *sector);
+
+    /**
+     * @brief Used internally by RecordWriter::append()
+     * 
+     * @param writer 
+     * @param buf 
+     * @param len 
+     * @return true on success or false on failure
+     */
+    bool recordWriterAppend(RecordWriter &writer, const void *buf, size_t len);
+
+    /**
+     * @brief Used internally by RecordWriter::commit() and RecordWriter::abort()
+     * 
+     * @param writer 
+     * @param commit true to commit the record, false to abort it
+     * @return true on success or false on failure
+     */
+    bool recordWriterClose(RecordWriter &writer, bool commit);
+
+#if CIRCULARBUFFERSPIFLASHRK_METRICS
+    /**
+     * @brief Measures one API call for metrics
+     * 
+     * Create an instance on the stack with the lock held. Flash access until the object is destroyed
+     * is counted for op. If an instance already exists, such as when one API call uses another, only the 
+     * outer one counts as a call.
+     */
+    class MetricsScope {
+    public:
+        /**
+         * @brief Start measuring a call
+         * 
+         * @param circBuffer The circular buffer object
+         * @param op The operation, such as Metrics::OP_WRITE
+         */
+        MetricsScope(CircularBufferSpiFlashRK &circBuffer, size_t op);
+
+        /**
+         * @brief Finish measuring the call and update the latency metrics
+         */
+        ~MetricsScope();
+
+    protected:
+        CircularBufferSpiFlashRK &circBuffer; //!< The circular buffer object
+        bool outer = false; //!< true if this is the outermost scope
+        uint32_t startUs = 0; //!< micros() when the call started
+    };
+
+    /**
+     * @brief Used internally to update the lock metrics after obtaining the lock
+     * 
+     * @param waitUs Number of microseconds spent waiting for the lock
+     */
+    void metricsLockAcquired(uint32_t waitUs);
+#endif
+
+#if CIRCULARBUFFERSPIFLASHRK_TRACE
+    /**
+     * @brief Records one internal step in the trace ring
+     * 
+     * Create an instance on the stack with the lock held. The entry is added when the object is destroyed.
+     */
+    class TraceScope {
+    public:
+        /**
+         * @brief Start timing a step
+         * 
+         * @param circBuffer The circular buffer object
+         * @param event The event, such as TraceEntry::EVENT_READ_SECTOR
+         * @param sectorNum The sector number
+         * @param sequence The sector sequence number
+         */
+        TraceScope(CircularBufferSpiFlashRK &circBuffer, uint8_t event, uint32_t sectorNum, uint32_t sequence);
+
+        /**
+         * @brief Finish timing the step and add it to the trace ring
+         */
+        ~TraceScope();
+
+        TraceEntry entry; //!< The entry being recorded. The data field can be set before the object is destroyed.
+
+    protected:
+        CircularBufferSpiFlashRK &circBuffer; //!< The circular buffer object
+    };
+#endif
+
+    /**
+     * @brief Used internally to erase a sector that will be reused, updating firstSequence and the usage stats
+     * 
+     * @param sector The sector to erase. Any unread records in it are counted as lost to overwrite.
+     */
+    void reclaimSector(Sector *sector);
+
+    /**
+     * @brief Used internally to copy a record to the write sector and mark the original as read. Lock must be held.
+     * 
+     * @param sectorNum Sector containing the record, which must not be the write sector
+     * @param index Record index in the sector. The record must not be leased, since the lease would still refer
+     * to the original and marking it as read would not remove the copy.
+     * @return true on success or false on failure
+     * 
+     * The type and timestamp are preserved. The original is marked as read after the copy is written, which 
+     * erases the sector if it was the last unread record in the oldest sector.
+     */
+    bool relocateRecord(uint32_t sectorNum, size_t index);
+
+    /**
+     * @brief Used internally to expire leases and check if another record can be leased. Lock must be held.
+     * 
+     * @return true if leases are not enabled or fewer than maxLeases records are leased
+     */
+    bool leaseAvailable();
+
+    /**
+     * @brief Used internally to check if a record is leased. Lock must be held.
+     * 
+     * @param pSector Sector containing the record
+     * @param index Record index in pSector->records
+     */
+    bool isLeased(const Sector *pSector, size_t index) const;
+
+    /**
+     * @brief Used internally to lease the record in readInfo, if leases are enabled. Lock must be held.
+     */
+    void addLease(const ReadInfo &readInfo);
+
+    /**
+     * @brief Used internally to remove the lease for the record in readInfo. Lock must be held.
+     * 
+     * @return true if the record was leased
+     */
+    bool removeLease(const ReadInfo &readInfo);
+
+    /**
+     * @brief Used internally to move high priority records out of the two sectors that will be erased next. Lock must be held.
+     * 
+     * @see withPriorityTypes()
+     */
+    void relocatePriorityRecords();
+
+    /**
+     * @brief Used internally to check if a record fits in a sector without starting a new sector
+     * 
+     * @param pSector The write sector
+     * @param size Size of the record data, including the timestamp
+     * @return true if it fits, leaving room for the footer and time range if enabled
+     */
+    bool recordFits(Sector *pSector, size_t size);
+
+    /**
+     * @brief Used internally to release the oldest sectors that are not retained if all of their records have been read. Lock must be held.
+     * 
+     * Sectors are checked until one that has unread records or has SECTOR_FLAG_PARTIAL_READ_MASK set, 
+     * so after reading in order, no sectors are indexed.
+     */
+    void reclaimReadSectors();
+
+    /**
+     * @brief Used internally to get the sequence of the oldest sector that may have unread records. Lock must be held.
+     * 
+     * This is firstSequence unless there are retained sectors, see withRetainAfterRead().
+     */
+    uint32_t getReadSequence();
+
+    /**
+     * @brief Used internally when all records in the sector at getReadSequence() have been read. Lock must be held.
+     * 
+     * @param pSector The sector, which must be finalized
+     * 
+     * The sector is erased, or with withRetainAfterRead(), SECTOR_FLAG_RETAINED_MASK is cleared in the header
+     * and readSequence is moved to the next sector.
+     */
+    void releaseReadSector(Sector *pSector);
+
+    /**
+     * @brief Used internally to erase the oldest sector without reading its records, updating firstSequence and the usage stats
+     * 
+     * @param indexSector true if the sector may have records marked as read, so it must be indexed to update the usage stats.
+     * Sectors with SECTOR_FLAG_PARTIAL_READ_MASK cleared and the sector at getReadSequence() are always indexed,
+     * and retained sectors never are.
+     * @return true if the sector was erased, false if it's the write sector, which cannot be discarded
+     * 
+     * The unread records are discarded, not counted as lost to overwrite.
+     */
+    bool discardFirstSector(bool indexSector);
+
+    /**
+     * @brief Used internally by load() to calculate usageStats from the sector headers
+     * 
+     * This calls getSector() for the read and write sectors and sectors with SECTOR_FLAG_PARTIAL_READ_MASK
+     * cleared, and recalculates the type bitmap of the write sector.
+     */
+    void rebuildUsageStats();
+
+    /**
+     * @brief Used internally by load() to finish loading sectorTimeRanges, see withTimeIndex()
+     * 
+     * This calls getSector() for the write sector and reads the timestamp of each record in it.
+     */
+    void rebuildTimeIndex();
+    
+    /**
+     * @brief Used internally when a sector is full and a new sector needs to be used. Use writeData() instead!
+     * 
+     * @param sector 
+     * @return true on success or false on failure
+     */
+    bool finalizeSector(Sector *sector);
+
+    /**
+     * @brief Used internally to read a record from a sector. Use readData() instead!
+     * 
+     * @param sector 
+     * @param index 
+     * @param data 
+     * @param meta 
+     * @return true on success or false on failure
+     */
+    bool readDataFromSector(Sector *sector, size_t index, DataBuffer &data, RecordCommon &meta);
+
+    /**
+     * @brief Used internally to validate as sector. Only used for off-device unit tests.
+     * 
+     * @param pSector 
+     * @return true on success or false on failure
+     * 
+     * This method validates all of the fields in the sector and assures that the data on flash
+     * matches the internal cache. It's only used during off-device unit tests, and will assert
+     * if the sector is not valid.
+     * 
+     * On-device it just always returns true. It also returns true if UNITTEST_NO_VALIDATE is
+     * defined, which is used for off-device benchmarks.
+     */
+    bool validateSector(Sector *pSector);
+
+    /**
+     * @brief Used internally to find a sector number for a sequence number
+     * 
+     * @param sequence 
+     * @param sectorNum 
+     * @return true on success or false on failure
+     * 
+     * This is O(1); it does not search sectorMeta.
+     */
+    bool sequenceToSectorNum(uint32_t sequence, uint32_t &sectorNum) const;
+
+
+    /**
+     * @brief Convert a sector number to an address
+     * 
+     * @param sectorNum 0 is the first sector of this buffer, not the device! 
+     * @return size_t The byte address in in the device for the beginning of this sector
+     */
+    size_t sectorNumToAddr(uint32_t sectorNum) const { return addrStart + ((size_t)sectorNum << sectorShift); };
+
+    /**
+     * @brief Remove entries from the sector cache
+     */
+    void clearCache();
+
+    static const uint32_t SECTOR_MAGIC = CircularBufferFormat::SECTOR_MAGIC; //!< Magic bytes stored at beginning of SectorHeader structure
+    static const uint32_t SECTOR_MAGIC_V1 = CircularBufferFormat::SECTOR_MAGIC_V1; //!< Magic bytes used by version 0.0.1 (2 byte RecordCommon), must be reformatted
+    static const uint32_t SECTOR_NUM_INVALID = 0xffffffff; //!< Sector number value used when there is no sector
+    static const uint32_t SECTOR_MAGIC_ERASED = CircularBufferFormat::SECTOR_MAGIC_ERASED; //!< Magic bytes value if the sector is erased and not formatted.
+    static const unsigned int SECTOR_FLAG_STARTED_MASK = CircularBufferFormat::SECTOR_FLAG_STARTED_MASK; //!< Bit that is cleared when a sector is first written to after formatting
+    static const unsigned int SECTOR_FLAG_FINALIZED_MASK = CircularBufferFormat::SECTOR_FLAG_FINALIZED_MASK; //!< Bit that is cleared when a sector has been fully written to
+    static const unsigned int SECTOR_FLAG_CORRUPTED_MASK = CircularBufferFormat::SECTOR_FLAG_CORRUPTED_MASK; //!< Bit that is cleared when a sector has invalid record structures
+    static const unsigned int SECTOR_FLAG_FOOTER_MASK = CircularBufferFormat::SECTOR_FLAG_FOOTER_MASK; //!< Bit that is cleared when a finalized sector has a footer
+    static const unsigned int SECTOR_FLAG_TIME_RANGE_MASK = CircularBufferFormat::SECTOR_FLAG_TIME_RANGE_MASK; //!< Bit that is cleared when a finalized sector has a time range
+    static const unsigned int SECTOR_FLAG_PARTIAL_READ_MASK = CircularBufferFormat::SECTOR_FLAG_PARTIAL_READ_MASK; //!< Bit that is cleared when a record is marked as read while the sector is not the oldest sector
+    static const unsigned int SECTOR_FLAG_RETAINED_MASK = CircularBufferFormat::SECTOR_FLAG_RETAINED_MASK; //!< Bit that is cleared when all records in a finalized sector have been read and it is kept for replay
+    static const uint16_t SECTOR_FOOTER_MAGIC = CircularBufferFormat::SECTOR_FOOTER_MAGIC; //!< Magic bytes in SectorFooter
+
+    static const unsigned int RECORD_SIZE_ERASED = CircularBufferFormat::RECORD_SIZE_ERASED; //!< Record size value when there is no record at this location. This is the value of the 16-bit value when the sector is erased.
+    static const unsigned int RECORD_FLAG_READ_MASK = CircularBufferFormat::RECORD_FLAG_READ_MASK; //!< Bit that is cleared when a record has been read.
+    static const unsigned int RECORD_FLAG_OPEN_MASK = CircularBufferFormat::RECORD_FLAG_OPEN_MASK; //!< Bit that is cleared when a record is started by openRecord(). The size is written on commit.
+    static const unsigned int RECORD_FLAG_ABORTED_MASK = CircularBufferFormat::RECORD_FLAG_ABORTED_MASK; //!< Bit that is cleared when a record from openRecord() is aborted. The read bit is also cleared.
+    static const unsigned int RECORD_FLAG_TIMESTAMP_MASK = CircularBufferFormat::RECORD_FLAG_TIMESTAMP_MASK; //!< Bit that is cleared when the record data starts with a 4 byte timestamp
+    static const unsigned int RECORD_TYPE_COUNT = CircularBufferFormat::RECORD_TYPE_COUNT; //!< Record types are 0 - 15
+
+    
+    /**
+     * @brief Number of cached Sector structures used by getSector
+     * 
+     * The Sector structure does not contain the data, so this is not a lot of RAM, but can add up
+     * especially if you are storing small records because there's a vector of RecordCommon structures,
+     * one for each record.
+     * 
+     * The cache exists because indexing a Sector requires n + 2 SPI reads where n is the number 
+     * of records, so this can be a lot of transactions if you have small records.
+     */
+    static const size_t SECTOR_CACHE_SIZE = 8;
+
+    static const size_t TAIL_CACHE_MAX_SIZE = 4096; //!< Maximum size for withTailCache()
+
+public:
+#ifndef UNITTEST
+    /**
+     * @brief Locks the mutex that protects shared resources
+     * 
+     * This is compatible with `WITH_LOCK(*this)`.
+     * 
+     * The mutex is not recursive so do not lock it within a locked section.
+     */
+#if CIRCULARBUFFERSPIFLASHRK_METRICS
+    void lock() { 
+        uint32_t startUs = micros();
+        os_mutex_recursive_lock(mutex); 
+        metricsLockAcquired(micros() - startUs);
+    };
+#else
+    void lock() { os_mutex_recursive_lock(mutex); };
+#endif
+
+    /**
+     * @brief Attempts to lock the mutex that protects shared resources
+     * 
+     * @return true if the mutex was locked or false if it was busy already.
+     */
+    bool tryLock() { return os_mutex_recursive_trylock(mutex); };
+
+    /**
+     * @brief Unlocks the mutex that protects shared resources
+     */
+    void unlock() { os_mutex_recursive_unlock(mutex); };
+#else
+#if CIRCULARBUFFERSPIFLASHRK_METRICS
+    void lock() { metricsLockAcquired(0); };
 #else
     void lock() {};
+#endif
     bool tryLock() { return true; };
     void unlock() {};
 #endif // UNITTEST
@@ -608,14 +1895,80 @@ protected:
     size_t addrStart; //!< Address in SPI flash where circular buffer begins, must be sector aligned
     size_t addrEnd; //!< Address in SPI flash where circular buffer ends, must be sector aligned
     size_t sectorCount; //!< Calculated in constructor, number of sectors from addrStart to addrEnd
+    size_t sectorSize; //!< Logical sector size in bytes, must be a power of 2
+    size_t deviceSectorSize; //!< Sector size of the flash chip (smallest erase unit), typically 4096
+    uint8_t sectorShift; //!< log2(sectorSize), calculated in constructor
+
+    size_t pageSize; //!< Flash page size, typically 256
+
+    uint8_t *pageBuf = nullptr; //!< Page buffer used by writeFlash(), pageSize bytes
+    size_t pageBufAddr = 0; //!< Flash address of the first byte in pageBuf not written to flash yet
+    size_t pageBufLen = 0; //!< Number of bytes in pageBuf not written to flash yet
+    bool writeBuffering = false; //!< Keep partial pages in pageBuf until full, see withWriteBuffering()
+    bool sectorFooter = false; //!< Write a footer when finalizing sectors, see withSectorFooter()
+
+    uint8_t *tailCache = nullptr; //!< Copy of recently written data, see withTailCache()
+    size_t tailCacheSize = 0; //!< Size of tailCache in bytes
+    size_t tailCacheAddr = 0; //!< Flash address of the first byte in tailCache
+    size_t tailCacheLen = 0; //!< Number of valid bytes in tailCache
+
+    uint8_t *readAheadBuf = nullptr; //!< Read ahead buffer, see withReadAhead()
+    size_t readAheadSize = 0; //!< Size of readAheadBuf in bytes
+    size_t readAheadRecords = 0; //!< Maximum number of records after the current one to read ahead
+    size_t readAheadAddr = 0; //!< Flash address of the first byte in readAheadBuf
+    size_t readAheadLen = 0; //!< Number of valid bytes in readAheadBuf
+    ReadAheadStats readAheadStats; //!< Statistics returned by getReadAheadStats()
+
+    bool recordWriterOpen = false; //!< true between openRecord() and RecordWriter commit() or abort()
+
+    /**
+     * @brief A record returned by readData() that has not been marked as read yet, see withLeases()
+     */
+    struct Lease {
+        uint32_t sectorNum; //!< Sector containing the record
+        uint32_t sequence; //!< Sequence number of that sector
+        size_t index; //!< Record index in the sector
+        unsigned long leaseTime; //!< millis() when the record was returned by readData()
+    };
+    Lease *leases = nullptr; //!< Array of leaseMax entries, see withLeases()
+    size_t leaseMax = 0; //!< Maximum number of leases
+    size_t leaseCount = 0; //!< Number of valid entries in leases
+    unsigned long leaseTimeoutMs = 0; //!< Leases older than this expire, 0 for no timeout
+
+    uint16_t priorityTypeMask = 0; //!< Record types that are high priority, see withPriorityTypes()
+    size_t priorityRelocateBytes = 0; //!< Maximum bytes moved per write, see withPriorityTypes()
+    uint32_t priorityDoneSequence = 0; //!< Sequence of the newest sector all of whose high priority records have been moved
+
+    uint16_t typeReadMask = 0; //!< typeMask of the last readData(readInfo, typeMask), 0 if typeReadSequence is not valid
+    uint32_t typeReadSequence = 0; //!< No unread records of the types in typeReadMask are before this sequence
+
+    UsageStats usageStats; //!< Maintained as records are written and read, returned by getUsageStats()
+    size_t writeSectorFree = 0; //!< Number of bytes available in the write sector, used for bytesUntilOverwrite
+
+#if CIRCULARBUFFERSPIFLASHRK_METRICS
+    Metrics metrics; //!< Returned by getMetrics()
+    size_t metricsOp = Metrics::OP_OTHER; //!< Operation that flash access is counted for, set by MetricsScope
+    bool metricsScopeActive = false; //!< true if a MetricsScope exists
+#endif
+
+#if CIRCULARBUFFERSPIFLASHRK_TRACE
+    TraceEntry *traceBuf = nullptr; //!< Trace ring, see withTrace()
+    size_t traceSize = 0; //!< Number of entries in traceBuf
+    size_t traceStart = 0; //!< Index of the oldest entry in traceBuf
+    size_t traceCount = 0; //!< Number of valid entries in traceBuf
+#endif
 
     SectorCommon *sectorMeta = nullptr; //!< Array of SectorCommon structures, one for each sector.
+    SectorTimeRange *sectorTimeRanges = nullptr; //!< Array of time ranges, one for each sector, see withTimeIndex()
 
 
     bool isValid = false; //!< true once load() or format() has been called and is successful
     std::deque<Sector*> sectorCache; //!< Cache used by getSector()
 
     uint32_t firstSequence = 0; //!< Sequence number of read from
+    uint32_t readSequence = 0; //!< Sequence of the oldest sector that is not retained, if larger than firstSequence, see getReadSequence()
+    bool retainAfterRead = false; //!< Keep sectors after all records are read, see withRetainAfterRead()
+    std::function<void(size_t addr)> blockErase32KFn; //!< 32K block erase, see withBlockErase32K()
     uint32_t writeSequence = 0; //!< Sequence number to write to
     uint32_t lastSequence = 0; //!< Last sequence number used.
 
@@ -0,0 +1,153 @@
+#ifndef __CIRCULARBUFFERSPIFLASHRKFORMAT_H
+#define __CIRCULARBUFFERSPIFLASHRKFORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// On-flash format definitions for CircularBufferSpiFlashRK
+//
+// This is separate from CircularBufferSpiFlashRK.h and does not depend on Particle.h so
+// it can be used by host tools such as tools/flashinspect. The structures are available
+// as CircularBufferSpiFlashRK::RecordCommon, SectorCommon, SectorHeader, etc., and the
+// constants as members of CircularBufferSpiFlashRK.
+//
+// Multi-byte values are stored little endian, as they are in RAM on the device.
+
+/**
+ * @brief Data stored in flash for each record in the sector
+ *
+ * This 4 byte (32 bit) structure is stored packed after the SectorHeader.
+ * If the size is all 1 bits (RECORD_SIZE_ERASED, 0xffff) then this record
+ * has not been written yet. (SPI NOR flash sectors are initialized to all
+ * 1s during sector or chip erase.)
+ */
+struct CircularBufferRecordCommon { // 4 bytes
+    unsigned int size : 16; //!< Number of bytes (0 - 65515 with 64K sectors, less with smaller sectors)
+    unsigned int flags : 8; //!< Flag bits
+    unsigned int typeTag : 8; //!< Record type in the low 4 bits, inverted so an erased value (0xff) is type 0. See getRecordType().
+} __attribute__((__packed__));
+
+/**
+ * @brief Data stored after the magic bytes in flash
+ *
+ * A copy of this is kept in RAM as well, so the library will use 12 bytes of
+ * RAM for each sector.
+ */
+struct CircularBufferSectorCommon { // 12 bytes
+    uint32_t sequence; //!< Monotonically increasing sequence number for sector used
+    unsigned int flags:8; //!< Various flag bits
+    unsigned int sectorShift:8; //!< log2 of the sector size the buffer was formatted with (12, 15, or 16)
+    unsigned int typeBitmap:16; //!< Bit n is cleared if the sector contains a record of type n, set during finalize
+    unsigned int recordCount:16; //!< Number of records, set during finalize
+    unsigned int dataSize:16; //!< Number of bytes of data in records, set during finalize
+} __attribute__((__packed__));
+
+/**
+ * @brief Structure store at the beginning of each sector
+ *
+ * This is separate from SectorCommon since we store information about each
+ * sector in the circular buffer. The magic bytes are necessary in flash but
+ * not in RAM, so not storing it in RAM saves 4 bytes per sector.
+ */
+struct CircularBufferSectorHeader { // 16 bytes
+    uint32_t sectorMagic; //!< Magic bytes SECTOR_MAGIC = 0x0ceb6444
+    CircularBufferSectorCommon c; //!< SectorCommon structure (12 bytes)
+} __attribute__((__packed__));
+
+/**
+ * @brief Trailer stored in the last 4 bytes of a finalized sector that has a footer
+ *
+ * The footer is written by finalizeSector() when enabled by withSectorFooter() and it fits
+ * in the unused space at the end of the sector. It's laid out as, ending at the end of the sector:
+ *
+ * - A copy of the RecordCommon for each record at the time of finalize (recordCount entries)
+ * - A read bitmap, (recordCount + 7) / 8 bytes. Bit (index % 8) of byte (index / 8) is cleared 
+ *   when record index is marked as read, instead of the READ bit in the RecordCommon.
+ * - This structure
+ *
+ * SECTOR_FLAG_FOOTER_MASK in the sector header is cleared after the footer is written. There is
+ * always at least sizeof(RecordCommon) erased bytes between the last record and the footer so
+ * walking the records stops before the footer.
+ */
+struct CircularBufferSectorFooter { // 4 bytes
+    uint16_t recordCount; //!< Number of RecordCommon entries in the footer, including aborted records
+    uint16_t footerMagic; //!< SECTOR_FOOTER_MAGIC
+} __attribute__((__packed__));
+
+/**
+ * @brief Oldest and newest record timestamps, stored in the last 8 bytes of a finalized sector
+ *
+ * This is written by finalizeSector() when enabled by withTimeIndex() and SECTOR_FLAG_TIME_RANGE_MASK
+ * in the sector header is cleared after it's written. If the sector also has a footer, the footer ends
+ * immediately before this structure instead of at the end of the sector.
+ *
+ * Records without a timestamp (RECORD_FLAG_TIMESTAMP_MASK not cleared) are counted as timestamp 0.
+ */
+struct CircularBufferSectorTimeRange { // 8 bytes
+    uint32_t minTimestamp; //!< Smallest record timestamp in the sector
+    uint32_t maxTimestamp; //!< Largest record timestamp in the sector
+} __attribute__((__packed__));
+
+/**
+ * @brief Constants for the on-flash format
+ */
+struct CircularBufferFormat {
+    static const uint32_t SECTOR_MAGIC = 0x0ceb6444; //!< Magic bytes stored at beginning of SectorHeader structure
+    static const uint32_t SECTOR_MAGIC_V1 = 0x0ceb6443; //!< Magic bytes used by version 0.0.1 (2 byte RecordCommon), must be reformatted
+    static const uint32_t SECTOR_MAGIC_ERASED = 0xffffffff; //!< Magic bytes value if the sector is erased and not formatted.
+    static const unsigned int SECTOR_FLAG_STARTED_MASK = 0x01; //!< Bit that is cleared when a sector is first written to after formatting
+    static const unsigned int SECTOR_FLAG_FINALIZED_MASK = 0x02; //!< Bit that is cleared when a sector has been fully written to
+    static const unsigned int SECTOR_FLAG_CORRUPTED_MASK = 0x04; //!< Bit that is cleared when a sector has invalid record structures
+    static const unsigned int SECTOR_FLAG_FOOTER_MASK = 0x08; //!< Bit that is cleared when a finalized sector has a footer, see CircularBufferSectorFooter
+    static const unsigned int SECTOR_FLAG_TIME_RANGE_MASK = 0x10; //!< Bit that is cleared when a finalized sector has a time range, see CircularBufferSectorTimeRange
+    static const unsigned int SECTOR_FLAG_PARTIAL_READ_MASK = 0x20; //!< Bit that is cleared when a record is marked as read while the sector is not the oldest sector
+    static const unsigned int SECTOR_FLAG_RETAINED_MASK = 0x40; //!< Bit that is cleared when all records in a finalized sector have been read and it's kept for replay instead of being erased
+    static const uint16_t SECTOR_FOOTER_MAGIC = 0xf007; //!< Magic bytes in CircularBufferSectorFooter
+
+    static const unsigned int RECORD_SIZE_ERASED = 0xffff; //!< Record size value when there is no record at this location. This is the value of the 16-bit value when the sector is erased.
+    static const unsigned int RECORD_FLAG_READ_MASK = 0x1; //!< Bit that is cleared when a record has been read.
+    static const unsigned int RECORD_FLAG_OPEN_MASK = 0x2; //!< Bit that is cleared when a record is started by openRecord(). The size is written on commit.
+    static const unsigned int RECORD_FLAG_ABORTED_MASK = 0x4; //!< Bit that is cleared when a record from openRecord() is aborted. The read bit is also cleared.
+    static const unsigned int RECORD_FLAG_TIMESTAMP_MASK = 0x8; //!< Bit that is cleared when the record data starts with a 4 byte timestamp, which is included in size.
+    static const unsigned int RECORD_TYPE_COUNT = 16; //!< Record types are 0 - 15, one bit each in typeBitmap
+
+    /**
+     * @brief Size of the footer for a sector with recordCount records, including the CircularBufferSectorFooter
+     */
+    static size_t getFooterSize(size_t recordCount) { 
+        return recordCount * sizeof(CircularBufferRecordCommon) + (recordCount + 7) / 8 + sizeof(CircularBufferSectorFooter); 
+    }
+
+    /**
+     * @brief Offset of the end of the footer (or the end of the records, if no footer) in a finalized sector
+     *
+     * @param sectorSize Sector size in bytes
+     * @param sectorFlags Flags from CircularBufferSectorCommon
+     */
+    static size_t getFooterEnd(size_t sectorSize, unsigned int sectorFlags) {
+        return sectorSize - (((sectorFlags & SECTOR_FLAG_TIME_RANGE_MASK) == 0) ? sizeof(CircularBufferSectorTimeRange) : 0);
+    }
+
+    /**
+     * @brief Number of bytes at the beginning of the record data used by the timestamp, 0 or 4
+     */
+    static size_t getTimestampSize(const CircularBufferRecordCommon &recordCommon) {
+        return ((recordCommon.flags & RECORD_FLAG_TIMESTAMP_MASK) == 0) ? sizeof(uint32_t) : 0;
+    }
+
+    /**
+     * @brief Get the record type (0 - 15) from a RecordCommon
+     */
+    static uint8_t getRecordType(const CircularBufferRecordCommon &recordCommon) {
+        return (uint8_t)(~recordCommon.typeTag & (RECORD_TYPE_COUNT - 1));
+    }
+
+    /**
+     * @brief Get the value to store in RecordCommon typeTag for a record type (0 - 15)
+     */
+    static uint8_t getTypeTag(uint8_t type) {
+        return (uint8_t)~(type & (RECORD_TYPE_COUNT - 1));
+    }
+};
+
+#endif // __CIRCULARBUFFERSPIFLASHRKFORMAT_H
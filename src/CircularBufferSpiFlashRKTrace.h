@@ -0,0 +1,52 @@
+#ifndef __CIRCULARBUFFERSPIFLASHRKTRACE_H
+#define __CIRCULARBUFFERSPIFLASHRKTRACE_H
+
+#include <stdint.h>
+
+/**
+ * @brief One entry in the trace ring, see CircularBufferSpiFlashRK::withTrace()
+ *
+ * This is separate from CircularBufferSpiFlashRK.h and does not depend on Particle.h so
+ * it can be used by host tools such as tools/trace2chrome. A dumped trace is an array of
+ * these 20 byte structures, stored little endian as they are in RAM.
+ */
+struct CircularBufferTraceEntry { // 20 bytes
+    uint32_t timestampUs; //!< micros() when the step started
+    uint32_t durationUs; //!< Number of microseconds the step took
+    uint32_t sectorNum; //!< Sector number (within the circular buffer, not the device)
+    uint32_t sequence; //!< Sector sequence number. For EVENT_WRITE_SECTOR_HEADER, the new sequence number.
+    uint16_t data; //!< Depends on the event, see the EVENT_ constants
+    uint8_t event; //!< One of the EVENT_ constants
+    uint8_t reserved; //!< Reserved for future use, 0
+
+    static const uint8_t EVENT_READ_SECTOR = 1; //!< readSector() indexing a sector, data is the number of records
+    static const uint8_t EVENT_APPEND = 2; //!< appendDataToSector() writing a record, data is the size of the record
+    static const uint8_t EVENT_FINALIZE = 3; //!< finalizeSector(), data is the number of records
+    static const uint8_t EVENT_WRITE_SECTOR_HEADER = 4; //!< writeSectorHeader(), data is 1 if the sector was erased
+    static const uint8_t EVENT_MARK_AS_READ = 5; //!< markAsRead(), data is the record index
+
+    /**
+     * @brief Get a readable name for an event, such as "readSector" for EVENT_READ_SECTOR
+     *
+     * @param event The event, such as EVENT_READ_SECTOR
+     * @return const char* The name
+     */
+    static const char *getEventName(uint8_t event) {
+        switch(event) {
+            case EVENT_READ_SECTOR:
+                return "readSector";
+            case EVENT_APPEND:
+                return "appendDataToSector";
+            case EVENT_FINALIZE:
+                return "finalizeSector";
+            case EVENT_WRITE_SECTOR_HEADER:
+                return "writeSectorHeader";
+            case EVENT_MARK_AS_READ:
+                return "markAsRead";
+            default:
+                return "unknown";
+        }
+    }
+} __attribute__((__packed__));
+
+#endif // __CIRCULARBUFFERSPIFLASHRKTRACE_H
@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CircularBufferSpiFlashRKFormat.h"
+
+// Host tool to inspect a raw flash image containing a CircularBufferSpiFlashRK buffer and extract its records.
+// Build using: make
+// Usage: ./flashinspect [options] image.bin
+//
+// The image is a raw dump of the flash chip (erased bytes are 0xff), such as one read from a device
+// or saved using SpiFlash::saveImage() in the automated tests.
+//
+// Binary export format: for each record, a 16 byte ExportRecordHeader followed by the record data.
+// JSONL export format: one JSON object per record. Records that are printable text (optionally
+// with a trailing null) are in "data", others are base64 encoded in "dataBase64". Records written
+// with a timestamp have "timestamp"; the timestamp is not included in the data. Records with a type
+// other than 0 have "type".
+
+typedef CircularBufferFormat Format;
+
+/**
+ * @brief Header before each record in the binary export format, little endian
+ */
+struct ExportRecordHeader { // 16 bytes
+    uint32_t sequence; //!< Sector sequence number
+    uint16_t index; //!< Record index within the sector
+    uint16_t size; //!< Number of bytes of data that follow
+    uint32_t timestamp; //!< Record timestamp, or 0 if the record does not have one
+    uint8_t type; //!< Record type, 0 - 15
+    uint8_t reserved[3]; //!< 0
+} __attribute__((__packed__));
+
+/**
+ * @brief Information about one sector, from analyzeSector()
+ */
+struct SectorInfo {
+    enum class State {
+        ERASED, //!< Not formatted
+        VALID, //!< Valid sector header
+        OLD_FORMAT, //!< SECTOR_MAGIC_V1, must be reformatted
+        INVALID //!< Not a sector header
+    };
+
+    uint32_t sectorNum = 0;
+    State state = State::ERASED;
+    CircularBufferSectorCommon c;
+    const char *error = nullptr; //!< Set if the record structure is corrupted
+    size_t recordCount = 0; //!< Number of records, not including aborted records
+    size_t unreadCount = 0;
+    size_t abortedCount = 0;
+    size_t dataSize = 0; //!< Bytes of data in records, not including aborted records
+    size_t usedBytes = 0; //!< Bytes used in the sector including headers and aborted records
+    bool openRecord = false; //!< True if there is a record from openRecord() that was never committed
+    bool hasFooter = false; //!< True if the sector has a footer, see CircularBufferSectorFooter
+    bool hasTimeRange = false; //!< True if the sector has a time range, see CircularBufferSectorTimeRange
+    CircularBufferSectorTimeRange timeRange; //!< Valid if hasTimeRange
+    uint16_t types = 0; //!< Bit n is set if the sector contains a record of type n, not including aborted records
+
+    bool isStarted() const { return (c.flags & Format::SECTOR_FLAG_STARTED_MASK) == 0; };
+    bool isFinalized() const { return (c.flags & Format::SECTOR_FLAG_FINALIZED_MASK) == 0; };
+    bool isRetained() const { return (c.flags & Format::SECTOR_FLAG_RETAINED_MASK) == 0; };
+    bool isCorrupted() const { return (c.flags & Format::SECTOR_FLAG_CORRUPTED_MASK) == 0 || error != nullptr; };
+};
+
+/**
+ * @brief Options from the command line
+ */
+struct Options {
+    const char *imagePath = nullptr;
+    size_t offset = 0;
+    size_t size = 0;
+    size_t sectorSize = 0;
+    bool printSectors = false;
+    const char *exportPath = nullptr;
+    bool exportAll = false;
+    bool jsonl = true;
+    size_t threads = 0;
+};
+
+/**
+ * @brief Walk the records in a sector, calling fn for each record that is not aborted
+ *
+ * This follows the same rules as CircularBufferSpiFlashRK::readSector(). The read flag passed to
+ * fn includes records marked as read in the footer.
+ */
+void walkRecords(const uint8_t *sectorData, size_t sectorSize, SectorInfo &info, std::function<void(size_t index, const CircularBufferRecordCommon &rc, const uint8_t *data)> fn) {
+    const size_t maxRecordSize = sectorSize - sizeof(CircularBufferSectorHeader) - sizeof(CircularBufferRecordCommon);
+
+    // Finalized sectors with a footer have the read flags in the footer bitmap
+    const uint8_t *readBitmap = nullptr;
+    size_t footerRecordCount = 0;
+    size_t footerEnd = sectorSize;
+    if ((info.c.flags & (Format::SECTOR_FLAG_FINALIZED_MASK | Format::SECTOR_FLAG_TIME_RANGE_MASK)) == 0) {
+        // The time range is in the last 8 bytes and the footer ends before it
+        footerEnd = Format::getFooterEnd(sectorSize, info.c.flags);
+        memcpy(&info.timeRange, &sectorData[footerEnd], sizeof(info.timeRange));
+        info.hasTimeRange = true;
+    }
+    if ((info.c.flags & (Format::SECTOR_FLAG_FINALIZED_MASK | Format::SECTOR_FLAG_FOOTER_MASK)) == 0) {
+        CircularBufferSectorFooter footer;
+        memcpy(&footer, &sectorData[footerEnd - sizeof(footer)], sizeof(footer));
+        if (footer.footerMagic == Format::SECTOR_FOOTER_MAGIC && Format::getFooterSize(footer.recordCount) < footerEnd) {
+            footerRecordCount = footer.recordCount;
+            readBitmap = &sectorData[footerEnd - sizeof(footer) - (footerRecordCount + 7) / 8];
+            info.hasFooter = true;
+        }
+    }
+
+    size_t offset = sizeof(CircularBufferSectorHeader);
+    size_t index = 0;
+    while((offset + sizeof(CircularBufferRecordCommon)) < sectorSize) {
+        CircularBufferRecordCommon rc;
+        memcpy(&rc, &sectorData[offset], sizeof(rc));
+        if (readBitmap && index < footerRecordCount && (readBitmap[index / 8] & (1 << (index % 8))) == 0) {
+            rc.flags &= ~Format::RECORD_FLAG_READ_MASK;
+        }
+
+        if (rc.size == Format::RECORD_SIZE_ERASED) {
+            if (rc.flags != 0xff || rc.typeTag != 0xff) {
+                info.openRecord = true;
+            }
+            break;
+        }
+        if (rc.size > maxRecordSize) {
+            info.error = "invalid size";
+            break;
+        }
+        size_t nextOffset = offset + sizeof(CircularBufferRecordCommon) + rc.size;
+        if (nextOffset > sectorSize) {
+            info.error = "invalid offset";
+            break;
+        }
+
+        if ((rc.flags & Format::RECORD_FLAG_ABORTED_MASK) == 0) {
+            info.abortedCount++;
+        }
+        else {
+            info.recordCount++;
+            info.dataSize += rc.size;
+            info.types |= (uint16_t)(1 << Format::getRecordType(rc));
+            if ((rc.flags & Format::RECORD_FLAG_READ_MASK) != 0) {
+                info.unreadCount++;
+            }
+            if (fn) {
+                fn(index, rc, &sectorData[offset + sizeof(CircularBufferRecordCommon)]);
+            }
+        }
+        index++;
+        offset = nextOffset;
+    }
+    info.usedBytes = offset;
+}
+
+void analyzeSector(const uint8_t *sectorData, size_t sectorSize, SectorInfo &info) {
+    CircularBufferSectorHeader header;
+    memcpy(&header, sectorData, sizeof(header));
+    info.c = header.c;
+
+    if (header.sectorMagic == Format::SECTOR_MAGIC_ERASED) {
+        info.state = SectorInfo::State::ERASED;
+        return;
+    }
+    if (header.sectorMagic == Format::SECTOR_MAGIC_V1) {
+        info.state = SectorInfo::State::OLD_FORMAT;
+        return;
+    }
+    if (header.sectorMagic != Format::SECTOR_MAGIC || ((size_t)1 << header.c.sectorShift) != sectorSize) {
+        info.state = SectorInfo::State::INVALID;
+        return;
+    }
+    info.state = SectorInfo::State::VALID;
+
+    walkRecords(sectorData, sectorSize, info, nullptr);
+}
+
+/**
+ * @brief Call fn(index) for index 0 to count - 1 using multiple threads
+ */
+void parallelFor(size_t count, size_t threads, std::function<void(size_t)> fn) {
+    const size_t chunkSize = 64;
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        while(true) {
+            size_t start = next.fetch_add(chunkSize);
+            if (start >= count) {
+                break;
+            }
+            size_t end = std::min(start + chunkSize, count);
+            for(size_t ii = start; ii < end; ii++) {
+                fn(ii);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for(size_t ii = 1; ii < threads; ii++) {
+        pool.push_back(std::thread(worker));
+    }
+    worker();
+    for(std::thread &t : pool) {
+        t.join();
+    }
+}
+
+void appendBase64(std::string &out, const uint8_t *data, size_t len) {
+    static const char *chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for(size_t ii = 0; ii < len; ii += 3) {
+        uint32_t value = (uint32_t)data[ii] << 16;
+        if (ii + 1 < len) {
+            value |= (uint32_t)data[ii + 1] << 8;
+        }
+        if (ii + 2 < len) {
+            value |= data[ii + 2];
+        }
+        out += chars[(value >> 18) & 0x3f];
+        out += chars[(value >> 12) & 0x3f];
+        out += (ii + 1 < len) ? chars[(value >> 6) & 0x3f] : '=';
+        out += (ii + 2 < len) ? chars[value & 0x3f] : '=';
+    }
+}
+
+/**
+ * @brief Appends data as a JSON string if it's printable text, returning false if it's not
+ */
+bool appendJsonText(std::string &out, const uint8_t *data, size_t len) {
+    if (len > 0 && data[len - 1] == 0) {
+        // c-strings are stored with the trailing null
+        len--;
+    }
+    for(size_t ii = 0; ii < len; ii++) {
+        if ((data[ii] < 0x20 && data[ii] != '\t' && data[ii] != '\n' && data[ii] != '\r') || data[ii] >= 0x7f) {
+            return false;
+        }
+    }
+
+    out += '"';
+    for(size_t ii = 0; ii < len; ii++) {
+        char ch = (char)data[ii];
+        switch(ch) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\t': out += "\\t"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            default: out += ch; break;
+        }
+    }
+    out += '"';
+    return true;
+}
+
+void exportSector(const uint8_t *sectorData, size_t sectorSize, const Options &options, std::string &out) {
+    SectorInfo info;
+    memcpy(&info.c, &sectorData[sizeof(uint32_t)], sizeof(info.c));
+
+    walkRecords(sectorData, sectorSize, info, [&](size_t index, const CircularBufferRecordCommon &rc, const uint8_t *data) {
+        bool isRead = (rc.flags & Format::RECORD_FLAG_READ_MASK) == 0;
+        if (isRead && !options.exportAll) {
+            return;
+        }
+
+        // The timestamp is stored before the data and included in the record size
+        size_t timestampSize = Format::getTimestampSize(rc);
+        uint32_t timestamp = 0;
+        if (timestampSize) {
+            memcpy(&timestamp, data, timestampSize);
+        }
+        const uint8_t *recordData = &data[timestampSize];
+        size_t size = rc.size - timestampSize;
+
+        if (options.jsonl) {
+            char buf[160];
+            snprintf(buf, sizeof(buf), "{\"sequence\":%lu,\"index\":%lu,\"size\":%u,\"read\":%s,",
+                (unsigned long)info.c.sequence, (unsigned long)index, (unsigned)size, isRead ? "true" : "false");
+            out += buf;
+            if (timestampSize) {
+                snprintf(buf, sizeof(buf), "\"timestamp\":%lu,", (unsigned long)timestamp);
+                out += buf;
+            }
+            if (Format::getRecordType(rc) != 0) {
+                snprintf(buf, sizeof(buf), "\"type\":%u,", (unsigned)Format::getRecordType(rc));
+                out += buf;
+            }
+
+            size_t start = out.size();
+            out += "\"data\":";
+            if (!appendJsonText(out, recordData, size)) {
+                out.resize(start);
+                out += "\"dataBase64\":\"";
+                appendBase64(out, recordData, size);
+                out += '"';
+            }
+            out += "}\n";
+        }
+        else {
+            ExportRecordHeader header;
+            header.sequence = info.c.sequence;
+            header.index = (uint16_t)index;
+            header.size = (uint16_t)size;
+            header.timestamp = timestamp;
+            header.type = Format::getRecordType(rc);
+            memset(header.reserved, 0, sizeof(header.reserved));
+            out.append((const char *)&header, sizeof(header));
+            out.append((const char *)recordData, size);
+        }
+    });
+}
+
+const char *sectorStateName(const SectorInfo &info) {
+    switch(info.state) {
+        case SectorInfo::State::ERASED:
+            return "erased";
+        case SectorInfo::State::OLD_FORMAT:
+            return "oldFormat";
+        case SectorInfo::State::INVALID:
+            return "invalid";
+        default:
+            if (info.isCorrupted()) {
+                return "corrupted";
+            }
+            if (info.isFinalized()) {
+                return "finalized";
+            }
+            if (info.isStarted()) {
+                return "started";
+            }
+            return "empty";
+    }
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [options] image.bin\n", name);
+    fprintf(stderr, "  --offset N       Address of the circular buffer in the image (default: 0)\n");
+    fprintf(stderr, "  --size N         Size of the circular buffer in bytes (default: rest of the image)\n");
+    fprintf(stderr, "  --sector-size N  Sector size (default: from the first sector header, or 4096)\n");
+    fprintf(stderr, "  --sectors        Print a line for each sector\n");
+    fprintf(stderr, "  --export FILE    Export records to FILE, - for stdout\n");
+    fprintf(stderr, "  --all            Export all records, including records already read (default: unread only)\n");
+    fprintf(stderr, "  --format F       Export format, jsonl or binary (default: jsonl)\n");
+    fprintf(stderr, "  --threads N      Number of threads (default: number of cores)\n");
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+
+    for(int ii = 1; ii < argc; ii++) {
+        bool hasValue = (ii + 1) < argc;
+        if (strcmp(argv[ii], "--offset") == 0 && hasValue) {
+            options.offset = strtoull(argv[++ii], nullptr, 0);
+        }
+        else
+        if (strcmp(argv[ii], "--size") == 0 && hasValue) {
+            options.size = strtoull(argv[++ii], nullptr, 0);
+        }
+        else
+        if (strcmp(argv[ii], "--sector-size") == 0 && hasValue) {
+            options.sectorSize = strtoull(argv[++ii], nullptr, 0);
+        }
+        else
+        if (strcmp(argv[ii], "--sectors") == 0) {
+            options.printSectors = true;
+        }
+        else
+        if (strcmp(argv[ii], "--export") == 0 && hasValue) {
+            options.exportPath = argv[++ii];
+        }
+        else
+        if (strcmp(argv[ii], "--all") == 0) {
+            options.exportAll = true;
+        }
+        else
+        if (strcmp(argv[ii], "--format") == 0 && hasValue) {
+            const char *format = argv[++ii];
+            if (strcmp(format, "jsonl") == 0) {
+                options.jsonl = true;
+            }
+            else
+            if (strcmp(format, "binary") == 0) {
+                options.jsonl = false;
+            }
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else
+        if (strcmp(argv[ii], "--threads") == 0 && hasValue) {
+            options.threads = strtoul(argv[++ii], nullptr, 0);
+        }
+        else
+        if (argv[ii][0] != '-' && !options.imagePath) {
+            options.imagePath = argv[ii];
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!options.imagePath) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (options.threads == 0) {
+        options.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    int fd = open(options.imagePath, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "could not open %s\n", options.imagePath);
+        return 1;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) != 0 || (size_t)sb.st_size <= options.offset) {
+        fprintf(stderr, "invalid image or offset\n");
+        return 1;
+    }
+    size_t imageSize = (size_t)sb.st_size;
+    if (options.size == 0) {
+        options.size = imageSize - options.offset;
+    }
+    if (options.offset + options.size > imageSize) {
+        fprintf(stderr, "offset and size are larger than the image (%lu bytes)\n", (unsigned long)imageSize);
+        return 1;
+    }
+
+    const uint8_t *image = (const uint8_t *)mmap(nullptr, imageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "could not map %s\n", options.imagePath);
+        return 1;
+    }
+    // Sectors are exported in sequence order, not address order, so prefetch the whole image
+    madvise((void *)image, imageSize, MADV_WILLNEED);
+    const uint8_t *bufferStart = &image[options.offset];
+
+    if (options.sectorSize == 0) {
+        options.sectorSize = 4096;
+        CircularBufferSectorHeader header;
+        memcpy(&header, bufferStart, sizeof(header));
+        if (header.sectorMagic == Format::SECTOR_MAGIC && header.c.sectorShift >= 12 && header.c.sectorShift <= 16) {
+            options.sectorSize = (size_t)1 << header.c.sectorShift;
+        }
+    }
+    const size_t sectorSize = options.sectorSize;
+    const size_t sectorCount = options.size / sectorSize;
+
+    std::vector<SectorInfo> sectors(sectorCount);
+    parallelFor(sectorCount, options.threads, [&](size_t sectorNum) {
+        sectors[sectorNum].sectorNum = (uint32_t)sectorNum;
+        analyzeSector(&bufferStart[sectorNum * sectorSize], sectorSize, sectors[sectorNum]);
+    });
+
+    // Ring order is by sequence number
+    std::vector<uint32_t> ring;
+    size_t counts[4] = {0};
+    size_t finalizedCount = 0, corruptedCount = 0, openRecordCount = 0;
+    size_t recordCount = 0, unreadCount = 0, abortedCount = 0, dataSize = 0;
+    for(const SectorInfo &info : sectors) {
+        counts[(int)info.state]++;
+        if (info.state != SectorInfo::State::VALID) {
+            continue;
+        }
+        ring.push_back(info.sectorNum);
+        if (info.isFinalized()) {
+            finalizedCount++;
+        }
+        if (info.isCorrupted()) {
+            corruptedCount++;
+        }
+        if (info.openRecord) {
+            openRecordCount++;
+        }
+        recordCount += info.recordCount;
+        unreadCount += info.unreadCount;
+        abortedCount += info.abortedCount;
+        dataSize += info.dataSize;
+    }
+    std::sort(ring.begin(), ring.end(), [&](uint32_t a, uint32_t b) {
+        return sectors[a].c.sequence < sectors[b].c.sequence;
+    });
+
+    size_t sequenceGaps = 0;
+    for(size_t ii = 1; ii < ring.size(); ii++) {
+        if (sectors[ring[ii]].c.sequence != sectors[ring[ii - 1]].c.sequence + 1) {
+            sequenceGaps++;
+        }
+    }
+
+    FILE *info = (options.exportPath && strcmp(options.exportPath, "-") == 0) ? stderr : stdout;
+
+    fprintf(info, "image=%s offset=0x%lx size=%lu sectorSize=%lu sectorCount=%lu\n", options.imagePath,
+        (unsigned long)options.offset, (unsigned long)options.size, (unsigned long)sectorSize, (unsigned long)sectorCount);
+    fprintf(info, "sectors: valid=%lu erased=%lu oldFormat=%lu invalid=%lu finalized=%lu corrupted=%lu openRecord=%lu\n",
+        (unsigned long)counts[(int)SectorInfo::State::VALID], (unsigned long)counts[(int)SectorInfo::State::ERASED],
+        (unsigned long)counts[(int)SectorInfo::State::OLD_FORMAT], (unsigned long)counts[(int)SectorInfo::State::INVALID],
+        (unsigned long)finalizedCount, (unsigned long)corruptedCount, (unsigned long)openRecordCount);
+    if (!ring.empty()) {
+        uint32_t readSectorNum = ring.back();
+        for(uint32_t sectorNum : ring) {
+            if (sectors[sectorNum].unreadCount) {
+                readSectorNum = sectorNum;
+                break;
+            }
+        }
+        fprintf(info, "ring: oldestSector=%lu oldestSequence=%lu newestSector=%lu newestSequence=%lu readSector=%lu sequenceGaps=%lu\n",
+            (unsigned long)ring.front(), (unsigned long)sectors[ring.front()].c.sequence,
+            (unsigned long)ring.back(), (unsigned long)sectors[ring.back()].c.sequence,
+            (unsigned long)readSectorNum, (unsigned long)sequenceGaps);
+    }
+    fprintf(info, "records: total=%lu unread=%lu read=%lu aborted=%lu dataSize=%lu\n",
+        (unsigned long)recordCount, (unsigned long)unreadCount, (unsigned long)(recordCount - unreadCount),
+        (unsigned long)abortedCount, (unsigned long)dataSize);
+
+    if (options.printSectors) {
+        for(uint32_t sectorNum = 0; sectorNum < sectorCount; sectorNum++) {
+            const SectorInfo &s = sectors[sectorNum];
+            if (s.state == SectorInfo::State::VALID) {
+                char timeRange[40] = {0};
+                if (s.hasTimeRange) {
+                    snprintf(timeRange, sizeof(timeRange), " timeRange=%lu-%lu", (unsigned long)s.timeRange.minTimestamp, (unsigned long)s.timeRange.maxTimestamp);
+                }
+                char types[20] = {0};
+                if (s.types & ~1) {
+                    // Only shown if there are records with a type other than 0
+                    snprintf(types, sizeof(types), " types=0x%04x", (unsigned)s.types);
+                }
+                fprintf(info, "sector=%lu sequence=%lu state=%s records=%lu unread=%lu aborted=%lu dataSize=%lu used=%lu free=%lu%s%s%s%s%s%s%s\n",
+                    (unsigned long)sectorNum, (unsigned long)s.c.sequence, sectorStateName(s),
+                    (unsigned long)s.recordCount, (unsigned long)s.unreadCount, (unsigned long)s.abortedCount,
+                    (unsigned long)s.dataSize, (unsigned long)s.usedBytes, (unsigned long)(sectorSize - s.usedBytes),
+                    s.openRecord ? " openRecord" : "", s.hasFooter ? " footer" : "", s.isRetained() ? " retained" : "", timeRange, types, s.error ? " error=" : "", s.error ? s.error : "");
+            }
+            else {
+                fprintf(info, "sector=%lu state=%s\n", (unsigned long)sectorNum, sectorStateName(s));
+            }
+        }
+    }
+
+    if (options.exportPath) {
+        FILE *out = stdout;
+        if (strcmp(options.exportPath, "-") != 0) {
+            out = fopen(options.exportPath, "wb");
+            if (!out) {
+                fprintf(stderr, "could not open %s\n", options.exportPath);
+                return 1;
+            }
+        }
+
+        // Sectors are formatted in parallel in batches, then written in ring order
+        const size_t batchSize = options.threads * 256;
+        std::vector<std::string> batch;
+        for(size_t start = 0; start < ring.size(); start += batchSize) {
+            size_t count = std::min(batchSize, ring.size() - start);
+            batch.assign(count, std::string());
+
+            parallelFor(count, options.threads, [&](size_t ii) {
+                uint32_t sectorNum = ring[start + ii];
+                if (sectors[sectorNum].isCorrupted() && sectors[sectorNum].recordCount == 0) {
+                    return;
+                }
+                exportSector(&bufferStart[sectorNum * sectorSize], sectorSize, options, batch[ii]);
+            });
+
+            for(const std::string &s : batch) {
+                if (!s.empty() && fwrite(s.data(), 1, s.size(), out) != s.size()) {
+                    fprintf(stderr, "write failed\n");
+                    return 1;
+                }
+            }
+        }
+
+        if (out != stdout) {
+            fclose(out);
+        }
+        fprintf(stderr, "exported %lu records\n", (unsigned long)(options.exportAll ? recordCount : unreadCount));
+    }
+
+    munmap((void *)image, imageSize);
+    close(fd);
+
+    return 0;
+}
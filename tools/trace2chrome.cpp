@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+#include "CircularBufferSpiFlashRKTrace.h"
+
+// Host tool to convert a trace from CircularBufferSpiFlashRK::readTrace() into Chrome trace JSON.
+// Build using: make
+// Usage: ./trace2chrome trace.bin [trace.json]
+// Open the JSON file in chrome://tracing or https://ui.perfetto.dev
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.bin [trace.json]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *inFile = fopen(argv[1], "rb");
+    if (!inFile) {
+        fprintf(stderr, "could not open %s\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<CircularBufferTraceEntry> entries;
+    CircularBufferTraceEntry entry;
+    while(fread(&entry, sizeof(entry), 1, inFile) == 1) {
+        entries.push_back(entry);
+    }
+    fclose(inFile);
+
+    FILE *outFile = stdout;
+    if (argc >= 3) {
+        outFile = fopen(argv[2], "w");
+        if (!outFile) {
+            fprintf(stderr, "could not open %s\n", argv[2]);
+            return 1;
+        }
+    }
+
+    // Entries are added when a step ends, so end times are in order. micros() wraps
+    // every 71 minutes, which is detected when an end time goes backwards.
+    uint64_t wrapOffset = 0;
+    uint32_t lastEnd = 0;
+
+    fprintf(outFile, "{\"traceEvents\":[\n");
+    for(size_t ii = 0; ii < entries.size(); ii++) {
+        const CircularBufferTraceEntry &e = entries[ii];
+
+        uint32_t end = e.timestampUs + e.durationUs;
+        if (ii > 0 && end < lastEnd) {
+            wrapOffset += 0x100000000ULL;
+        }
+        lastEnd = end;
+
+        uint64_t ts = wrapOffset + end - e.durationUs;
+
+        fprintf(outFile, "{\"name\":\"%s\",\"cat\":\"flash\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%lu,\"pid\":1,\"tid\":1,"
+            "\"args\":{\"sectorNum\":%lu,\"sequence\":%lu,\"data\":%u}}%s\n",
+            CircularBufferTraceEntry::getEventName(e.event), (unsigned long long)ts, (unsigned long)e.durationUs,
+            (unsigned long)e.sectorNum, (unsigned long)e.sequence, (unsigned)e.data, (ii + 1 < entries.size()) ? "," : "");
+    }
+    fprintf(outFile, "],\"displayTimeUnit\":\"ms\"}\n");
+
+    if (outFile != stdout) {
+        fclose(outFile);
+    }
+    fprintf(stderr, "converted %d entries\n", (int)entries.size());
+
+    return 0;
+}